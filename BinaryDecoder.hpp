@@ -0,0 +1,522 @@
+//
+//  BinaryDecoder.hpp
+//  embeddedRest
+//
+//  MessagePack and CBOR readers emitting the same SAX events as rapidjson's `Reader`,
+//  so bodies encoded with `JsonValueAdapter::toMsgpack`/`toCbor` decode straight into
+//  structs through `JsonDecoder` (or into any rapidjson style SAX handler). Strings are
+//  handed out as pointers into the body - nothing is copied until the value lands in its
+//  field.
+//
+//      City city;
+//      if(BinaryDecoder::decodeMsgpack(response, city)){
+//          ...
+//      }
+//
+
+#pragma once
+
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <cmath>
+
+#include "JsonDecoder.hpp"
+
+/**
+ *  Shared cursor over the input of `MsgpackReader` and `CborReader`.
+ */
+class BinaryReader{
+public:
+    /**
+     *  Containers nested deeper than this are rejected (the readers recurse).
+     */
+    static const int maxDepth=512;
+
+protected:
+    const uint8_t *_begin;
+    const uint8_t *_position;
+    const uint8_t *_end;
+
+    BinaryReader(const char *data,size_t length):
+    _begin(reinterpret_cast<const uint8_t*>(data)),
+    _position(_begin),
+    _end(_begin+length){}
+
+    size_t remaining() const{
+        return size_t(_end-_position);
+    }
+
+    bool readByte(uint8_t &value){
+        if(_position==_end){
+            return false;
+        }
+        value=*_position++;
+        return true;
+    }
+
+    bool readBigEndian(uint64_t &value,int bytes){
+        if(this->remaining()<size_t(bytes)){
+            return false;
+        }
+        value=0;
+        for(auto i=0;i<bytes;++i){
+            value=(value<<8)|*_position++;
+        }
+        return true;
+    }
+
+    bool readFloat(double &value,int bytes){
+        uint64_t bits;
+        if(!this->readBigEndian(bits, bytes)){
+            return false;
+        }
+        if(bytes==4){
+            auto bits32=uint32_t(bits);
+            float single;
+            ::memcpy(&single, &bits32, sizeof(single));
+            value=single;
+        }else{
+            ::memcpy(&value, &bits, sizeof(value));
+        }
+        return true;
+    }
+
+    /**
+     *  `length` bytes of the input in place.
+     */
+    bool take(uint64_t length,const char *&data){
+        if(length>this->remaining() || length>UINT32_MAX){
+            return false;
+        }
+        data=reinterpret_cast<const char*>(_position);
+        _position+=length;
+        return true;
+    }
+
+    template<class Handler>
+    static bool integer(Handler &handler,uint64_t value,bool negative){
+        if(negative){
+            return handler.Int64(int64_t(value));
+        }
+        return value<=uint64_t(INT64_MAX)?handler.Int64(int64_t(value)):handler.Uint64(value);
+    }
+
+    template<class Reader,class Handler>
+    static bool run(Reader &reader,Handler &handler,size_t *errorOffset){
+        auto ok=reader.value(handler, 0);
+        if(ok && reader._position!=reader._end){
+            //  trailing garbage..
+            ok=false;
+        }
+        if(!ok && errorOffset){
+            *errorOffset=size_t(reader._position-reader._begin);
+        }
+        return ok;
+    }
+};
+
+class MsgpackReader:public BinaryReader{
+public:
+
+    /**
+     *  Feeds `handler` (rapidjson SAX interface) with events of the single value in `data`.
+     *  Returns false on malformed input, map keys which aren't strings, extension types, or
+     *  if handler returned false. `bin` values are reported as strings.
+     */
+    template<class Handler>
+    static bool parse(const char *data,size_t length,Handler &handler,size_t *errorOffset=nullptr){
+        MsgpackReader reader(data, length);
+        return run(reader, handler, errorOffset);
+    }
+
+protected:
+    friend class BinaryReader;
+
+    MsgpackReader(const char *data,size_t length):BinaryReader(data, length){}
+
+    template<class Handler>
+    bool value(Handler &handler,int depth){
+        uint8_t marker;
+        if(!this->readByte(marker)){
+            return false;
+        }
+        uint64_t argument=0;
+        if(marker<=0x7f){
+            return handler.Int64(marker);
+        }else if(marker>=0xe0){
+            return handler.Int64(int8_t(marker));
+        }else if((marker&0xe0)==0xa0){
+            return this->string(handler, marker&0x1f);
+        }else if((marker&0xf0)==0x90){
+            return this->array(handler, marker&0x0f, depth);
+        }else if((marker&0xf0)==0x80){
+            return this->map(handler, marker&0x0f, depth);
+        }
+        switch(marker){
+            case 0xc0:
+                return handler.Null();
+            case 0xc2:
+                return handler.Bool(false);
+            case 0xc3:
+                return handler.Bool(true);
+            case 0xc4:
+            case 0xd9:
+                return this->readBigEndian(argument, 1) && this->string(handler, argument);
+            case 0xc5:
+            case 0xda:
+                return this->readBigEndian(argument, 2) && this->string(handler, argument);
+            case 0xc6:
+            case 0xdb:
+                return this->readBigEndian(argument, 4) && this->string(handler, argument);
+            case 0xca:
+            case 0xcb:{
+                double number;
+                return this->readFloat(number, marker==0xca?4:8) && handler.Double(number);
+            }
+            case 0xcc:
+            case 0xcd:
+            case 0xce:
+            case 0xcf:
+                return this->readBigEndian(argument, 1<<(marker-0xcc)) && integer(handler, argument, false);
+            case 0xd0:
+            case 0xd1:
+            case 0xd2:
+            case 0xd3:{
+                const auto bytes=1<<(marker-0xd0);
+                if(!this->readBigEndian(argument, bytes)){
+                    return false;
+                }
+                //  sign extension..
+                const auto shift=64-8*bytes;
+                return handler.Int64(int64_t(argument<<shift)>>shift);
+            }
+            case 0xdc:
+                return this->readBigEndian(argument, 2) && this->array(handler, argument, depth);
+            case 0xdd:
+                return this->readBigEndian(argument, 4) && this->array(handler, argument, depth);
+            case 0xde:
+                return this->readBigEndian(argument, 2) && this->map(handler, argument, depth);
+            case 0xdf:
+                return this->readBigEndian(argument, 4) && this->map(handler, argument, depth);
+            default:
+                //  0xc1 (never used) and extension types..
+                return false;
+        }
+    }
+
+    template<class Handler>
+    bool string(Handler &handler,uint64_t length){
+        const char *data;
+        return this->take(length, data) && handler.String(data, rapidjson::SizeType(length), false);
+    }
+
+    template<class Handler>
+    bool array(Handler &handler,uint64_t count,int depth){
+        if(depth>=maxDepth || !handler.StartArray()){
+            return false;
+        }
+        for(uint64_t i=0;i<count;++i){
+            if(!this->value(handler, depth+1)){
+                return false;
+            }
+        }
+        return handler.EndArray(rapidjson::SizeType(count));
+    }
+
+    template<class Handler>
+    bool map(Handler &handler,uint64_t count,int depth){
+        if(depth>=maxDepth || !handler.StartObject()){
+            return false;
+        }
+        for(uint64_t i=0;i<count;++i){
+            if(!this->key(handler) || !this->value(handler, depth+1)){
+                return false;
+            }
+        }
+        return handler.EndObject(rapidjson::SizeType(count));
+    }
+
+    template<class Handler>
+    bool key(Handler &handler){
+        uint8_t marker;
+        if(!this->readByte(marker)){
+            return false;
+        }
+        uint64_t length;
+        if((marker&0xe0)==0xa0){
+            length=marker&0x1f;
+        }else if(marker==0xd9 || marker==0xda || marker==0xdb){
+            if(!this->readBigEndian(length, 1<<(marker-0xd9))){
+                return false;
+            }
+        }else{
+            --_position;
+            return false;
+        }
+        const char *data;
+        return this->take(length, data) && handler.Key(data, rapidjson::SizeType(length), false);
+    }
+};
+
+class CborReader:public BinaryReader{
+public:
+
+    /**
+     *  Feeds `handler` (rapidjson SAX interface) with events of the single data item in
+     *  `data`. Tags are skipped (the tagged item is reported), byte strings are reported as
+     *  strings, `undefined` as null. Indefinite length strings are joined into a copy.
+     *  Returns false on malformed input, map keys which aren't text, or if handler
+     *  returned false.
+     */
+    template<class Handler>
+    static bool parse(const char *data,size_t length,Handler &handler,size_t *errorOffset=nullptr){
+        CborReader reader(data, length);
+        return run(reader, handler, errorOffset);
+    }
+
+protected:
+    friend class BinaryReader;
+
+    static const uint64_t indefinite=UINT64_MAX;
+
+    std::string _scratch;
+
+    CborReader(const char *data,size_t length):BinaryReader(data, length){}
+
+    /**
+     *  Reads initial byte and argument. `argument` is `indefinite` for additional info 31.
+     */
+    bool head(int &majorType,uint8_t &info,uint64_t &argument){
+        uint8_t initial;
+        if(!this->readByte(initial)){
+            return false;
+        }
+        majorType=initial>>5;
+        info=initial&0x1f;
+        if(info<24){
+            argument=info;
+            return true;
+        }
+        switch(info){
+            case 24:
+                return this->readBigEndian(argument, 1);
+            case 25:
+                return this->readBigEndian(argument, 2);
+            case 26:
+                return this->readBigEndian(argument, 4);
+            case 27:
+                return this->readBigEndian(argument, 8);
+            case 31:
+                argument=indefinite;
+                //  indefinite length is for strings and containers only..
+                return (majorType>=2 && majorType<=5) || majorType==7;
+            default:
+                return false;
+        }
+    }
+
+    bool isBreak(){
+        if(_position<_end && *_position==0xff){
+            ++_position;
+            return true;
+        }
+        return false;
+    }
+
+    template<class Handler>
+    bool value(Handler &handler,int depth){
+        int majorType;
+        uint8_t info;
+        uint64_t argument;
+        if(!this->head(majorType, info, argument)){
+            return false;
+        }
+        switch(majorType){
+            case 0:
+                return integer(handler, argument, false);
+            case 1:
+                if(argument>uint64_t(INT64_MAX)){
+                    //  below INT64_MIN..
+                    return handler.Double(-1.0-double(argument));
+                }
+                return integer(handler, uint64_t(-1-int64_t(argument)), true);
+            case 2:
+            case 3:{
+                const char *data;
+                size_t length;
+                if(!this->string(majorType, argument, data, length)){
+                    return false;
+                }
+                return handler.String(data, rapidjson::SizeType(length), data==_scratch.data());
+            }
+            case 4:{
+                if(depth>=maxDepth || !handler.StartArray()){
+                    return false;
+                }
+                uint64_t count=0;
+                for(;argument==indefinite?!this->isBreak():count<argument;++count){
+                    if(!this->value(handler, depth+1)){
+                        return false;
+                    }
+                }
+                return handler.EndArray(rapidjson::SizeType(count));
+            }
+            case 5:{
+                if(depth>=maxDepth || !handler.StartObject()){
+                    return false;
+                }
+                uint64_t count=0;
+                for(;argument==indefinite?!this->isBreak():count<argument;++count){
+                    if(!this->key(handler) || !this->value(handler, depth+1)){
+                        return false;
+                    }
+                }
+                return handler.EndObject(rapidjson::SizeType(count));
+            }
+            case 6:
+                return depth<maxDepth && this->value(handler, depth+1);
+            default:
+                return this->simple(handler, info, argument);
+        }
+    }
+
+    template<class Handler>
+    bool simple(Handler &handler,uint8_t info,uint64_t argument){
+        switch(info){
+            case 20:
+                return handler.Bool(false);
+            case 21:
+                return handler.Bool(true);
+            case 22:
+            case 23:
+                return handler.Null();
+            case 25:
+                return handler.Double(halfToDouble(uint16_t(argument)));
+            case 26:{
+                auto bits=uint32_t(argument);
+                float single;
+                ::memcpy(&single, &bits, sizeof(single));
+                return handler.Double(single);
+            }
+            case 27:{
+                double number;
+                ::memcpy(&number, &argument, sizeof(number));
+                return handler.Double(number);
+            }
+            default:
+                //  unassigned simple values and a stray break..
+                return false;
+        }
+    }
+
+    /**
+     *  Byte or text string after its head: in place if definite, joined into `_scratch`
+     *  if indefinite.
+     */
+    bool string(int majorType,uint64_t argument,const char *&data,size_t &length){
+        if(argument!=indefinite){
+            length=size_t(argument);
+            return this->take(argument, data);
+        }
+        _scratch.clear();
+        while(!this->isBreak()){
+            int chunkType;
+            uint8_t info;
+            uint64_t chunkLength;
+            const char *chunk;
+            if(!this->head(chunkType, info, chunkLength) || chunkType!=majorType || chunkLength==indefinite
+               || !this->take(chunkLength, chunk))
+            {
+                return false;
+            }
+            _scratch.append(chunk, size_t(chunkLength));
+        }
+        data=_scratch.data();
+        length=_scratch.length();
+        return length<=UINT32_MAX;
+    }
+
+    template<class Handler>
+    bool key(Handler &handler){
+        int majorType;
+        uint8_t info;
+        uint64_t argument;
+        const char *data;
+        size_t length;
+        if(!this->head(majorType, info, argument) || majorType!=3 || !this->string(majorType, argument, data, length)){
+            return false;
+        }
+        return handler.Key(data, rapidjson::SizeType(length), data==_scratch.data());
+    }
+
+    static double halfToDouble(uint16_t half){
+        const auto exponent=(half>>10)&0x1f;
+        const auto mantissa=half&0x3ff;
+        double res;
+        if(exponent==0){
+            res=std::ldexp(mantissa, -24);
+        }else if(exponent!=31){
+            res=std::ldexp(mantissa+1024, exponent-25);
+        }else{
+            res=mantissa?NAN:INFINITY;
+        }
+        return (half&0x8000)?-res:res;
+    }
+};
+
+/**
+ *  `JsonDecoder` fed from MessagePack or CBOR instead of JSON text. Same types and the
+ *  same rules (unknown keys skipped, mismatching types fail).
+ */
+class BinaryDecoder{
+public:
+    template<class T>
+    static bool decodeMsgpack(const char *data,size_t length,T &value,size_t *errorOffset=nullptr){
+        return decode<MsgpackReader>(data, length, value, errorOffset);
+    }
+
+    template<class T>
+    static bool decodeMsgpack(const std::string &body,T &value,size_t *errorOffset=nullptr){
+        return decodeMsgpack(body.data(), body.length(), value, errorOffset);
+    }
+
+    template<class T>
+    static bool decodeMsgpack(const Response &response,T &value,size_t *errorOffset=nullptr){
+        return decodeMsgpack(response.bodyData(), response.bodySize(), value, errorOffset);
+    }
+
+    template<class T>
+    static bool decodeCbor(const char *data,size_t length,T &value,size_t *errorOffset=nullptr){
+        return decode<CborReader>(data, length, value, errorOffset);
+    }
+
+    template<class T>
+    static bool decodeCbor(const std::string &body,T &value,size_t *errorOffset=nullptr){
+        return decodeCbor(body.data(), body.length(), value, errorOffset);
+    }
+
+    template<class T>
+    static bool decodeCbor(const Response &response,T &value,size_t *errorOffset=nullptr){
+        return decodeCbor(response.bodyData(), response.bodySize(), value, errorOffset);
+    }
+
+protected:
+    template<class Reader,class T>
+    static bool decode(const char *data,size_t length,T &value,size_t *errorOffset){
+        JsonDecoder decoder;
+        decoder.push(std::unique_ptr<JsonDecoder::Frame>(new RootFrame<T>(value)));
+        return Reader::parse(data, length, decoder, errorOffset);
+    }
+
+    template<class T>
+    struct RootFrame:JsonDecoder::Frame{
+        T &target;
+
+        RootFrame(T &target_):target(target_){}
+
+        bool value(JsonDecoder &decoder,const JsonEvent &event) override{
+            return JsonValueDecoder<T>::decode(decoder, event, this->target);
+        }
+    };
+};
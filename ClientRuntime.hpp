@@ -0,0 +1,555 @@
+//
+//  ClientRuntime.hpp
+//  embeddedRest
+//
+//  Sharded executor for requests: one worker thread (shard) per core, optionally pinned,
+//  each with its own queues, TLS connection pool, transport and io_uring ring, so shards
+//  don't contend on shared locks. Submissions are spread over the shards, idle shards
+//  steal queued work from busy ones through lock-free queues.
+//
+//      ClientRuntime runtime;
+//      auto response=runtime.submit(UrlRequest("api.local", "/users"));
+//      ...
+//      std::cout<<response.get().body()<<std::endl;
+//
+
+#pragma once
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <exception>
+#include <iostream>
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <cstdint>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "UrlRequest.hpp"
+
+/**
+ *  Bounded multi-producer multi-consumer queue (Dmitry Vyukov's): one CAS per push or
+ *  pop, no locks. Capacity is rounded up to a power of two.
+ */
+template<class T>
+class BoundedQueue{
+public:
+    explicit BoundedQueue(size_t capacity):
+    _mask(roundUp(capacity)-1),
+    _cells(new Cell[_mask+1])
+    {
+        for(size_t i=0;i<=_mask;++i){
+            _cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     *  Returns false if the queue is full.
+     */
+    bool push(T *item){
+        auto position=_pushPosition.load(std::memory_order_relaxed);
+        Cell *cell;
+        while(true){
+            cell=&_cells[position&_mask];
+            auto sequence=cell->sequence.load(std::memory_order_acquire);
+            auto difference=intptr_t(sequence)-intptr_t(position);
+            if(difference==0){
+                if(_pushPosition.compare_exchange_weak(position, position+1, std::memory_order_relaxed)){
+                    break;
+                }
+            }else if(difference<0){
+                return false;
+            }else{
+                position=_pushPosition.load(std::memory_order_relaxed);
+            }
+        }
+        cell->item=item;
+        cell->sequence.store(position+1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     *  nullptr if the queue is empty.
+     */
+    T* pop(){
+        auto position=_popPosition.load(std::memory_order_relaxed);
+        Cell *cell;
+        while(true){
+            cell=&_cells[position&_mask];
+            auto sequence=cell->sequence.load(std::memory_order_acquire);
+            auto difference=intptr_t(sequence)-intptr_t(position+1);
+            if(difference==0){
+                if(_popPosition.compare_exchange_weak(position, position+1, std::memory_order_relaxed)){
+                    break;
+                }
+            }else if(difference<0){
+                return nullptr;
+            }else{
+                position=_popPosition.load(std::memory_order_relaxed);
+            }
+        }
+        auto res=cell->item;
+        cell->sequence.store(position+_mask+1, std::memory_order_release);
+        return res;
+    }
+
+    bool empty() const{
+        return _pushPosition.load(std::memory_order_acquire)==_popPosition.load(std::memory_order_acquire);
+    }
+
+protected:
+    struct Cell{
+        std::atomic<size_t> sequence;
+        T *item=nullptr;
+    };
+
+    const size_t _mask;
+    std::unique_ptr<Cell[]> _cells;
+    char _padding[64];
+    std::atomic<size_t> _pushPosition{0};
+    char _positionsPadding[64];
+    std::atomic<size_t> _popPosition{0};
+
+    static size_t roundUp(size_t value){
+        size_t res=2;
+        while(res<value){
+            res<<=1;
+        }
+        return res;
+    }
+};
+
+/**
+ *  Chase-Lev work stealing deque (the C11 formulation by Lê et al.) of fixed capacity:
+ *  the owner pushes and pops at the bottom, thieves steal from the top.
+ */
+template<class T>
+class WorkStealingDeque{
+public:
+    explicit WorkStealingDeque(size_t capacity):
+    _mask(roundUp(capacity)-1),
+    _items(new std::atomic<T*>[_mask+1]){}
+
+    /**
+     *  Owner only. Returns false if the deque is full.
+     */
+    bool push(T *item){
+        auto bottom=_bottom.load(std::memory_order_relaxed);
+        auto top=_top.load(std::memory_order_acquire);
+        if(bottom-top>int64_t(_mask)){
+            return false;
+        }
+        _items[size_t(bottom)&_mask].store(item, std::memory_order_relaxed);
+        _bottom.store(bottom+1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     *  Owner only, newest item first. nullptr if empty.
+     */
+    T* pop(){
+        auto bottom=_bottom.load(std::memory_order_relaxed)-1;
+        _bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto top=_top.load(std::memory_order_relaxed);
+        if(top>bottom){
+            _bottom.store(bottom+1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        auto res=_items[size_t(bottom)&_mask].load(std::memory_order_relaxed);
+        if(top==bottom){
+            //  last item, race thieves for it..
+            if(!_top.compare_exchange_strong(top, top+1, std::memory_order_seq_cst, std::memory_order_relaxed)){
+                res=nullptr;
+            }
+            _bottom.store(bottom+1, std::memory_order_relaxed);
+        }
+        return res;
+    }
+
+    /**
+     *  Any thread, oldest item first. nullptr if empty or another thread won the item.
+     */
+    T* steal(){
+        auto top=_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto bottom=_bottom.load(std::memory_order_acquire);
+        if(top>=bottom){
+            return nullptr;
+        }
+        auto res=_items[size_t(top)&_mask].load(std::memory_order_relaxed);
+        if(!_top.compare_exchange_strong(top, top+1, std::memory_order_seq_cst, std::memory_order_relaxed)){
+            return nullptr;
+        }
+        return res;
+    }
+
+    bool empty() const{
+        return _bottom.load(std::memory_order_acquire)<=_top.load(std::memory_order_acquire);
+    }
+
+protected:
+    const size_t _mask;
+    std::unique_ptr<std::atomic<T*>[]> _items;
+    char _padding[64];
+    std::atomic<int64_t> _top{0};
+    char _indicesPadding[64];
+    std::atomic<int64_t> _bottom{0};
+
+    static size_t roundUp(size_t value){
+        size_t res=2;
+        while(res<value){
+            res<<=1;
+        }
+        return res;
+    }
+};
+
+class ClientRuntime{
+public:
+    struct Options{
+
+        /**
+         *  Worker threads. Requests block the shard performing them, so I/O bound loads
+         *  benefit from more shards than cores.
+         */
+        size_t shards=std::max(std::thread::hardware_concurrency(), 1u);
+
+        /**
+         *  Pin shard `i` to CPU `i % cores` (Linux only).
+         */
+        bool pinThreads=false;
+
+        /**
+         *  Capacity of each shard's submission queue and local deque.
+         */
+        size_t queueCapacity=64*1024;
+
+        /**
+         *  Requests using the default `TlsContext::shared()` get a context of the shard
+         *  instead, so idle TLS connections and sessions are pooled per shard.
+         */
+        bool perShardTls=true;
+
+        /**
+         *  Creates the transport of shard `i` which replaces the transport of every request
+         *  it performs. Not set - requests keep their own.
+         */
+        std::function<std::shared_ptr<Transport>(size_t)> transportFactory;
+    };
+
+    struct Stats{
+        uint64_t executed=0;    //  tasks run by the shard
+        uint64_t stolen=0;      //  of them taken from other shards
+    };
+
+    ClientRuntime():ClientRuntime(Options()){}
+
+    ClientRuntime(Options options):_options(std::move(options)){
+        _options.shards=std::max(_options.shards, size_t(1));
+        for(size_t i=0;i<_options.shards;++i){
+            _shards.emplace_back(new Shard(i, _options.queueCapacity));
+            _shards.back()->runtime=this;
+#ifdef EMBEDDED_REST_TLS
+            if(_options.perShardTls){
+                _shards.back()->tls=std::make_shared<TlsContext>();
+            }
+#endif
+            if(_options.transportFactory){
+                _shards.back()->transport=_options.transportFactory(i);
+            }
+        }
+        for(auto &shard:_shards){
+            shard->thread=std::thread(&ClientRuntime::work, this, shard.get());
+        }
+    }
+
+    ClientRuntime(const ClientRuntime&)=delete;
+    ClientRuntime& operator=(const ClientRuntime&)=delete;
+
+    /**
+     *  Runs the work already queued, then joins the shards.
+     */
+    ~ClientRuntime(){
+        _stopping.store(true);
+        for(auto &shard:_shards){
+            this->wake(*shard, true);
+        }
+        for(auto &shard:_shards){
+            if(shard->thread.joinable()){
+                shard->thread.join();
+            }
+        }
+    }
+
+    /**
+     *  Queues `task`. From a shard thread it goes to the shard's own deque (others may
+     *  steal it), from any other thread to the shards round robin. If every queue is full
+     *  the calling thread waits for space (a shard runs `task` itself). `task` must not throw.
+     */
+    void post(std::function<void()> task){
+        std::unique_ptr<Task> item(new Task(std::move(task)));
+        auto shard=currentShard();
+        if(shard && shard->runtime==this && shard->deque.push(item.get())){
+            item.release();
+            this->wakeThief();
+            return;
+        }
+        auto &next=nextShard();
+        while(true){
+            for(size_t attempt=0;attempt<_shards.size();++attempt){
+                auto &target=*_shards[next++%_shards.size()];
+                if(target.inbox.push(item.get())){
+                    item.release();
+                    if(!this->wake(target, false)){
+                        //  target is busy, a sleeping shard can take it..
+                        this->wakeThief();
+                    }
+                    return;
+                }
+            }
+            if(shard && shard->runtime==this){
+                //  a shard can't wait for queues only shards drain..
+                item->function();
+                return;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+    /**
+     *  Performs `request` on a shard. The future throws what `perform` throws.
+     */
+    std::future<Response> submit(UrlRequest request){
+        auto promise=std::make_shared<std::promise<Response>>();
+        auto res=promise->get_future();
+        this->post([this,promise,request]() mutable{
+            try{
+                this->prepare(request);
+                promise->set_value(request.perform());
+            }catch(...){
+                promise->set_exception(std::current_exception());
+            }
+        });
+        return res;
+    }
+
+    /**
+     *  Performs `request` on a shard and calls `handler` there with the response.
+     *  Requests failing with an exception (unresolvable host, response without a valid
+     *  status line) are reported to std::cerr, `handler` isn't called for them. Exceptions
+     *  thrown by `handler` are reported the same way - they never reach the shard.
+     */
+    void submit(UrlRequest request,std::function<void(Response&)> handler){
+        this->post([this,request,handler]() mutable{
+            try{
+                this->prepare(request);
+                auto response=request.perform();
+                handler(response);
+            }catch(const UrlRequest::HostIsNullException&){
+                std::cerr<<"host is null"<<std::endl;
+            }catch(const Response::IncorrectStartLineException&){
+                std::cerr<<"incorrect start line"<<std::endl;
+            }catch(const std::exception &exception){
+                std::cerr<<"request failed: "<<exception.what()<<std::endl;
+            }catch(...){
+                std::cerr<<"request failed"<<std::endl;
+            }
+        });
+    }
+
+    size_t shards() const{
+        return _shards.size();
+    }
+
+    std::vector<Stats> stats() const{
+        std::vector<Stats> res;
+        for(const auto &shard:_shards){
+            Stats stats;
+            stats.executed=shard->executed.load(std::memory_order_relaxed);
+            stats.stolen=shard->stolen.load(std::memory_order_relaxed);
+            res.push_back(stats);
+        }
+        return res;
+    }
+
+    /**
+     *  Index of the shard the calling thread is, -1 if it isn't one.
+     */
+    static int currentShardIndex(){
+        auto shard=currentShard();
+        return shard?int(shard->index):-1;
+    }
+
+protected:
+    struct Task{
+        std::function<void()> function;
+
+        Task(std::function<void()> function):function(std::move(function)){}
+    };
+
+    struct Shard{
+        const size_t index;
+        ClientRuntime *runtime=nullptr;
+        BoundedQueue<Task> inbox;
+        WorkStealingDeque<Task> deque;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable condition;
+        std::atomic<bool> sleeping{false};
+        std::atomic<uint64_t> executed{0};
+        std::atomic<uint64_t> stolen{0};
+#ifdef EMBEDDED_REST_TLS
+        std::shared_ptr<TlsContext> tls;
+#endif
+        std::shared_ptr<Transport> transport;
+
+        Shard(size_t index,size_t capacity):
+        index(index),
+        inbox(capacity),
+        deque(capacity){}
+
+        bool idle() const{
+            return this->inbox.empty() && this->deque.empty();
+        }
+    };
+
+    Options _options;
+    std::vector<std::unique_ptr<Shard>> _shards;
+    std::atomic<bool> _stopping{false};
+    std::atomic<int> _sleepers{0};
+
+    static Shard*& currentShard(){
+        static thread_local Shard *res=nullptr;
+        return res;
+    }
+
+    /**
+     *  Round robin position of the submitting thread - no shared counter to contend on.
+     */
+    static size_t& nextShard(){
+        static thread_local size_t res=std::random_device{}();
+        return res;
+    }
+
+    void prepare(UrlRequest &request){
+        auto shard=currentShard();
+        if(!shard){
+            return;
+        }
+#ifdef EMBEDDED_REST_TLS
+        if(shard->tls && request.tls() && request.tls()==TlsContext::shared()){
+            request.tls(shard->tls);
+        }
+#endif
+        if(shard->transport){
+            request.transport(shard->transport);
+        }
+    }
+
+    /**
+     *  Wakes `shard` if it sleeps. Returns false if it was awake (busy or spinning).
+     */
+    bool wake(Shard &shard,bool always){
+        if(!always && !shard.sleeping.load()){
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> lock(shard.mutex);
+        }
+        shard.condition.notify_one();
+        return true;
+    }
+
+    void wakeThief(){
+        if(!_sleepers.load()){
+            return;
+        }
+        for(auto &shard:_shards){
+            if(shard->sleeping.load()){
+                this->wake(*shard, true);
+                return;
+            }
+        }
+    }
+
+    Task* take(Shard &shard){
+        if(auto task=shard.deque.pop()){
+            return task;
+        }
+        if(auto task=shard.inbox.pop()){
+            return task;
+        }
+        //  steal starting from the next shard so thieves spread over victims..
+        for(size_t i=1;i<_shards.size();++i){
+            auto &victim=*_shards[(shard.index+i)%_shards.size()];
+            auto task=victim.deque.steal();
+            if(!task){
+                task=victim.inbox.pop();
+            }
+            if(task){
+                shard.stolen.fetch_add(1, std::memory_order_relaxed);
+                return task;
+            }
+        }
+        return nullptr;
+    }
+
+    bool nothingQueued() const{
+        for(const auto &shard:_shards){
+            if(!shard->idle()){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void work(Shard *shard){
+        currentShard()=shard;
+#if defined(__linux__)
+        if(_options.pinThreads){
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(int(shard->index%std::max(std::thread::hardware_concurrency(), 1u)), &cpus);
+            ::pthread_setaffinity_np(::pthread_self(), sizeof(cpus), &cpus);
+        }
+#endif
+        auto misses=0;
+        while(true){
+            if(auto task=this->take(*shard)){
+                misses=0;
+                std::unique_ptr<Task> owned(task);
+                owned->function();
+                shard->executed.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            if(_stopping.load() && this->nothingQueued()){
+                break;
+            }
+            if(++misses<64){
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(shard->mutex);
+            shard->sleeping.store(true);
+            ++_sleepers;
+            //  re-checked after announcing sleep, so a post either sees us sleeping or we see it..
+            if(this->nothingQueued() && !_stopping.load()){
+                shard->condition.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            --_sleepers;
+            shard->sleeping.store(false);
+            misses=0;
+        }
+        currentShard()=nullptr;
+    }
+};
@@ -0,0 +1,525 @@
+//
+//  DiskCache.hpp
+//  embeddedRest
+//
+//  Persistent on-disk response cache. Bodies are stored one per file and served
+//  with mmap, metadata (headers, validators, freshness) lives in a single binary
+//  index file which is loaded on construction so a warm start serves fresh
+//  entries without touching the network. POSIX only.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <memory>
+#include <fstream>
+#include <sstream>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cstring>
+#include <atomic>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "Response.hpp"
+
+class DiskCache{
+public:
+    /**
+     *  Cached response metadata. Body is kept in a separate file inside cache directory.
+     */
+    struct Entry{
+        std::string key;
+        int statusCode=200;
+        std::string statusDescription;
+        std::vector<std::string> headers;
+        std::string etag;
+        std::string lastModified;
+        int64_t storedAt=0;
+        int64_t expiresAt=0;
+        int64_t lastAccess=0;
+        uint64_t bodySize=0;
+        
+        bool isFresh(int64_t now) const{
+            return now<this->expiresAt;
+        }
+        
+        bool hasValidators() const{
+            return this->etag.length() || this->lastModified.length();
+        }
+        
+        /**
+         *  Size of body file on disk: body prefixed with the key.
+         */
+        uint64_t fileSize() const{
+            return sizeof(uint32_t)+this->key.length()+this->bodySize;
+        }
+    };
+    
+    /**
+     *  Read-only memory-mapped body file. The file starts with the key it was stored
+     *  for (u32 length + bytes) so two keys sharing a file name are told apart.
+     */
+    struct MappedBody:Response::ExternalBody{
+        
+        static uint64_t fileHeaderSize(const std::string &key){
+            return sizeof(uint32_t)+key.length();
+        }
+        
+        static std::shared_ptr<MappedBody> open(const std::string &filepath,const std::string &key,size_t expectedSize){
+            auto fd=::open(filepath.c_str(), O_RDONLY);
+            if(fd<0){
+                return {};
+            }
+            auto headerSize=size_t(fileHeaderSize(key));
+            struct stat st;
+            if(::fstat(fd, &st)!=0 || size_t(st.st_size)!=headerSize+expectedSize){
+                ::close(fd);
+                return {};
+            }
+            auto address=::mmap(nullptr, headerSize+expectedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+            ::close(fd);
+            if(address==MAP_FAILED){
+                return {};
+            }
+            std::shared_ptr<MappedBody> res(new MappedBody);
+            res->address=address;
+            res->mappedLength=headerSize+expectedSize;
+            res->offset=headerSize;
+            uint32_t keyLength;
+            ::memcpy(&keyLength, address, sizeof(keyLength));
+            if(keyLength!=key.length() || ::memcmp((const char*)address+sizeof(keyLength), key.data(), key.length())!=0){
+                return {};
+            }
+            return res;
+        }
+        
+        ~MappedBody(){
+            if(this->address){
+                ::munmap(this->address, this->mappedLength);
+            }
+        }
+        
+        const char* data() const override{
+            return (const char*)this->address+this->offset;
+        }
+        
+        size_t size() const override{
+            return this->mappedLength-this->offset;
+        }
+    
+    protected:
+        void *address=nullptr;
+        size_t mappedLength=0;
+        size_t offset=0;
+        
+        MappedBody(){}
+    };
+    
+    /**
+     *  Freshness lifetime in seconds for responses which have validators but
+     *  no `Cache-Control: max-age`/`Expires`. 0 means revalidate every time.
+     */
+    int64_t defaultTtl=0;
+    
+    DiskCache(std::string directory,uint64_t maxSize=256*1024*1024):
+    _directory(std::move(directory)),
+    _maxSize(maxSize)
+    {
+        if(_directory.length() && _directory.back()!='/'){
+            _directory+='/';
+        }
+        ::mkdir(_directory.c_str(), 0755);
+        std::lock_guard<std::mutex> lock(_mutex);
+        this->loadIndex();
+        if(this->evictIfNeeded()){
+            this->saveIndex();
+        }
+    }
+    
+    DiskCache(const DiskCache&)=delete;
+    DiskCache& operator=(const DiskCache&)=delete;
+    
+    ~DiskCache(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_indexDirty){
+            this->saveIndex();
+        }
+    }
+    
+    /**
+     *  Finds entry by key. Returns false on miss. Updates LRU position on hit.
+     */
+    bool lookup(const std::string &key,Entry &entry){
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it=_entries.find(key);
+        if(it==_entries.end()){
+            return false;
+        }
+        it->second.lastAccess=now();
+        _indexDirty=true;
+        entry=it->second;
+        return true;
+    }
+    
+    /**
+     *  Builds a response for cached entry with body mapped into memory. Returns
+     *  false if body file is missing or damaged (entry gets removed then).
+     */
+    bool makeResponse(const Entry &entry,std::shared_ptr<Response> &response){
+        auto body=MappedBody::open(this->bodyFilePath(entry.key), entry.key, size_t(entry.bodySize));
+        if(!body){
+            this->remove(entry.key);
+            return false;
+        }
+        response=std::make_shared<Response>(entry.statusCode,
+                                            entry.statusDescription,
+                                            entry.headers,
+                                            std::move(body));
+        return true;
+    }
+    
+    /**
+     *  Stores response if it is cacheable (200 without `no-store`/`private`/`Vary`, with
+     *  either freshness information or validators and a body that fits `maxSize` and
+     *  matches `Content-Length`). Returns true if it was stored.
+     */
+    bool store(const std::string &key,const Response &response){
+        if(response.statusCode()!=200){
+            return false;
+        }
+        //  cut short..
+        auto contentLength=response.header("Content-Length");
+        if(contentLength.length() && ::strtoull(contentLength.c_str(), nullptr, 10)!=response.bodySize()){
+            return false;
+        }
+        //  would evict everything including itself..
+        if(MappedBody::fileHeaderSize(key)+response.bodySize()>_maxSize){
+            return false;
+        }
+        Entry entry;
+        if(!this->fillEntry(key, response, entry)){
+            return false;
+        }
+        auto bodyPath=this->bodyFilePath(key);
+        auto tempPath=bodyPath+".tmp"+std::to_string(++this->tempCounter());
+        {
+            std::ofstream file(tempPath, std::ios::binary|std::ios::trunc);
+            if(!file){
+                return false;
+            }
+            auto keyLength=uint32_t(key.length());
+            file.write((const char*)&keyLength, sizeof(keyLength));
+            file.write(key.data(), std::streamsize(key.length()));
+            file.write(response.bodyData(), std::streamsize(response.bodySize()));
+            if(!file){
+                ::unlink(tempPath.c_str());
+                return false;
+            }
+        }
+        //  rename keeps previous body alive for responses which still map it..
+        if(::rename(tempPath.c_str(), bodyPath.c_str())!=0){
+            ::unlink(tempPath.c_str());
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _entries[key]=std::move(entry);
+        this->evictIfNeeded();
+        this->saveIndex();
+        return true;
+    }
+    
+    /**
+     *  Refreshes freshness information of stored entry after `304 Not Modified`.
+     */
+    void revalidated(const std::string &key,const Response &notModifiedResponse){
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it=_entries.find(key);
+        if(it==_entries.end()){
+            return;
+        }
+        auto &entry=it->second;
+        auto currentTime=now();
+        auto etag=notModifiedResponse.header("ETag");
+        if(etag.length()){
+            entry.etag=std::move(etag);
+        }
+        auto lastModified=notModifiedResponse.header("Last-Modified");
+        if(lastModified.length()){
+            entry.lastModified=std::move(lastModified);
+        }
+        entry.storedAt=currentTime;
+        entry.expiresAt=currentTime+this->freshnessLifetime(notModifiedResponse);
+        entry.lastAccess=currentTime;
+        this->saveIndex();
+    }
+    
+    void remove(const std::string &key){
+        std::lock_guard<std::mutex> lock(_mutex);
+        if(_entries.erase(key)){
+            ::unlink(this->bodyFilePath(key).c_str());
+            this->saveIndex();
+        }
+    }
+    
+    uint64_t totalSize() const{
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint64_t res=0;
+        for(const auto &p:_entries){
+            res+=p.second.fileSize();
+        }
+        return res;
+    }
+    
+    size_t count() const{
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _entries.size();
+    }
+    
+    const std::string& directory() const{
+        return _directory;
+    }
+    
+    static int64_t now(){
+        return int64_t(::time(nullptr));
+    }
+
+protected:
+    std::string _directory;
+    uint64_t _maxSize;
+    std::map<std::string,Entry> _entries;
+    bool _indexDirty=false;
+    mutable std::mutex _mutex;
+    
+    static std::atomic<unsigned>& tempCounter(){
+        static std::atomic<unsigned> res(0);
+        return res;
+    }
+    
+    static const uint32_t indexMagic=0x43445245;  //  "ERDC"
+    static const uint32_t indexVersion=2;
+    
+    std::string indexFilePath() const{
+        return _directory+"index.bin";
+    }
+    
+    std::string bodyFilePath(const std::string &key) const{
+        //  FNV-1a, body file starts with the full key so `MappedBody::open` rejects a file
+        //  written for a colliding key (it is then dropped as a miss)..
+        uint64_t hash=1469598103934665603ULL;
+        for(auto c:key){
+            hash^=uint64_t((unsigned char)c);
+            hash*=1099511628211ULL;
+        }
+        char name[32];
+        ::snprintf(name, sizeof(name), "%016llx.body", (unsigned long long)hash);
+        return _directory+name;
+    }
+    
+    bool fillEntry(const std::string &key,const Response &response,Entry &entry) const{
+        auto cacheControl=response.header("Cache-Control");
+        if(cacheControl.find("no-store")!=std::string::npos){
+            return false;
+        }
+        //  the cache is shared between requests (and users) and keys don't include
+        //  request headers..
+        if(cacheControl.find("private")!=std::string::npos || response.header("Vary").length()){
+            return false;
+        }
+        auto currentTime=now();
+        entry.key=key;
+        entry.statusCode=response.statusCode();
+        entry.statusDescription=response.statusDescription();
+        entry.headers=response.headers();
+        entry.etag=response.header("ETag");
+        entry.lastModified=response.header("Last-Modified");
+        entry.storedAt=currentTime;
+        entry.expiresAt=currentTime+this->freshnessLifetime(response);
+        entry.lastAccess=currentTime;
+        entry.bodySize=response.bodySize();
+        return entry.expiresAt>currentTime || entry.hasValidators();
+    }
+    
+    int64_t freshnessLifetime(const Response &response) const{
+        auto cacheControl=response.header("Cache-Control");
+        if(cacheControl.find("no-cache")!=std::string::npos){
+            return 0;
+        }
+        auto maxAgePos=cacheControl.find("max-age=");
+        if(maxAgePos!=std::string::npos){
+            auto maxAge=int64_t(::atoll(cacheControl.c_str()+maxAgePos+8));
+            auto age=int64_t(::atoll(response.header("Age").c_str()));
+            return maxAge>age?maxAge-age:0;
+        }
+        auto expires=response.header("Expires");
+        if(expires.length()){
+            struct tm expiresTime;
+            ::memset(&expiresTime, 0, sizeof(expiresTime));
+            if(::strptime(expires.c_str(), "%a, %d %b %Y %H:%M:%S", &expiresTime)){
+                auto expiresAt=int64_t(::timegm(&expiresTime));
+                auto currentTime=now();
+                return expiresAt>currentTime?expiresAt-currentTime:0;
+            }
+            return 0;
+        }
+        return this->defaultTtl;
+    }
+    
+    /**
+     *  Removes least recently used entries until total size fits `_maxSize`.
+     *  Must be called with `_mutex` locked. Returns true if anything was evicted.
+     */
+    bool evictIfNeeded(){
+        uint64_t total=0;
+        for(const auto &p:_entries){
+            total+=p.second.fileSize();
+        }
+        auto evicted=false;
+        while(total>_maxSize && _entries.size()){
+            auto victim=_entries.begin();
+            for(auto it=_entries.begin();it!=_entries.end();++it){
+                if(it->second.lastAccess<victim->second.lastAccess){
+                    victim=it;
+                }
+            }
+            total-=victim->second.fileSize();
+            ::unlink(this->bodyFilePath(victim->first).c_str());
+            _entries.erase(victim);
+            evicted=true;
+        }
+        return evicted;
+    }
+    
+    //  index file format (little endian host order):
+    //  magic u32, version u32, count u32, then `count` records of
+    //  key, status u32, description, headers (u32 count + strings), etag, lastModified,
+    //  storedAt i64, expiresAt i64, lastAccess i64, bodySize u64.
+    //  Strings are u32 length followed by bytes. Body files are the key string
+    //  followed by raw body bytes.
+    
+    template<class T>
+    static void writePod(std::ostream &stream,T value){
+        stream.write((const char*)&value, sizeof(value));
+    }
+    
+    template<class T>
+    static bool readPod(std::istream &stream,T &value){
+        return bool(stream.read((char*)&value, sizeof(value)));
+    }
+    
+    static void writeString(std::ostream &stream,const std::string &value){
+        writePod(stream, uint32_t(value.length()));
+        stream.write(value.data(), std::streamsize(value.length()));
+    }
+    
+    static bool readString(std::istream &stream,std::string &value){
+        uint32_t length;
+        if(!readPod(stream, length)){
+            return false;
+        }
+        value.resize(length);
+        return length==0 || bool(stream.read(&value[0], length));
+    }
+    
+    /**
+     *  Must be called with `_mutex` locked.
+     */
+    void saveIndex(){
+        auto path=this->indexFilePath();
+        auto tempPath=path+".tmp";
+        {
+            std::ofstream stream(tempPath, std::ios::binary|std::ios::trunc);
+            if(!stream){
+                return;
+            }
+            writePod(stream, indexMagic);
+            writePod(stream, indexVersion);
+            writePod(stream, uint32_t(_entries.size()));
+            for(const auto &p:_entries){
+                const auto &entry=p.second;
+                writeString(stream, entry.key);
+                writePod(stream, int32_t(entry.statusCode));
+                writeString(stream, entry.statusDescription);
+                writePod(stream, uint32_t(entry.headers.size()));
+                for(const auto &header:entry.headers){
+                    writeString(stream, header);
+                }
+                writeString(stream, entry.etag);
+                writeString(stream, entry.lastModified);
+                writePod(stream, entry.storedAt);
+                writePod(stream, entry.expiresAt);
+                writePod(stream, entry.lastAccess);
+                writePod(stream, entry.bodySize);
+            }
+            if(!stream){
+                return;
+            }
+        }
+        if(::rename(tempPath.c_str(), path.c_str())==0){
+            _indexDirty=false;
+        }
+    }
+    
+    /**
+     *  Must be called with `_mutex` locked. Damaged index is treated as empty one.
+     */
+    void loadIndex(){
+        std::ifstream stream(this->indexFilePath(), std::ios::binary);
+        if(!stream){
+            return;
+        }
+        uint32_t magic=0,version=0,count=0;
+        if(!readPod(stream, magic) || magic!=indexMagic){
+            return;
+        }
+        if(!readPod(stream, version) || version!=indexVersion){
+            return;
+        }
+        if(!readPod(stream, count)){
+            return;
+        }
+        for(uint32_t i=0;i<count;++i){
+            Entry entry;
+            int32_t statusCode;
+            uint32_t headersCount;
+            if(!readString(stream, entry.key)
+               || !readPod(stream, statusCode)
+               || !readString(stream, entry.statusDescription)
+               || !readPod(stream, headersCount)){
+                break;
+            }
+            entry.statusCode=statusCode;
+            entry.headers.resize(headersCount);
+            auto headersRead=true;
+            for(auto &header:entry.headers){
+                if(!readString(stream, header)){
+                    headersRead=false;
+                    break;
+                }
+            }
+            if(!headersRead
+               || !readString(stream, entry.etag)
+               || !readString(stream, entry.lastModified)
+               || !readPod(stream, entry.storedAt)
+               || !readPod(stream, entry.expiresAt)
+               || !readPod(stream, entry.lastAccess)
+               || !readPod(stream, entry.bodySize)){
+                break;
+            }
+            struct stat st;
+            auto bodyPath=this->bodyFilePath(entry.key);
+            if(::stat(bodyPath.c_str(), &st)==0 && uint64_t(st.st_size)==entry.fileSize()){
+                auto key=entry.key;
+                _entries[key]=std::move(entry);
+            }
+        }
+    }
+};
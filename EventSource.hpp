@@ -0,0 +1,388 @@
+//
+//  EventSource.hpp
+//  embeddedRest
+//
+//  Server-Sent Events client. Keeps a `text/event-stream` response open, parses it as
+//  bytes arrive and dispatches every event as soon as its terminating blank line is
+//  received. Reconnects with `Last-Event-ID` when the stream ends or goes silent for
+//  longer than `idleTimeout` (servers send comment lines as heartbeats).
+//
+//      UrlRequest request;
+//      request.host("feeds.local").uri("/prices");
+//      EventSource source(request, [](const EventSource::Event &event){
+//          std::cout<<event.type<<": "<<event.data<<std::endl;
+//          return true;
+//      });
+//      source.run();     //  until stop() is called from another thread
+//
+
+#pragma once
+
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cctype>
+#include <algorithm>
+
+#include "UrlRequest.hpp"
+
+/**
+ *  Incremental `text/event-stream` parser (WHATWG HTML, server-sent events section).
+ */
+class EventStreamParser{
+public:
+    struct Event{
+        std::string type;   //  "message" unless `event:` field is set
+        std::string data;   //  `data:` lines joined with '\n'
+        std::string id;     //  last event id at the time of dispatch
+    };
+
+    /**
+     *  Return false to stop the stream.
+     */
+    typedef std::function<bool(const Event &event)> EventHandler;
+
+    EventStreamParser(EventHandler handler):_handler(std::move(handler)){}
+
+    /**
+     *  Parses next piece of the stream dispatching complete events. Returns false if
+     *  handler stopped the stream.
+     */
+    bool feed(const char *data,size_t length){
+        const auto end=data+length;
+        auto position=data;
+        if(_bomPending){
+            while(position<end && _bomMatched<3){
+                if((unsigned char)*position!=bom()[_bomMatched]){
+                    break;
+                }
+                ++position;
+                ++_bomMatched;
+            }
+            if(_bomMatched==3 || position<end){
+                _bomPending=false;
+                if(_bomMatched<3 && _bomMatched>0){
+                    //  not a BOM after all..
+                    _line.assign((const char*)bom(), _bomMatched);
+                }
+            }else{
+                return true;
+            }
+        }
+        while(position<end){
+            if(_skipLineFeed){
+                _skipLineFeed=false;
+                if(*position=='\n'){
+                    ++position;
+                    continue;
+                }
+            }
+            auto lineEnd=position;
+            while(lineEnd<end && *lineEnd!='\n' && *lineEnd!='\r'){
+                ++lineEnd;
+            }
+            if(lineEnd==end){
+                _line.append(position, size_t(end-position));
+                break;
+            }
+            auto ok=true;
+            if(_line.length()){
+                _line.append(position, size_t(lineEnd-position));
+                ok=this->onLine(_line.data(), _line.length());
+                _line.clear();
+            }else{
+                ok=this->onLine(position, size_t(lineEnd-position));
+            }
+            _skipLineFeed=(*lineEnd=='\r');
+            position=lineEnd+1;
+            if(!ok){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     *  `Last-Event-ID` to send on reconnect.
+     */
+    const std::string& lastEventId() const{
+        return _lastEventId;
+    }
+
+    void lastEventId(std::string value){
+        _lastEventId=std::move(value);
+        _eventId=_lastEventId;
+    }
+
+    /**
+     *  Reconnection time the server set with `retry:`, -1 if it didn't.
+     */
+    long retry() const{
+        return _retry;
+    }
+
+    /**
+     *  Comment lines received - servers send them as heartbeats.
+     */
+    uint64_t comments() const{
+        return _comments;
+    }
+
+    /**
+     *  Drops a partially received event - the stream it came from has ended.
+     */
+    void reset(){
+        _line.clear();
+        _event.data.clear();
+        _event.type.clear();
+        _hasData=false;
+        _eventId=_lastEventId;
+        _skipLineFeed=false;
+        _bomPending=true;
+        _bomMatched=0;
+    }
+
+protected:
+    EventHandler _handler;
+    Event _event;
+    bool _hasData=false;
+    std::string _line;
+    std::string _eventId;       //  `id:` of the event being received
+    std::string _lastEventId;
+    long _retry=-1;
+    uint64_t _comments=0;
+    bool _skipLineFeed=false;
+    bool _bomPending=true;
+    size_t _bomMatched=0;
+
+    static const unsigned char* bom(){
+        static const unsigned char res[]={0xef, 0xbb, 0xbf};
+        return res;
+    }
+
+    bool onLine(const char *line,size_t length){
+        if(!length){
+            return this->dispatch();
+        }
+        if(*line==':'){
+            ++_comments;
+            return true;
+        }
+        auto colon=(const char*)::memchr(line, ':', length);
+        auto nameLength=colon?size_t(colon-line):length;
+        auto value=colon?colon+1:line+length;
+        auto valueLength=length-(value-line);
+        if(valueLength && *value==' '){
+            ++value;
+            --valueLength;
+        }
+        if(fieldIs(line, nameLength, "data")){
+            if(_hasData){
+                _event.data+='\n';
+            }
+            _event.data.append(value, valueLength);
+            _hasData=true;
+        }else if(fieldIs(line, nameLength, "event")){
+            _event.type.assign(value, valueLength);
+        }else if(fieldIs(line, nameLength, "id")){
+            if(!::memchr(value, 0, valueLength)){
+                _eventId.assign(value, valueLength);
+            }
+        }else if(fieldIs(line, nameLength, "retry")){
+            auto digits=valueLength>0;
+            for(size_t i=0;i<valueLength;++i){
+                digits=digits && value[i]>='0' && value[i]<='9';
+            }
+            if(digits){
+                _retry=std::strtol(std::string(value, valueLength).c_str(), nullptr, 10);
+            }
+        }
+        return true;
+    }
+
+    bool dispatch(){
+        //  the id becomes the reconnect id only once its event is complete..
+        _lastEventId=_eventId;
+        if(!_hasData){
+            _event.type.clear();
+            return true;
+        }
+        if(_event.type.empty()){
+            _event.type="message";
+        }
+        _event.id=_lastEventId;
+        auto res=_handler(_event);
+        _event.data.clear();
+        _event.type.clear();
+        _hasData=false;
+        return res;
+    }
+
+    static bool fieldIs(const char *name,size_t length,const char *field){
+        return length==::strlen(field) && ::memcmp(name, field, length)==0;
+    }
+};
+
+class EventSource{
+public:
+    typedef EventStreamParser::Event Event;
+    typedef EventStreamParser::EventHandler EventHandler;
+
+    /**
+     *  Delay before reconnecting unless the server set one with `retry:`.
+     */
+    std::chrono::milliseconds retry{3000};
+
+    /**
+     *  Stream without a single byte (event or heartbeat comment) for this long is
+     *  considered dead and reconnected. Replaces `UrlRequest::timeout` of the request.
+     */
+    std::chrono::seconds idleTimeout{45};
+
+    /**
+     *  Reconnects in a row without receiving an event before `run` gives up, -1 - never.
+     */
+    int maxReconnects=-1;
+
+    EventSource(UrlRequest request,EventHandler handler):
+    _request(std::move(request)),
+    _handler(std::move(handler)),
+    _parser([this](const Event &event){
+        _eventReceived=true;
+        return _handler(event);
+    }){}
+
+    EventSource(const EventSource&)=delete;
+    EventSource& operator=(const EventSource&)=delete;
+
+    /**
+     *  Streams events until `stop` is called, the handler returns false, the server
+     *  answers with something other than a `text/event-stream` 200 which isn't worth
+     *  retrying (anything but 408, 429 and 5xx), or `maxReconnects` is exceeded. Dropped
+     *  connections and unresolvable hosts are reconnected. Returns the last response head.
+     */
+    Response run(){
+        auto failedInRow=0;
+        while(true){
+            auto request=_request;
+            request.timeout.tv_sec=long(this->idleTimeout.count());
+            request.timeout.tv_usec=0;
+            request.addHeader("Accept: text/event-stream");
+            request.addHeader("Cache-Control: no-cache");
+            if(_parser.lastEventId().length()){
+                request.addHeader("Last-Event-ID: "+_parser.lastEventId());
+            }
+            auto cancelToken=std::make_shared<RetryPolicy::CancelToken>();
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if(_stopped){
+                    return _lastResponse;
+                }
+                _cancelToken=cancelToken;
+            }
+            request.cancelToken(cancelToken);
+            _parser.reset();
+            _eventReceived=false;
+            auto handlerStopped=false;
+            auto accepted=false;
+            Response response(0, std::string(), std::string());
+            try{
+                response=request.performStreaming([this,&handlerStopped](const char *data,size_t length){
+                    handlerStopped=!_parser.feed(data, length);
+                    return !handlerStopped;
+                },[&accepted](const Response &head){
+                    accepted=(head.statusCode()==200 && isEventStream(head.header("Content-Type")));
+                    return accepted;
+                });
+            }catch(const Response::IncorrectStartLineException&){
+                //  closed before status line - retried like any dropped connection..
+            }catch(const UrlRequest::HostIsNullException&){
+                //  resolver failures are usually transient too..
+            }
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _cancelToken.reset();
+                _lastResponse=response;
+                if(_stopped || handlerStopped){
+                    return response;
+                }
+            }
+            const auto statusCode=response.statusCode();
+            if(!accepted && statusCode && statusCode!=408 && statusCode!=429 && statusCode<500){
+                return response;
+            }
+            failedInRow=_eventReceived?0:failedInRow+1;
+            if(this->maxReconnects>=0 && failedInRow>this->maxReconnects){
+                return response;
+            }
+            ++_reconnects;
+            auto delay=_parser.retry()>=0?std::chrono::milliseconds(_parser.retry()):this->retry;
+            std::unique_lock<std::mutex> lock(_mutex);
+            if(_condition.wait_for(lock, delay, [this]{return _stopped;})){
+                return response;
+            }
+        }
+    }
+
+    /**
+     *  Makes `run` return as soon as possible. Can be called from any thread.
+     */
+    void stop(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stopped=true;
+        if(_cancelToken){
+            _cancelToken->cancel();
+        }
+        _condition.notify_all();
+    }
+
+    /**
+     *  Id of the last event received, sent as `Last-Event-ID` on reconnect. Can be set
+     *  before `run` to resume a stream.
+     */
+    std::string lastEventId() const{
+        return _parser.lastEventId();
+    }
+
+    void lastEventId(std::string value){
+        _parser.lastEventId(std::move(value));
+    }
+
+    uint64_t reconnects() const{
+        return _reconnects.load();
+    }
+
+protected:
+    UrlRequest _request;
+    EventHandler _handler;
+    EventStreamParser _parser;
+    bool _eventReceived=false;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _stopped=false;
+    std::shared_ptr<RetryPolicy::CancelToken> _cancelToken;
+    Response _lastResponse{0, std::string(), std::string()};
+    std::atomic<uint64_t> _reconnects{0};
+
+    /**
+     *  True if `contentType` is `text/event-stream`, parameters aside.
+     */
+    static bool isEventStream(const std::string &contentType){
+        static const std::string mimeType="text/event-stream";
+        if(contentType.length()<mimeType.length()
+           || !std::equal(mimeType.begin(), mimeType.end(), contentType.begin(), [](char a,char b){
+               return a==std::tolower((unsigned char)b);
+           }))
+        {
+            return false;
+        }
+        return contentType.length()==mimeType.length() || contentType[mimeType.length()]==';' || contentType[mimeType.length()]==' ';
+    }
+};
@@ -0,0 +1,512 @@
+//
+//  Hpack.hpp
+//  embeddedRest
+//
+//  HPACK header compression for HTTP/2 (RFC 7541): static and dynamic tables,
+//  prefixed integers and Huffman coded string literals.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+class Hpack{
+public:
+    typedef std::pair<std::string,std::string> Header;
+    
+    struct HuffmanCode{
+        uint32_t code;
+        uint8_t length;
+    };
+    
+    /**
+     *  RFC 7541 Appendix B, indexed by symbol (256 is EOS).
+     */
+    static const HuffmanCode* huffmanCodes(){
+        static const HuffmanCode res[257]={
+        {0x1ff8,13}, {0x7fffd8,23}, {0xfffffe2,28}, {0xfffffe3,28}, {0xfffffe4,28}, {0xfffffe5,28},
+        {0xfffffe6,28}, {0xfffffe7,28}, {0xfffffe8,28}, {0xffffea,24}, {0x3ffffffc,30}, {0xfffffe9,28},
+        {0xfffffea,28}, {0x3ffffffd,30}, {0xfffffeb,28}, {0xfffffec,28}, {0xfffffed,28}, {0xfffffee,28},
+        {0xfffffef,28}, {0xffffff0,28}, {0xffffff1,28}, {0xffffff2,28}, {0x3ffffffe,30}, {0xffffff3,28},
+        {0xffffff4,28}, {0xffffff5,28}, {0xffffff6,28}, {0xffffff7,28}, {0xffffff8,28}, {0xffffff9,28},
+        {0xffffffa,28}, {0xffffffb,28}, {0x14,6}, {0x3f8,10}, {0x3f9,10}, {0xffa,12},
+        {0x1ff9,13}, {0x15,6}, {0xf8,8}, {0x7fa,11}, {0x3fa,10}, {0x3fb,10},
+        {0xf9,8}, {0x7fb,11}, {0xfa,8}, {0x16,6}, {0x17,6}, {0x18,6},
+        {0x0,5}, {0x1,5}, {0x2,5}, {0x19,6}, {0x1a,6}, {0x1b,6},
+        {0x1c,6}, {0x1d,6}, {0x1e,6}, {0x1f,6}, {0x5c,7}, {0xfb,8},
+        {0x7ffc,15}, {0x20,6}, {0xffb,12}, {0x3fc,10}, {0x1ffa,13}, {0x21,6},
+        {0x5d,7}, {0x5e,7}, {0x5f,7}, {0x60,7}, {0x61,7}, {0x62,7},
+        {0x63,7}, {0x64,7}, {0x65,7}, {0x66,7}, {0x67,7}, {0x68,7},
+        {0x69,7}, {0x6a,7}, {0x6b,7}, {0x6c,7}, {0x6d,7}, {0x6e,7},
+        {0x6f,7}, {0x70,7}, {0x71,7}, {0x72,7}, {0xfc,8}, {0x73,7},
+        {0xfd,8}, {0x1ffb,13}, {0x7fff0,19}, {0x1ffc,13}, {0x3ffc,14}, {0x22,6},
+        {0x7ffd,15}, {0x3,5}, {0x23,6}, {0x4,5}, {0x24,6}, {0x5,5},
+        {0x25,6}, {0x26,6}, {0x27,6}, {0x6,5}, {0x74,7}, {0x75,7},
+        {0x28,6}, {0x29,6}, {0x2a,6}, {0x7,5}, {0x2b,6}, {0x76,7},
+        {0x2c,6}, {0x8,5}, {0x9,5}, {0x2d,6}, {0x77,7}, {0x78,7},
+        {0x79,7}, {0x7a,7}, {0x7b,7}, {0x7ffe,15}, {0x7fc,11}, {0x3ffd,14},
+        {0x1ffd,13}, {0xffffffc,28}, {0xfffe6,20}, {0x3fffd2,22}, {0xfffe7,20}, {0xfffe8,20},
+        {0x3fffd3,22}, {0x3fffd4,22}, {0x3fffd5,22}, {0x7fffd9,23}, {0x3fffd6,22}, {0x7fffda,23},
+        {0x7fffdb,23}, {0x7fffdc,23}, {0x7fffdd,23}, {0x7fffde,23}, {0xffffeb,24}, {0x7fffdf,23},
+        {0xffffec,24}, {0xffffed,24}, {0x3fffd7,22}, {0x7fffe0,23}, {0xffffee,24}, {0x7fffe1,23},
+        {0x7fffe2,23}, {0x7fffe3,23}, {0x7fffe4,23}, {0x1fffdc,21}, {0x3fffd8,22}, {0x7fffe5,23},
+        {0x3fffd9,22}, {0x7fffe6,23}, {0x7fffe7,23}, {0xffffef,24}, {0x3fffda,22}, {0x1fffdd,21},
+        {0xfffe9,20}, {0x3fffdb,22}, {0x3fffdc,22}, {0x7fffe8,23}, {0x7fffe9,23}, {0x1fffde,21},
+        {0x7fffea,23}, {0x3fffdd,22}, {0x3fffde,22}, {0xfffff0,24}, {0x1fffdf,21}, {0x3fffdf,22},
+        {0x7fffeb,23}, {0x7fffec,23}, {0x1fffe0,21}, {0x1fffe1,21}, {0x3fffe0,22}, {0x1fffe2,21},
+        {0x7fffed,23}, {0x3fffe1,22}, {0x7fffee,23}, {0x7fffef,23}, {0xfffea,20}, {0x3fffe2,22},
+        {0x3fffe3,22}, {0x3fffe4,22}, {0x7ffff0,23}, {0x3fffe5,22}, {0x3fffe6,22}, {0x7ffff1,23},
+        {0x3ffffe0,26}, {0x3ffffe1,26}, {0xfffeb,20}, {0x7fff1,19}, {0x3fffe7,22}, {0x7ffff2,23},
+        {0x3fffe8,22}, {0x1ffffec,25}, {0x3ffffe2,26}, {0x3ffffe3,26}, {0x3ffffe4,26}, {0x7ffffde,27},
+        {0x7ffffdf,27}, {0x3ffffe5,26}, {0xfffff1,24}, {0x1ffffed,25}, {0x7fff2,19}, {0x1fffe3,21},
+        {0x3ffffe6,26}, {0x7ffffe0,27}, {0x7ffffe1,27}, {0x3ffffe7,26}, {0x7ffffe2,27}, {0xfffff2,24},
+        {0x1fffe4,21}, {0x1fffe5,21}, {0x3ffffe8,26}, {0x3ffffe9,26}, {0xffffffd,28}, {0x7ffffe3,27},
+        {0x7ffffe4,27}, {0x7ffffe5,27}, {0xfffec,20}, {0xfffff3,24}, {0xfffed,20}, {0x1fffe6,21},
+        {0x3fffe9,22}, {0x1fffe7,21}, {0x1fffe8,21}, {0x7ffff3,23}, {0x3fffea,22}, {0x3fffeb,22},
+        {0x1ffffee,25}, {0x1ffffef,25}, {0xfffff4,24}, {0xfffff5,24}, {0x3ffffea,26}, {0x7ffff4,23},
+        {0x3ffffeb,26}, {0x7ffffe6,27}, {0x3ffffec,26}, {0x3ffffed,26}, {0x7ffffe7,27}, {0x7ffffe8,27},
+        {0x7ffffe9,27}, {0x7ffffea,27}, {0x7ffffeb,27}, {0xffffffe,28}, {0x7ffffec,27}, {0x7ffffed,27},
+        {0x7ffffee,27}, {0x7ffffef,27}, {0x7fffff0,27}, {0x3ffffee,26}, {0x3fffffff,30},
+        };
+        return res;
+    }
+    
+    /**
+     *  RFC 7541 Appendix A. Index 1 is the first element.
+     */
+    static const std::vector<Header>& staticTable(){
+        static const std::vector<Header> res={
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+        };
+        return res;
+    }
+    
+    static void encodeInteger(std::string &out,uint64_t value,int prefixBits,uint8_t flags){
+        const uint64_t maxPrefix=(1u<<prefixBits)-1;
+        if(value<maxPrefix){
+            out+=char(flags|uint8_t(value));
+            return;
+        }
+        out+=char(flags|uint8_t(maxPrefix));
+        value-=maxPrefix;
+        while(value>=128){
+            out+=char(0x80|(value&0x7f));
+            value>>=7;
+        }
+        out+=char(value);
+    }
+    
+    static bool decodeInteger(const uint8_t *&p,const uint8_t *end,int prefixBits,uint64_t &value){
+        if(p>=end){
+            return false;
+        }
+        const uint64_t maxPrefix=(1u<<prefixBits)-1;
+        value=*p++&maxPrefix;
+        if(value<maxPrefix){
+            return true;
+        }
+        for(auto shift=0;shift<63;shift+=7){
+            if(p>=end){
+                return false;
+            }
+            auto byte=*p++;
+            value+=uint64_t(byte&0x7f)<<shift;
+            if(!(byte&0x80)){
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static size_t huffmanLength(const std::string &s){
+        uint64_t bits=0;
+        for(auto c:s){
+            bits+=huffmanCodes()[uint8_t(c)].length;
+        }
+        return size_t((bits+7)/8);
+    }
+    
+    static void huffmanEncode(const std::string &s,std::string &out){
+        uint64_t buffer=0;
+        int bits=0;
+        for(auto c:s){
+            const auto &code=huffmanCodes()[uint8_t(c)];
+            buffer=(buffer<<code.length)|code.code;
+            bits+=code.length;
+            while(bits>=8){
+                bits-=8;
+                out+=char(buffer>>bits);
+            }
+        }
+        if(bits){
+            //  padded with the most significant bits of EOS (all ones)..
+            out+=char((buffer<<(8-bits))|(0xff>>bits));
+        }
+    }
+    
+    static bool huffmanDecode(const uint8_t *data,size_t length,std::string &out){
+        const auto &tree=huffmanTree();
+        size_t node=0;
+        auto depth=0;
+        auto allOnes=true;
+        for(size_t i=0;i<length;++i){
+            for(auto bit=7;bit>=0;--bit){
+                auto b=(data[i]>>bit)&1;
+                node=tree[node].children[b];
+                ++depth;
+                allOnes=allOnes && b;
+                if(!node){
+                    return false;
+                }
+                if(tree[node].symbol>=0){
+                    if(tree[node].symbol==256){
+                        return false;
+                    }
+                    out+=char(tree[node].symbol);
+                    node=0;
+                    depth=0;
+                    allOnes=true;
+                }
+            }
+        }
+        //  padding must be shorter than 8 bits and be a prefix of EOS..
+        return depth<8 && allOnes;
+    }
+    
+    /**
+     *  Writes string literal, Huffman coded if that's shorter.
+     */
+    static void encodeString(std::string &out,const std::string &s){
+        auto huffman=huffmanLength(s);
+        if(huffman<s.length()){
+            encodeInteger(out, huffman, 7, 0x80);
+            huffmanEncode(s, out);
+        }else{
+            encodeInteger(out, s.length(), 7, 0);
+            out+=s;
+        }
+    }
+    
+    static bool decodeString(const uint8_t *&p,const uint8_t *end,std::string &out){
+        if(p>=end){
+            return false;
+        }
+        auto huffman=(*p&0x80)!=0;
+        uint64_t length=0;
+        if(!decodeInteger(p, end, 7, length) || length>uint64_t(end-p)){
+            return false;
+        }
+        out.clear();
+        if(huffman){
+            if(!huffmanDecode(p, size_t(length), out)){
+                return false;
+            }
+        }else{
+            out.assign((const char*)p, size_t(length));
+        }
+        p+=length;
+        return true;
+    }
+    
+    class DynamicTable{
+    public:
+        DynamicTable(size_t maxSize=4096):
+        _maxSize(maxSize){}
+        
+        static size_t entrySize(const Header &header){
+            return header.first.length()+header.second.length()+32;
+        }
+        
+        void add(Header header){
+            auto size=entrySize(header);
+            while(_entries.size() && _size+size>_maxSize){
+                this->evict();
+            }
+            if(size<=_maxSize){
+                _size+=size;
+                _entries.push_front(std::move(header));
+            }
+        }
+        
+        void maxSize(size_t value){
+            _maxSize=value;
+            while(_entries.size() && _size>_maxSize){
+                this->evict();
+            }
+        }
+        
+        size_t maxSize() const{
+            return _maxSize;
+        }
+        
+        size_t count() const{
+            return _entries.size();
+        }
+        
+        /**
+         *  Entry by HPACK index (62 is the newest dynamic entry), nullptr if out of range.
+         */
+        const Header* get(uint64_t index) const{
+            const auto &staticEntries=staticTable();
+            if(index==0){
+                return nullptr;
+            }
+            if(index<=staticEntries.size()){
+                return &staticEntries[size_t(index-1)];
+            }
+            index-=staticEntries.size()+1;
+            if(index<_entries.size()){
+                return &_entries[size_t(index)];
+            }
+            return nullptr;
+        }
+        
+        /**
+         *  Returns index of entry equal to `header` or 0. `nameIndex` gets index of an entry
+         *  with the same name (or 0).
+         */
+        uint64_t find(const Header &header,uint64_t &nameIndex) const{
+            nameIndex=0;
+            const auto &staticEntries=staticTable();
+            for(size_t i=0;i<staticEntries.size();++i){
+                if(staticEntries[i].first==header.first){
+                    if(staticEntries[i].second==header.second){
+                        return i+1;
+                    }
+                    if(!nameIndex){
+                        nameIndex=i+1;
+                    }
+                }
+            }
+            for(size_t i=0;i<_entries.size();++i){
+                if(_entries[i].first==header.first){
+                    if(_entries[i].second==header.second){
+                        return staticEntries.size()+1+i;
+                    }
+                    if(!nameIndex){
+                        nameIndex=staticEntries.size()+1+i;
+                    }
+                }
+            }
+            return 0;
+        }
+        
+    protected:
+        std::deque<Header> _entries;
+        size_t _size=0;
+        size_t _maxSize;
+        
+        void evict(){
+            _size-=entrySize(_entries.back());
+            _entries.pop_back();
+        }
+    };
+    
+    class Encoder{
+    public:
+        
+        /**
+         *  Peer's SETTINGS_HEADER_TABLE_SIZE. Size update is signalled in the next block.
+         */
+        void maxTableSize(size_t value){
+            if(value!=_table.maxSize()){
+                _table.maxSize(value);
+                _sizeUpdatePending=true;
+            }
+        }
+        
+        /**
+         *  Header names must be lower case. Values of sensitive headers are never indexed.
+         */
+        std::string encode(const std::vector<Header> &headers){
+            std::string res;
+            if(_sizeUpdatePending){
+                encodeInteger(res, _table.maxSize(), 5, 0x20);
+                _sizeUpdatePending=false;
+            }
+            for(const auto &header:headers){
+                uint64_t nameIndex=0;
+                auto index=_table.find(header, nameIndex);
+                if(index){
+                    encodeInteger(res, index, 7, 0x80);
+                    continue;
+                }
+                const auto sensitive=(header.first=="authorization" || header.first=="cookie" || header.first=="proxy-authorization");
+                const auto indexable=!sensitive && DynamicTable::entrySize(header)<=_table.maxSize()/2;
+                if(indexable){
+                    encodeInteger(res, nameIndex, 6, 0x40);
+                }else{
+                    encodeInteger(res, nameIndex, 4, sensitive?0x10:0);
+                }
+                if(!nameIndex){
+                    encodeString(res, header.first);
+                }
+                encodeString(res, header.second);
+                if(indexable){
+                    _table.add(header);
+                }
+            }
+            return res;
+        }
+        
+    protected:
+        DynamicTable _table;
+        bool _sizeUpdatePending=false;
+    };
+    
+    class Decoder{
+    public:
+        
+        /**
+         *  Our SETTINGS_HEADER_TABLE_SIZE - the largest table size the peer may set.
+         */
+        size_t maxAllowedTableSize=4096;
+        
+        /**
+         *  Returns false on malformed block (connection error COMPRESSION_ERROR).
+         */
+        bool decode(const std::string &block,std::vector<Header> &headers){
+            auto p=(const uint8_t*)block.data();
+            const auto end=p+block.length();
+            while(p<end){
+                const auto byte=*p;
+                if(byte&0x80){
+                    uint64_t index=0;
+                    if(!decodeInteger(p, end, 7, index)){
+                        return false;
+                    }
+                    auto entry=_table.get(index);
+                    if(!entry){
+                        return false;
+                    }
+                    headers.push_back(*entry);
+                }else if((byte&0xe0)==0x20){
+                    uint64_t size=0;
+                    if(!decodeInteger(p, end, 5, size) || size>this->maxAllowedTableSize){
+                        return false;
+                    }
+                    _table.maxSize(size_t(size));
+                }else{
+                    const auto incremental=(byte&0x40)!=0;
+                    uint64_t nameIndex=0;
+                    if(!decodeInteger(p, end, incremental?6:4, nameIndex)){
+                        return false;
+                    }
+                    Header header;
+                    if(nameIndex){
+                        auto entry=_table.get(nameIndex);
+                        if(!entry){
+                            return false;
+                        }
+                        header.first=entry->first;
+                    }else if(!decodeString(p, end, header.first)){
+                        return false;
+                    }
+                    if(!decodeString(p, end, header.second)){
+                        return false;
+                    }
+                    if(incremental){
+                        _table.add(header);
+                    }
+                    headers.push_back(std::move(header));
+                }
+            }
+            return true;
+        }
+        
+    protected:
+        DynamicTable _table;
+    };
+
+protected:
+    struct HuffmanNode{
+        size_t children[2]={0,0};
+        int symbol=-1;
+    };
+    
+    static const std::vector<HuffmanNode>& huffmanTree(){
+        static const std::vector<HuffmanNode> res=[]{
+            std::vector<HuffmanNode> tree(1);
+            for(auto symbol=0;symbol<257;++symbol){
+                const auto &code=huffmanCodes()[symbol];
+                size_t node=0;
+                for(int bit=code.length-1;bit>=0;--bit){
+                    auto b=(code.code>>bit)&1;
+                    if(!tree[node].children[b]){
+                        tree[node].children[b]=tree.size();
+                        tree.emplace_back();
+                    }
+                    node=tree[node].children[b];
+                }
+                tree[node].symbol=symbol;
+            }
+            return tree;
+        }();
+        return res;
+    }
+};
@@ -0,0 +1,956 @@
+//
+//  Http2Client.hpp
+//  embeddedRest
+//
+//  HTTP/2 (RFC 7540) client: many concurrent requests are multiplexed as streams over
+//  one connection per peer - prior knowledge h2c over plain sockets or h2 negotiated
+//  with ALPN over TLS. Every connection has a single I/O thread which writes queued
+//  frames and reads incoming ones. Request threads only queue frames and wait for
+//  their stream, so TLS sessions are never used from two threads. POSIX only.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cctype>
+
+#include <sys/select.h>
+#include <unistd.h>
+
+#include "Transport.hpp"
+#include "Hpack.hpp"
+#include "Response.hpp"
+#include "ResponseParser.hpp"
+#include "RetryPolicy.hpp"
+
+class Http2Connection{
+public:
+
+    struct Request{
+        std::string method="GET";
+        std::string scheme="http";
+        std::string authority;
+        std::string path="/";
+
+        /**
+         *  Regular headers with lower case names (no connection-specific ones).
+         */
+        std::vector<Hpack::Header> headers;
+        std::string body;
+
+        /**
+         *  Applies to every wait: for stream slot, flow control window, response bytes.
+         */
+        timeval timeout{30, 0};
+
+        /**
+         *  Stream weight 1..256 sent in HEADERS priority block, 0 - no priority block.
+         */
+        int weight=0;
+
+        /**
+         *  Adds HTTP/1.1 style "Name: value" header. Connection-specific headers (which are
+         *  forbidden in HTTP/2) and `Host` (sent as :authority) are dropped.
+         */
+        void addHeader(const std::string &line){
+            auto colonPos=line.find(':');
+            if(colonPos==std::string::npos){
+                return;
+            }
+            auto name=line.substr(0, colonPos);
+            std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+            auto valuePos=line.find_first_not_of(" \t", colonPos+1);
+            auto value=(valuePos==std::string::npos)?std::string():line.substr(valuePos);
+            if(name=="connection" || name=="keep-alive" || name=="proxy-connection" || name=="transfer-encoding"
+               || name=="upgrade" || name=="host" || name=="content-length" || (name=="te" && value!="trailers"))
+            {
+                return;
+            }
+            this->headers.emplace_back(std::move(name), std::move(value));
+        }
+    };
+
+    enum class Failure{
+        none,
+        connectionClosed,   //  connection lost before response was complete
+        refused,            //  stream refused or above GOAWAY's last stream - never processed
+        reset,              //  RST_STREAM from server
+        timeout,
+        cancelled,
+    };
+
+    enum FrameType:uint8_t{
+        DATA=0x0,
+        HEADERS=0x1,
+        PRIORITY=0x2,
+        RST_STREAM=0x3,
+        SETTINGS=0x4,
+        PUSH_PROMISE=0x5,
+        PING=0x6,
+        GOAWAY=0x7,
+        WINDOW_UPDATE=0x8,
+        CONTINUATION=0x9,
+    };
+
+    enum Flag:uint8_t{
+        END_STREAM=0x1,
+        ACK=0x1,
+        END_HEADERS=0x4,
+        PADDED=0x8,
+        PRIORITY_FLAG=0x20,
+    };
+
+    enum Setting:uint16_t{
+        HEADER_TABLE_SIZE=0x1,
+        ENABLE_PUSH=0x2,
+        MAX_CONCURRENT_STREAMS=0x3,
+        INITIAL_WINDOW_SIZE=0x4,
+        MAX_FRAME_SIZE=0x5,
+        MAX_HEADER_LIST_SIZE=0x6,
+    };
+
+    enum ErrorCode:uint32_t{
+        NO_ERROR_CODE=0x0,
+        PROTOCOL_ERROR=0x1,
+        FLOW_CONTROL_ERROR=0x3,
+        FRAME_SIZE_ERROR=0x6,
+        REFUSED_STREAM=0x7,
+        CANCEL=0x8,
+        COMPRESSION_ERROR=0x9,
+    };
+
+    /**
+     *  Receive window of every stream. Bigger windows let fast servers send without
+     *  waiting for WINDOW_UPDATE, memory used per stream is bounded by it.
+     */
+    static const uint32_t streamWindow=1u<<20;
+    static const uint32_t connectionWindow=16u<<20;
+
+    /**
+     *  Takes connected transport, sends the connection preface and starts I/O thread.
+     */
+    Http2Connection(std::unique_ptr<Connection> connection):
+    _connection(std::move(connection))
+    {
+        ::pipe(_wakePipe);
+        TransportOptions::setNonBlocking(_wakePipe[0]);
+        TransportOptions::setNonBlocking(_wakePipe[1]);
+        _out="PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+        std::string settings;
+        appendSetting(settings, ENABLE_PUSH, 0);
+        appendSetting(settings, INITIAL_WINDOW_SIZE, streamWindow);
+        appendFrame(_out, SETTINGS, 0, 0, settings);
+        appendWindowUpdate(_out, 0, connectionWindow-65535);
+        _thread=std::thread([this]{
+            this->run();
+        });
+    }
+
+    ~Http2Connection(){
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if(!_closed){
+                std::string payload;
+                appendUint32(payload, _lastPeerStreamId);
+                appendUint32(payload, NO_ERROR_CODE);
+                appendFrame(_out, GOAWAY, 0, 0, payload);
+            }
+            _closing=true;
+        }
+        this->wake();
+        _thread.join();
+        ::close(_wakePipe[0]);
+        ::close(_wakePipe[1]);
+    }
+
+    Http2Connection(const Http2Connection&)=delete;
+    Http2Connection& operator=(const Http2Connection&)=delete;
+
+    /**
+     *  False once connection is lost, got GOAWAY or ran out of stream ids.
+     */
+    bool usable(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        return !_closed && !_goaway && !_closing && _nextStreamId<0x7fffff00u;
+    }
+
+    size_t activeStreams(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _streams.size();
+    }
+
+    /**
+     *  Performs request on a new stream. Returns nullptr with `failure` set if there is no
+     *  complete response. If `headersHandler`/`bodyHandler` are set they are called on the
+     *  calling thread like `ResponseParser` does, returned response has no body then.
+     */
+    std::shared_ptr<Response> perform(const Request &request,
+                                      Failure &failure,
+                                      const ResponseParser::HeadersHandler &headersHandler=ResponseParser::HeadersHandler(),
+                                      const ResponseParser::BodyHandler &bodyHandler=ResponseParser::BodyHandler(),
+                                      const std::shared_ptr<RetryPolicy::CancelToken> &cancelToken=nullptr)
+    {
+        failure=Failure::none;
+        auto stream=std::make_shared<Stream>();
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        //  open stream..
+        if(!this->waitFor(lock, *stream, request.timeout, [this]{
+            //  until server's SETTINGS arrive its stream limit is unknown, don't risk refusals..
+            return _closing || _streams.size()<(_settingsReceived?_peerMaxConcurrentStreams:1);
+        })){
+            failure=_closed||_goaway?Failure::refused:Failure::timeout;
+            return nullptr;
+        }
+        if(_closing){
+            //  nothing was sent yet..
+            failure=Failure::refused;
+            return nullptr;
+        }
+        stream->id=_nextStreamId;
+        _nextStreamId+=2;
+        stream->sendWindow=_peerInitialWindow;
+        _streams[stream->id]=stream;
+        std::vector<Hpack::Header> headers;
+        headers.reserve(request.headers.size()+5);
+        headers.emplace_back(":method", request.method);
+        headers.emplace_back(":scheme", request.scheme);
+        headers.emplace_back(":authority", request.authority);
+        headers.emplace_back(":path", request.path);
+        headers.insert(headers.end(), request.headers.begin(), request.headers.end());
+        if(request.body.length()){
+            headers.emplace_back("content-length", std::to_string(request.body.length()));
+        }
+        this->appendHeaders(*stream, headers, request.body.empty(), request.weight);
+        ++_streamsOpened;
+        lock.unlock();
+        this->wake();
+        if(cancelToken && !cancelToken->attach([this,stream]{
+            this->cancel(stream);
+        })){
+            this->cancel(stream);
+        }
+        lock.lock();
+
+        //  body..
+        size_t sent=0;
+        while(sent<request.body.length()){
+            if(!this->waitFor(lock, *stream, request.timeout, [this,&stream]{
+                return std::min<int64_t>(stream->sendWindow, _sendWindow)>0;
+            })){
+                return this->finish(lock, stream, failure, Failure::timeout, cancelToken);
+            }
+            auto count=size_t(std::min<int64_t>({stream->sendWindow, _sendWindow, int64_t(_peerMaxFrameSize), int64_t(request.body.length()-sent)}));
+            auto last=(sent+count==request.body.length());
+            appendFrame(_out, DATA, last?END_STREAM:0, stream->id, request.body.data()+sent, count);
+            stream->sendWindow-=count;
+            _sendWindow-=count;
+            sent+=count;
+            lock.unlock();
+            this->wake();
+            lock.lock();
+        }
+
+        //  response headers..
+        if(!this->waitFor(lock, *stream, request.timeout, [&stream]{
+            return stream->headersReady;
+        })){
+            return this->finish(lock, stream, failure, Failure::timeout, cancelToken);
+        }
+        auto response=makeResponse(stream->headers);
+        if(!response){
+            return this->finish(lock, stream, failure, Failure::reset, cancelToken);
+        }
+        if(headersHandler){
+            lock.unlock();
+            auto accepted=headersHandler(*response);
+            lock.lock();
+            if(!accepted){
+                this->finish(lock, stream, failure, Failure::none, cancelToken);
+                return response;
+            }
+        }
+
+        //  body..
+        std::string body;
+        uint32_t consumed=0;
+        while(true){
+            if(!this->waitFor(lock, *stream, request.timeout, [&stream]{
+                return stream->data.size() || stream->endStream;
+            })){
+                return this->finish(lock, stream, failure, Failure::timeout, cancelToken);
+            }
+            if(stream->data.empty()){
+                break;
+            }
+            auto chunk=std::move(stream->data.front());
+            stream->data.pop_front();
+            consumed+=uint32_t(chunk.length());
+            if(consumed>=streamWindow/2 && !stream->endStream){
+                appendWindowUpdate(_out, stream->id, consumed);
+                consumed=0;
+                lock.unlock();
+                this->wake();
+            }else{
+                lock.unlock();
+            }
+            if(bodyHandler){
+                if(!bodyHandler(chunk.data(), chunk.length())){
+                    lock.lock();
+                    this->finish(lock, stream, failure, Failure::none, cancelToken);
+                    return response;
+                }
+            }else{
+                body+=chunk;
+            }
+            lock.lock();
+        }
+        this->finish(lock, stream, failure, Failure::none, cancelToken);
+        if(!bodyHandler){
+            response=std::make_shared<Response>(startLine(stream->headers), headersList(stream->headers), std::move(body));
+        }
+        return response;
+    }
+
+    uint64_t streamsOpened() const{
+        return _streamsOpened.load();
+    }
+
+protected:
+
+    struct Stream{
+        uint32_t id=0;
+        int64_t sendWindow=0;
+        std::condition_variable condition;
+        std::vector<Hpack::Header> headers;
+        bool headersReady=false;
+        std::deque<std::string> data;
+        bool endStream=false;
+        bool reset=false;
+        uint32_t resetCode=0;
+        bool cancelled=false;
+    };
+
+    std::unique_ptr<Connection> _connection;
+    std::thread _thread;
+    int _wakePipe[2]={-1,-1};
+    std::mutex _mutex;
+    std::condition_variable _condition;     //  waiting for a stream slot
+    std::map<uint32_t,std::shared_ptr<Stream>> _streams;
+    std::string _out;
+    uint32_t _nextStreamId=1;
+    uint32_t _lastPeerStreamId=0;
+    uint32_t _goawayLastStreamId=0;
+    bool _goaway=false;
+    bool _closed=false;
+    bool _closing=false;
+    bool _connectionError=false;
+    Hpack::Encoder _encoder;
+    Hpack::Decoder _decoder;
+    bool _settingsReceived=false;
+    uint32_t _peerMaxConcurrentStreams=0xffffffff;
+    int64_t _peerInitialWindow=65535;
+    uint32_t _peerMaxFrameSize=16384;
+    int64_t _sendWindow=65535;
+    uint32_t _receivedSinceUpdate=0;
+    uint32_t _continuationStream=0;
+    uint8_t _continuationFlags=0;
+    std::string _headerBlock;
+    std::atomic<uint64_t> _streamsOpened{0};
+
+    /**
+     *  Waits on stream condition until `predicate`, stream failure or timeout. Returns
+     *  true if predicate holds.
+     */
+    template<class Predicate>
+    bool waitFor(std::unique_lock<std::mutex> &lock,Stream &stream,timeval timeout,Predicate predicate){
+        auto duration=std::chrono::seconds(timeout.tv_sec)+std::chrono::microseconds(timeout.tv_usec);
+        while(!predicate()){
+            if(stream.reset || stream.cancelled || _closed || (_goaway && (!stream.id || stream.id>_goawayLastStreamId))){
+                return false;
+            }
+            auto &condition=stream.id?stream.condition:_condition;
+            if(condition.wait_for(lock, duration)==std::cv_status::timeout && !predicate()){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     *  Closes stream (with RST_STREAM if it's still open on our side) and translates
+     *  its state to failure. `timeoutFailure` is used if stream itself is fine.
+     */
+    std::shared_ptr<Response> finish(std::unique_lock<std::mutex> &lock,
+                                     const std::shared_ptr<Stream> &stream,
+                                     Failure &failure,
+                                     Failure fallback,
+                                     const std::shared_ptr<RetryPolicy::CancelToken> &cancelToken)
+    {
+        if(stream->cancelled){
+            failure=Failure::cancelled;
+        }else if(stream->reset){
+            failure=(stream->resetCode==REFUSED_STREAM)?Failure::refused:Failure::reset;
+        }else if(_goaway && stream->id>_goawayLastStreamId){
+            failure=Failure::refused;
+        }else if(_closed && !stream->endStream){
+            failure=Failure::connectionClosed;
+        }else{
+            failure=fallback;
+        }
+        if(!stream->endStream && !stream->reset && !_closed){
+            std::string payload;
+            appendUint32(payload, CANCEL);
+            appendFrame(_out, RST_STREAM, 0, stream->id, payload);
+        }
+        _streams.erase(stream->id);
+        _condition.notify_all();
+        lock.unlock();
+        if(cancelToken){
+            cancelToken->detach();
+        }
+        this->wake();
+        lock.lock();
+        return nullptr;
+    }
+
+    void cancel(const std::shared_ptr<Stream> &stream){
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            stream->cancelled=true;
+        }
+        stream->condition.notify_all();
+    }
+
+    void wake(){
+        char c=0;
+        (void)::write(_wakePipe[1], &c, 1);
+    }
+
+    //  frames..
+
+    static void appendUint32(std::string &out,uint32_t value){
+        out+=char(value>>24);
+        out+=char(value>>16);
+        out+=char(value>>8);
+        out+=char(value);
+    }
+
+    static void appendFrame(std::string &out,uint8_t type,uint8_t flags,uint32_t streamId,const char *payload,size_t length){
+        out+=char(length>>16);
+        out+=char(length>>8);
+        out+=char(length);
+        out+=char(type);
+        out+=char(flags);
+        appendUint32(out, streamId&0x7fffffff);
+        out.append(payload, length);
+    }
+
+    static void appendFrame(std::string &out,uint8_t type,uint8_t flags,uint32_t streamId,const std::string &payload){
+        appendFrame(out, type, flags, streamId, payload.data(), payload.length());
+    }
+
+    static void appendSetting(std::string &out,uint16_t id,uint32_t value){
+        out+=char(id>>8);
+        out+=char(id);
+        appendUint32(out, value);
+    }
+
+    static void appendWindowUpdate(std::string &out,uint32_t streamId,uint32_t increment){
+        std::string payload;
+        appendUint32(payload, increment&0x7fffffff);
+        appendFrame(out, WINDOW_UPDATE, 0, streamId, payload);
+    }
+
+    /**
+     *  HEADERS (+ CONTINUATION) frames. Must be called under lock so blocks are encoded and
+     *  sent in stream order.
+     */
+    void appendHeaders(const Stream &stream,const std::vector<Hpack::Header> &headers,bool endStream,int weight){
+        std::string block;
+        if(weight>0){
+            appendUint32(block, 0);     //  depends on the root, not exclusive
+            block+=char(std::min(std::max(weight, 1), 256)-1);
+        }
+        block+=_encoder.encode(headers);
+        size_t pos=0;
+        auto first=true;
+        do{
+            auto count=std::min<size_t>(block.length()-pos, _peerMaxFrameSize);
+            auto last=(pos+count==block.length());
+            uint8_t flags=last?END_HEADERS:0;
+            if(first){
+                if(endStream){
+                    flags|=END_STREAM;
+                }
+                if(weight>0){
+                    flags|=PRIORITY_FLAG;
+                }
+            }
+            appendFrame(_out, first?HEADERS:CONTINUATION, flags, stream.id, block.data()+pos, count);
+            pos+=count;
+            first=false;
+        }while(pos<block.length());
+    }
+
+    //  I/O thread..
+
+    void run(){
+        std::string in;
+        char buffer[32*1024];
+        const timeval noWait{0, 0};
+        const timeval sendTimeout{30, 0};
+        while(true){
+            std::string out;
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                out.swap(_out);
+            }
+            if(out.length() && !_connection->send(out.data(), out.length(), sendTimeout)){
+                break;
+            }
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if(_connectionError && _out.empty()){
+                    break;
+                }
+            }
+            auto received=false;
+            long n;
+            while((n=_connection->receive(buffer, sizeof(buffer), noWait))>0){
+                in.append(buffer, size_t(n));
+                received=true;
+            }
+            if(n!=-2){
+                break;
+            }
+            if(received){
+                if(!this->processFrames(in)){
+                    break;
+                }
+                continue;
+            }
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                if(_out.length()){
+                    continue;
+                }
+                if(_closing){
+                    break;
+                }
+            }
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(_connection->fd(), &fds);
+            FD_SET(_wakePipe[0], &fds);
+            timeval tv{1, 0};
+            if(::select(std::max(_connection->fd(), _wakePipe[0])+1, &fds, nullptr, nullptr, &tv)>0 && FD_ISSET(_wakePipe[0], &fds)){
+                char drain[64];
+                while(::read(_wakePipe[0], drain, sizeof(drain))>0){}
+            }
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _closed=true;
+        for(auto &p:_streams){
+            p.second->condition.notify_all();
+        }
+        _condition.notify_all();
+    }
+
+    static uint32_t readUint32(const char *p){
+        return (uint32_t(uint8_t(p[0]))<<24)|(uint32_t(uint8_t(p[1]))<<16)|(uint32_t(uint8_t(p[2]))<<8)|uint32_t(uint8_t(p[3]));
+    }
+
+    /**
+     *  Handles all complete frames in `in`. Returns false on connection error.
+     */
+    bool processFrames(std::string &in){
+        size_t pos=0;
+        auto res=true;
+        std::unique_lock<std::mutex> lock(_mutex);
+        while(res && !_connectionError && in.length()-pos>=9){
+            auto p=in.data()+pos;
+            auto length=(uint32_t(uint8_t(p[0]))<<16)|(uint32_t(uint8_t(p[1]))<<8)|uint32_t(uint8_t(p[2]));
+            if(length>16384){
+                //  we never allow frames bigger than default SETTINGS_MAX_FRAME_SIZE..
+                res=this->connectionError(FRAME_SIZE_ERROR);
+                break;
+            }
+            if(in.length()-pos<9+length){
+                break;
+            }
+            auto type=uint8_t(p[3]);
+            auto flags=uint8_t(p[4]);
+            auto streamId=readUint32(p+5)&0x7fffffff;
+            res=this->onFrame(type, flags, streamId, p+9, length);
+            pos+=9+length;
+        }
+        in.erase(0, _connectionError?in.length():pos);
+        lock.unlock();
+        this->wake();   //  frames may have been queued (acks, window updates)..
+        return res;
+    }
+
+    /**
+     *  Our own GOAWAY: connection is closed once it is sent and frames still arriving are
+     *  dropped. Peer may have processed any stream in flight, so they end up as
+     *  `connectionClosed` (not retried), `refused` stays for what the peer itself refused.
+     */
+    bool connectionError(uint32_t code){
+        std::string payload;
+        appendUint32(payload, _lastPeerStreamId);
+        appendUint32(payload, code);
+        appendFrame(_out, GOAWAY, 0, 0, payload);
+        _connectionError=true;
+        _closing=true;
+        return true;
+    }
+
+    bool onFrame(uint8_t type,uint8_t flags,uint32_t streamId,const char *payload,uint32_t length){
+        if(_continuationStream && (type!=CONTINUATION || streamId!=_continuationStream)){
+            return this->connectionError(PROTOCOL_ERROR);
+        }
+        switch(type){
+            case DATA:{
+                _receivedSinceUpdate+=length;
+                if(_receivedSinceUpdate>=connectionWindow/2){
+                    appendWindowUpdate(_out, 0, _receivedSinceUpdate);
+                    _receivedSinceUpdate=0;
+                }
+                if(!this->stripPadding(flags, payload, length)){
+                    return this->connectionError(PROTOCOL_ERROR);
+                }
+                auto it=_streams.find(streamId);
+                if(it!=_streams.end()){
+                    auto &stream=*it->second;
+                    if(length){
+                        stream.data.emplace_back(payload, length);
+                    }
+                    if(flags&END_STREAM){
+                        stream.endStream=true;
+                    }
+                    stream.condition.notify_all();
+                }
+            }break;
+            case HEADERS:{
+                if(!this->stripPadding(flags, payload, length)){
+                    return this->connectionError(PROTOCOL_ERROR);
+                }
+                if(flags&PRIORITY_FLAG){
+                    if(length<5){
+                        return this->connectionError(PROTOCOL_ERROR);
+                    }
+                    payload+=5;
+                    length-=5;
+                }
+                _headerBlock.assign(payload, length);
+                _continuationFlags=flags;
+                if(flags&END_HEADERS){
+                    return this->onHeaderBlock(streamId);
+                }
+                _continuationStream=streamId;
+            }break;
+            case CONTINUATION:{
+                if(streamId!=_continuationStream){
+                    return this->connectionError(PROTOCOL_ERROR);
+                }
+                _headerBlock.append(payload, length);
+                if(flags&END_HEADERS){
+                    _continuationStream=0;
+                    return this->onHeaderBlock(streamId);
+                }
+            }break;
+            case RST_STREAM:{
+                auto it=_streams.find(streamId);
+                if(it!=_streams.end() && length>=4){
+                    it->second->reset=true;
+                    it->second->resetCode=readUint32(payload);
+                    it->second->condition.notify_all();
+                }
+            }break;
+            case SETTINGS:{
+                if(flags&ACK){
+                    break;
+                }
+                for(uint32_t i=0;i+6<=length;i+=6){
+                    auto id=uint16_t((uint8_t(payload[i])<<8)|uint8_t(payload[i+1]));
+                    auto value=readUint32(payload+i+2);
+                    switch(id){
+                        case HEADER_TABLE_SIZE:
+                            _encoder.maxTableSize(std::min<uint32_t>(value, 4096));
+                            break;
+                        case MAX_CONCURRENT_STREAMS:
+                            _peerMaxConcurrentStreams=value;
+                            break;
+                        case INITIAL_WINDOW_SIZE:{
+                            auto delta=int64_t(value)-_peerInitialWindow;
+                            _peerInitialWindow=value;
+                            for(auto &p:_streams){
+                                p.second->sendWindow+=delta;
+                            }
+                        }break;
+                        case MAX_FRAME_SIZE:
+                            _peerMaxFrameSize=value;
+                            break;
+                        default:
+                            break;
+                    }
+                }
+                appendFrame(_out, SETTINGS, ACK, 0, std::string());
+                _settingsReceived=true;
+                this->notifyAll();
+            }break;
+            case PING:{
+                if(!(flags&ACK)){
+                    appendFrame(_out, PING, ACK, 0, payload, length);
+                }
+            }break;
+            case GOAWAY:{
+                if(length>=8){
+                    _goaway=true;
+                    _goawayLastStreamId=readUint32(payload)&0x7fffffff;
+                    this->notifyAll();
+                }
+            }break;
+            case WINDOW_UPDATE:{
+                if(length>=4){
+                    auto increment=readUint32(payload)&0x7fffffff;
+                    if(streamId){
+                        auto it=_streams.find(streamId);
+                        if(it!=_streams.end()){
+                            it->second->sendWindow+=increment;
+                            it->second->condition.notify_all();
+                        }
+                    }else{
+                        _sendWindow+=increment;
+                        this->notifyAll();
+                    }
+                }
+            }break;
+            case PUSH_PROMISE:
+                //  disabled in our SETTINGS..
+                return this->connectionError(PROTOCOL_ERROR);
+            default:
+                //  PRIORITY and unknown frame types are ignored..
+                break;
+        }
+        return true;
+    }
+
+    bool stripPadding(uint8_t flags,const char *&payload,uint32_t &length){
+        if(!(flags&PADDED)){
+            return true;
+        }
+        if(!length){
+            return false;
+        }
+        auto padding=uint8_t(payload[0]);
+        if(padding>=length){
+            return false;
+        }
+        ++payload;
+        length-=1+padding;
+        return true;
+    }
+
+    bool onHeaderBlock(uint32_t streamId){
+        std::vector<Hpack::Header> headers;
+        if(!_decoder.decode(_headerBlock, headers)){
+            //  decoder state is unknown now, connection can't be used any more..
+            return this->connectionError(COMPRESSION_ERROR);
+        }
+        _headerBlock.clear();
+        auto it=_streams.find(streamId);
+        if(it==_streams.end()){
+            return true;
+        }
+        auto &stream=*it->second;
+        if(!stream.headersReady){
+            auto status=findHeader(headers, ":status");
+            if(status.length()==3 && status[0]=='1'){
+                //  interim response (100 Continue, 103 Early Hints)..
+                return true;
+            }
+            stream.headers=std::move(headers);
+            stream.headersReady=true;
+        }
+        if(_continuationFlags&END_STREAM){
+            stream.endStream=true;
+        }
+        stream.condition.notify_all();
+        return true;
+    }
+
+    void notifyAll(){
+        for(auto &p:_streams){
+            p.second->condition.notify_all();
+        }
+        _condition.notify_all();
+    }
+
+    //  responses..
+
+    static std::string findHeader(const std::vector<Hpack::Header> &headers,const char *name){
+        for(const auto &header:headers){
+            if(header.first==name){
+                return header.second;
+            }
+        }
+        return std::string();
+    }
+
+    static std::string startLine(const std::vector<Hpack::Header> &headers){
+        auto status=findHeader(headers, ":status");
+        return "HTTP/2 "+status+" "+reasonPhrase(std::atoi(status.c_str()));
+    }
+
+    static std::vector<std::string> headersList(const std::vector<Hpack::Header> &headers){
+        std::vector<std::string> res;
+        res.reserve(headers.size());
+        for(const auto &header:headers){
+            if(header.first.length() && header.first[0]!=':'){
+                res.push_back(header.first+": "+header.second);
+            }
+        }
+        return res;
+    }
+
+    static std::shared_ptr<Response> makeResponse(const std::vector<Hpack::Header> &headers){
+        try{
+            return std::make_shared<Response>(startLine(headers), headersList(headers), std::string());
+        }catch(const Response::IncorrectStartLineException&){
+            return nullptr;
+        }
+    }
+
+    static const char* reasonPhrase(int statusCode){
+        switch(statusCode){
+            case 200:return "OK";
+            case 201:return "Created";
+            case 202:return "Accepted";
+            case 204:return "No Content";
+            case 206:return "Partial Content";
+            case 301:return "Moved Permanently";
+            case 302:return "Found";
+            case 304:return "Not Modified";
+            case 400:return "Bad Request";
+            case 401:return "Unauthorized";
+            case 403:return "Forbidden";
+            case 404:return "Not Found";
+            case 408:return "Request Timeout";
+            case 416:return "Range Not Satisfiable";
+            case 429:return "Too Many Requests";
+            case 500:return "Internal Server Error";
+            case 502:return "Bad Gateway";
+            case 503:return "Service Unavailable";
+            case 504:return "Gateway Timeout";
+            default:return "Unknown";
+        }
+    }
+};
+
+/**
+ *  Keeps one HTTP/2 connection per peer and hands it out to requests. Share one client
+ *  between requests which should be multiplexed.
+ */
+class Http2Client{
+public:
+    typedef std::function<std::unique_ptr<Connection>()> ConnectFunction;
+
+    struct Stats{
+        uint64_t connectionsOpened=0;
+        uint64_t streamsOpened=0;
+    };
+
+    /**
+     *  Returns usable connection to `key` or opens one with `connect`. nullptr if that failed.
+     *  `connect` runs without the client lock, requests to the same key wait for it and
+     *  share its outcome, other keys are not blocked.
+     */
+    std::shared_ptr<Http2Connection> connection(const std::string &key,const ConnectFunction &connect){
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto &slot=_connections[key];
+        if(slot.connecting){
+            auto failures=slot.failures;
+            _connected.wait(lock, [&slot]{
+                return !slot.connecting;
+            });
+            if(slot.failures!=failures){
+                return nullptr;
+            }
+        }
+        if(slot.connection && slot.connection->usable()){
+            return slot.connection;
+        }
+        slot.connecting=true;
+        lock.unlock();
+        std::shared_ptr<Http2Connection> connection;
+        try{
+            auto transport=connect();
+            if(transport){
+                connection=std::make_shared<Http2Connection>(std::move(transport));
+            }
+        }catch(...){
+            //  e.g. unresolvable host, waiters must not hang..
+            lock.lock();
+            slot.connecting=false;
+            ++slot.failures;
+            _connected.notify_all();
+            throw;
+        }
+        lock.lock();
+        slot.connecting=false;
+        if(connection){
+            if(slot.connection){
+                _streamsOfClosed+=slot.connection->streamsOpened();
+            }
+            //  old connection (if any) finishes its streams and closes when last of them leaves..
+            slot.connection=connection;
+            ++_connectionsOpened;
+        }else{
+            ++slot.failures;
+        }
+        _connected.notify_all();
+        return connection;
+    }
+
+    Stats stats(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        Stats res;
+        res.connectionsOpened=_connectionsOpened;
+        res.streamsOpened=_streamsOfClosed;
+        for(auto &p:_connections){
+            if(p.second.connection){
+                res.streamsOpened+=p.second.connection->streamsOpened();
+            }
+        }
+        return res;
+    }
+
+protected:
+    struct Slot{
+        std::shared_ptr<Http2Connection> connection;
+        bool connecting=false;
+        uint64_t failures=0;
+    };
+    
+    std::mutex _mutex;
+    std::condition_variable _connected;
+    std::map<std::string,Slot> _connections;
+    uint64_t _connectionsOpened=0;
+    uint64_t _streamsOfClosed=0;
+};
@@ -0,0 +1,428 @@
+//
+//  IoUring.hpp
+//  embeddedRest
+//
+//  Linux io_uring backend on raw syscalls (no liburing needed). Compiled in only when
+//  `EMBEDDED_REST_IO_URING` is defined, used by requests with `TransportOptions::ioUring`.
+//  Every thread gets its own ring with a registered receive buffer. Connect, send of the
+//  request and the first receive are linked and submitted with one `io_uring_enter`,
+//  completions are read straight from the shared completion queue. If the kernel lacks
+//  io_uring (or it is disabled) requests use regular sockets.
+//
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <vector>
+#include <map>
+#include <string>
+#include <initializer_list>
+#include <memory>
+#include <cstring>
+#include <cstdint>
+#include <cerrno>
+#include <algorithm>
+
+#include "Transport.hpp"
+
+class IoUring{
+public:
+    static const unsigned queueDepth=32;
+    static const size_t bufferSize=64*1024;
+
+    IoUring(){
+        io_uring_params params;
+        ::memset(&params, 0, sizeof(params));
+        _fd=int(::syscall(__NR_io_uring_setup, queueDepth, &params));
+        if(_fd<0){
+            return;
+        }
+        _sqRingSize=params.sq_off.array+params.sq_entries*sizeof(unsigned);
+        _cqRingSize=params.cq_off.cqes+params.cq_entries*sizeof(io_uring_cqe);
+        auto singleMap=(params.features&IORING_FEAT_SINGLE_MMAP)!=0;
+        if(singleMap){
+            _sqRingSize=_cqRingSize=std::max(_sqRingSize, _cqRingSize);
+        }
+        _sqRing=::mmap(nullptr, _sqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+        if(_sqRing==MAP_FAILED){
+            _sqRing=nullptr;
+            return;
+        }
+        if(singleMap){
+            _cqRing=_sqRing;
+        }else{
+            _cqRing=::mmap(nullptr, _cqRingSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+            if(_cqRing==MAP_FAILED){
+                _cqRing=nullptr;
+                return;
+            }
+        }
+        _sqesSize=params.sq_entries*sizeof(io_uring_sqe);
+        _sqes=(io_uring_sqe*)::mmap(nullptr, _sqesSize, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, _fd, IORING_OFF_SQES);
+        if(_sqes==MAP_FAILED){
+            _sqes=nullptr;
+            return;
+        }
+        auto sq=(char*)_sqRing;
+        _sqHead=(unsigned*)(sq+params.sq_off.head);
+        _sqTail=(unsigned*)(sq+params.sq_off.tail);
+        _sqMask=*(unsigned*)(sq+params.sq_off.ring_mask);
+        _sqEntries=params.sq_entries;
+        _sqArray=(unsigned*)(sq+params.sq_off.array);
+        auto cq=(char*)_cqRing;
+        _cqHead=(unsigned*)(cq+params.cq_off.head);
+        _cqTail=(unsigned*)(cq+params.cq_off.tail);
+        _cqMask=*(unsigned*)(cq+params.cq_off.ring_mask);
+        _cqes=(io_uring_cqe*)(cq+params.cq_off.cqes);
+
+        _buffer.reset(new char[bufferSize]);
+        iovec iov{_buffer.get(), bufferSize};
+        if(::syscall(__NR_io_uring_register, _fd, IORING_REGISTER_BUFFERS, &iov, 1)<0){
+            return;
+        }
+        _valid=this->supports({IORING_OP_CONNECT, IORING_OP_SEND, IORING_OP_READ_FIXED, IORING_OP_LINK_TIMEOUT});
+    }
+
+    ~IoUring(){
+        if(_sqes){
+            ::munmap(_sqes, _sqesSize);
+        }
+        if(_cqRing && _cqRing!=_sqRing){
+            ::munmap(_cqRing, _cqRingSize);
+        }
+        if(_sqRing){
+            ::munmap(_sqRing, _sqRingSize);
+        }
+        if(_fd>=0){
+            ::close(_fd);
+        }
+    }
+
+    IoUring(const IoUring&)=delete;
+    IoUring& operator=(const IoUring&)=delete;
+
+    /**
+     *  Ring of the calling thread, nullptr if io_uring isn't available (old kernel, seccomp,
+     *  `kernel.io_uring_disabled`).
+     */
+    static IoUring* threadLocal(){
+        thread_local IoUring ring;
+        return ring._valid?&ring:nullptr;
+    }
+
+    bool valid() const{
+        return _valid;
+    }
+
+    /**
+     *  Registered buffer (index 0) receives go to.
+     */
+    char* buffer() const{
+        return _buffer.get();
+    }
+
+    /**
+     *  True if `count` more entries can be prepared. Check before preparing a linked chain so
+     *  it isn't cut in the middle: `prepare` can't fail after that.
+     */
+    bool available(unsigned count) const{
+        auto used=*_sqTail+_prepared-__atomic_load_n(_sqHead, __ATOMIC_ACQUIRE);
+        return used+count<=_sqEntries;
+    }
+
+    /**
+     *  Next free submission entry (zeroed) or nullptr if the queue is full. It's submitted
+     *  with the next `submitAndWait`.
+     */
+    io_uring_sqe* prepare(uint8_t opcode,int fd,uint64_t &tag){
+        auto tail=*_sqTail+_prepared;
+        if(tail-__atomic_load_n(_sqHead, __ATOMIC_ACQUIRE)>=_sqEntries){
+            return nullptr;
+        }
+        auto index=tail&_sqMask;
+        auto sqe=&_sqes[index];
+        ::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode=opcode;
+        sqe->fd=fd;
+        tag=++_lastTag;
+        sqe->user_data=tag;
+        _sqArray[index]=index;
+        ++_prepared;
+        return sqe;
+    }
+
+    /**
+     *  Timeout for the previously prepared (linked) operation. It's cancelled with -ECANCELED
+     *  when the time is up.
+     */
+    io_uring_sqe* prepareLinkTimeout(io_uring_sqe *operation,const __kernel_timespec *timeout,uint64_t &tag){
+        operation->flags|=IOSQE_IO_LINK;
+        auto sqe=this->prepare(IORING_OP_LINK_TIMEOUT, -1, tag);
+        if(sqe){
+            sqe->addr=(uint64_t)timeout;
+            sqe->len=1;
+        }
+        return sqe;
+    }
+
+    /**
+     *  Submits prepared entries and waits for completion of every operation in `tags`. Results
+     *  (bytes or -errno) are stored in the same order. One syscall if nothing has to wait.
+     */
+    bool submitAndWait(const std::vector<uint64_t> &tags,std::vector<int> &results){
+        auto toSubmit=_prepared;
+        if(toSubmit){
+            __atomic_store_n(_sqTail, *_sqTail+toSubmit, __ATOMIC_RELEASE);
+            _prepared=0;
+        }
+        results.assign(tags.size(), 0);
+        auto pending=tags.size();
+        std::vector<bool> done(tags.size(), false);
+        while(true){
+            this->reap();
+            for(size_t i=0;i<tags.size();++i){
+                if(!done[i]){
+                    auto it=_completed.find(tags[i]);
+                    if(it!=_completed.end()){
+                        results[i]=it->second;
+                        _completed.erase(it);
+                        done[i]=true;
+                        --pending;
+                    }
+                }
+            }
+            if(!pending && !toSubmit){
+                return true;
+            }
+            auto res=::syscall(__NR_io_uring_enter, _fd, toSubmit, unsigned(pending), pending?IORING_ENTER_GETEVENTS:0, nullptr, 0);
+            if(res<0){
+                if(errno==EINTR || errno==EAGAIN || errno==EBUSY){
+                    continue;
+                }
+                return false;
+            }
+            toSubmit-=std::min<unsigned>(toSubmit, unsigned(res));
+        }
+    }
+
+    /**
+     *  Converts `timeval` timeout to the form link timeouts take.
+     */
+    static __kernel_timespec timespec(timeval timeout){
+        __kernel_timespec res;
+        res.tv_sec=timeout.tv_sec;
+        res.tv_nsec=(long long)timeout.tv_usec*1000;
+        return res;
+    }
+
+protected:
+    int _fd=-1;
+    bool _valid=false;
+    void *_sqRing=nullptr;
+    void *_cqRing=nullptr;
+    size_t _sqRingSize=0;
+    size_t _cqRingSize=0;
+    io_uring_sqe *_sqes=nullptr;
+    size_t _sqesSize=0;
+    unsigned *_sqHead=nullptr;
+    unsigned *_sqTail=nullptr;
+    unsigned *_sqArray=nullptr;
+    unsigned _sqMask=0;
+    unsigned _sqEntries=0;
+    unsigned *_cqHead=nullptr;
+    unsigned *_cqTail=nullptr;
+    unsigned _cqMask=0;
+    io_uring_cqe *_cqes=nullptr;
+    unsigned _prepared=0;
+    uint64_t _lastTag=0;
+    std::unique_ptr<char[]> _buffer;
+    std::map<uint64_t,int> _completed;
+
+    /**
+     *  Moves all available completions from the ring to `_completed` - no syscall.
+     */
+    void reap(){
+        auto head=*_cqHead;
+        auto tail=__atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        while(head!=tail){
+            const auto &cqe=_cqes[head&_cqMask];
+            _completed[cqe.user_data]=cqe.res;
+            ++head;
+        }
+        __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    bool supports(std::initializer_list<uint8_t> opcodes){
+        const size_t opsCount=256;
+        std::vector<char> storage(sizeof(io_uring_probe)+opsCount*sizeof(io_uring_probe_op), 0);
+        auto probe=(io_uring_probe*)storage.data();
+        if(::syscall(__NR_io_uring_register, _fd, IORING_REGISTER_PROBE, probe, opsCount)<0){
+            return false;
+        }
+        for(auto opcode:opcodes){
+            if(opcode>probe->last_op || !(probe->ops[opcode].flags&IO_URING_OP_SUPPORTED)){
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+/**
+ *  Socket driven through the thread's ring. Must be used on the thread which created it.
+ */
+class UringConnection:public Connection{
+public:
+    UringConnection(IoUring &ring,int fd):
+    _ring(ring),
+    _fd(fd){}
+
+    ~UringConnection(){
+        if(_receivePending){
+            //  completes the in-flight receive so the registered buffer is free again..
+            ::shutdown(_fd, SHUT_RDWR);
+            std::vector<int> results;
+            _ring.submitAndWait(_receiveTags, results);
+        }
+        ::close(_fd);
+    }
+
+    int fd() const override{
+        return _fd;
+    }
+
+    bool plain() const override{
+        return !_receivePending && _leftover.empty();
+    }
+
+    /**
+     *  Connects, sends `data` and starts receiving the response with one submission. Returns
+     *  false if connect or send failed (`connected` tells which).
+     */
+    bool open(const sockaddr *address,socklen_t addressLength,const std::string &data,timeval timeout,bool &connected){
+        static_assert(IoUring::queueDepth>=6, "open() prepares six entries at once");
+        connected=false;
+        _timeouts[0]=_timeouts[1]=_timeouts[2]=IoUring::timespec(timeout);
+        //  connect, send and receive, each with its link timeout..
+        if(!_ring.available(6)){
+            return false;
+        }
+        std::vector<uint64_t> tags(4);
+        auto connect=_ring.prepare(IORING_OP_CONNECT, _fd, tags[0]);
+        connect->addr=(uint64_t)address;
+        connect->off=addressLength;
+        _ring.prepareLinkTimeout(connect, &_timeouts[0], tags[1])->flags|=IOSQE_IO_LINK;
+        auto send=_ring.prepare(IORING_OP_SEND, _fd, tags[2]);
+        send->addr=(uint64_t)data.data();
+        send->len=uint32_t(data.length());
+        send->msg_flags=MSG_NOSIGNAL;
+        _ring.prepareLinkTimeout(send, &_timeouts[1], tags[3])->flags|=IOSQE_IO_LINK;
+        this->prepareReceive();
+        std::vector<int> results;
+        if(!_ring.submitAndWait(tags, results)){
+            return false;
+        }
+        connected=(results[0]==0);
+        if(!connected || results[2]<0){
+            this->finishReceive();
+            return false;
+        }
+        _sent=size_t(results[2]);
+        return true;
+    }
+
+    /**
+     *  Bytes of `data` passed to `open` which were sent.
+     */
+    size_t sent() const{
+        return _sent;
+    }
+
+    bool send(const char *data,size_t length,timeval timeout) override{
+        while(length){
+            _timeouts[1]=IoUring::timespec(timeout);
+            if(!_ring.available(2)){
+                return false;
+            }
+            std::vector<uint64_t> tags(2);
+            auto send=_ring.prepare(IORING_OP_SEND, _fd, tags[0]);
+            send->addr=(uint64_t)data;
+            send->len=uint32_t(std::min<size_t>(length, 1u<<30));
+            send->msg_flags=MSG_NOSIGNAL;
+            _ring.prepareLinkTimeout(send, &_timeouts[1], tags[1]);
+            std::vector<int> results;
+            if(!_ring.submitAndWait(tags, results) || results[0]<=0){
+                return false;
+            }
+            data+=results[0];
+            length-=size_t(results[0]);
+        }
+        return true;
+    }
+
+    long receive(char *buffer,size_t length,timeval timeout) override{
+        if(_leftover.length()){
+            auto count=std::min(length, _leftover.length());
+            ::memcpy(buffer, _leftover.data(), count);
+            _leftover.erase(0, count);
+            return long(count);
+        }
+        if(!_receivePending){
+            if(!_ring.available(2)){
+                return -1;
+            }
+            _timeouts[2]=IoUring::timespec(timeout);
+            this->prepareReceive();
+        }
+        auto res=this->finishReceive();
+        if(res==-ECANCELED || res==-EINTR){
+            return -2;
+        }
+        if(res<0){
+            return -1;
+        }
+        auto count=std::min<size_t>(size_t(res), length);
+        ::memcpy(buffer, _ring.buffer(), count);
+        if(count<size_t(res)){
+            //  caller's buffer is smaller, keep the rest for the next call..
+            _leftover.assign(_ring.buffer()+count, size_t(res)-count);
+        }
+        return long(count);
+    }
+
+protected:
+    IoUring &_ring;
+    int _fd;
+    __kernel_timespec _timeouts[3];
+    std::vector<uint64_t> _receiveTags;
+    bool _receivePending=false;
+    size_t _sent=0;
+    std::string _leftover;
+
+    /**
+     *  Caller checks that two entries are available.
+     */
+    void prepareReceive(){
+        _receiveTags.assign(2, 0);
+        auto receive=_ring.prepare(IORING_OP_READ_FIXED, _fd, _receiveTags[0]);
+        receive->addr=(uint64_t)_ring.buffer();
+        receive->len=uint32_t(IoUring::bufferSize);
+        receive->buf_index=0;
+        _ring.prepareLinkTimeout(receive, &_timeouts[2], _receiveTags[1]);
+        _receivePending=true;
+    }
+
+    int finishReceive(){
+        std::vector<int> results;
+        auto ok=_ring.submitAndWait(_receiveTags, results);
+        _receivePending=false;
+        return ok?results[0]:-EIO;
+    }
+};
@@ -0,0 +1,292 @@
+//
+//  JsonArrayStream.hpp
+//  embeddedRest
+//
+//  Splits a JSON body into elements of one array while bytes are still arriving,
+//  so every record can be processed as soon as it is received and only one record
+//  is kept in memory. The array is either the root value or is found by a path of
+//  object keys, e.g. {"response"} for `{"response":[...]}`.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+
+#include "JsonDecoder.hpp"
+
+class JsonArrayStream{
+public:
+
+    /**
+     *  Receives JSON text of one array element. Return false to stop.
+     */
+    typedef std::function<bool(const char *json,size_t length)> ElementHandler;
+    
+    /**
+     *  Outcome of the stream once the whole body was fed.
+     */
+    enum class Status{
+        complete,       //  target array found and closed
+        notFound,       //  body ended without the target array
+        truncated,      //  body ended inside the JSON text
+        malformed,      //  unbalanced brackets
+        decodeFailed,   //  element didn't match `T` (`decoding` streams only)
+        stopped,        //  handler returned false
+    };
+    
+    JsonArrayStream(ElementHandler elementHandler,std::vector<std::string> path=std::vector<std::string>()):
+    JsonArrayStream([elementHandler](const char *json,size_t length,size_t&){
+        return elementHandler(json, length)?Verdict::accepted:Verdict::stopped;
+    },std::move(path)){}
+    
+    /**
+     *  Stream which decodes every element into `T` with `JsonDecoder` and passes it to `handler`.
+     *  Element which doesn't match `T` stops the stream.
+     */
+    template<class T>
+    static JsonArrayStream decoding(std::function<bool(T&)> handler,std::vector<std::string> path=std::vector<std::string>()){
+        return JsonArrayStream([handler](const char *json,size_t length,size_t &errorOffset){
+            T value;
+            if(!JsonDecoder::decode(json, length, value, &errorOffset)){
+                return Verdict::invalid;
+            }
+            return handler(value)?Verdict::accepted:Verdict::stopped;
+        },std::move(path));
+    }
+    
+    /**
+     *  Consumes next piece of JSON text. Returns false if handler stopped the stream
+     *  or JSON is malformed. Can be used as `ResponseParser::BodyHandler` directly.
+     */
+    bool feed(const char *data,size_t length){
+        for(size_t i=0;i<length && !_stopped;++i,++_offset){
+            this->onChar(data[i]);
+        }
+        return !_stopped;
+    }
+    
+    bool operator()(const char *data,size_t length){
+        return this->feed(data, length);
+    }
+    
+    /**
+     *  Count of elements passed to handler so far.
+     */
+    size_t count() const{
+        return _count;
+    }
+    
+    /**
+     *  True if target array was found and its closing bracket reached.
+     */
+    bool finished() const{
+        return _finished;
+    }
+    
+    bool failed() const{
+        return _failed;
+    }
+    
+    Status status() const{
+        if(_failed){
+            return Status::malformed;
+        }
+        if(_decodeFailed){
+            return Status::decodeFailed;
+        }
+        if(_stopped){
+            return Status::stopped;
+        }
+        if(_finished){
+            return Status::complete;
+        }
+        return (_stack.size() || _inString)?Status::truncated:Status::notFound;
+    }
+    
+    /**
+     *  Body offset where the stream stopped for `malformed`, `decodeFailed` and `stopped`
+     *  (for `decodeFailed` it points into the element), otherwise count of bytes fed.
+     */
+    size_t errorOffset() const{
+        return _stopped?_errorOffset:_offset;
+    }
+
+protected:
+    enum class Verdict{
+        accepted,
+        stopped,
+        invalid,
+    };
+    
+    /**
+     *  Like `ElementHandler`, `errorOffset` (relative to the element) is set for `invalid`.
+     */
+    typedef std::function<Verdict(const char *json,size_t length,size_t &errorOffset)> CheckedElementHandler;
+    
+    JsonArrayStream(CheckedElementHandler elementHandler,std::vector<std::string> path):
+    _elementHandler(std::move(elementHandler)),
+    _path(std::move(path)){}
+    
+    struct Container{
+        char type;          //  '{' or '['
+        bool expectKey;
+        int pathLevel;      //  index in `_path` of the key this object is expected to contain, -1 if off path
+    };
+    
+    CheckedElementHandler _elementHandler;
+    std::vector<std::string> _path;
+    std::vector<Container> _stack;
+    std::string _key;
+    std::string _lastKey;
+    std::string _element;
+    size_t _count=0;
+    size_t _offset=0;
+    size_t _elementOffset=0;
+    size_t _errorOffset=0;
+    size_t _targetDepth=0;      //  stack size when inside target array, 0 if not there
+    bool _inString=false;
+    bool _escape=false;
+    bool _inKey=false;
+    bool _stopped=false;
+    bool _finished=false;
+    bool _failed=false;
+    bool _decodeFailed=false;
+    
+    bool insideTarget() const{
+        return _targetDepth && _stack.size()>=_targetDepth;
+    }
+    
+    void onChar(char c){
+        const auto capturing=this->insideTarget() && !(_stack.size()==_targetDepth && !_inString && (c==',' || c==']'));
+        if(capturing && (_element.length() || !isWhitespace(c))){
+            if(_element.empty()){
+                _elementOffset=_offset;
+            }
+            _element+=c;
+        }
+        if(_inString){
+            if(_escape){
+                _escape=false;
+            }else if(c=='\\'){
+                _escape=true;
+            }else if(c=='"'){
+                _inString=false;
+                if(_inKey){
+                    _inKey=false;
+                    _lastKey=std::move(_key);
+                    _key.clear();
+                }
+                return;
+            }
+            if(_inKey){
+                _key+=c;
+            }
+            return;
+        }
+        switch(c){
+            case '"':{
+                _inString=true;
+                if(_stack.size() && _stack.back().type=='{' && _stack.back().expectKey && _stack.back().pathLevel>=0){
+                    _inKey=true;
+                }
+            }break;
+            case ':':
+                if(_stack.size() && _stack.back().type=='{'){
+                    _stack.back().expectKey=false;
+                }
+                break;
+            case ',':
+                if(_stack.size()==_targetDepth && _targetDepth){
+                    this->flushElement();
+                }else if(_stack.size() && _stack.back().type=='{'){
+                    _stack.back().expectKey=true;
+                }
+                break;
+            case '{':
+            case '[':
+                this->open(c);
+                break;
+            case '}':
+            case ']':
+                if(_stack.empty()){
+                    this->fail();
+                    return;
+                }
+                if(_stack.size()==_targetDepth && _targetDepth){
+                    this->flushElement();
+                    _targetDepth=0;
+                    _finished=true;
+                }
+                _stack.pop_back();
+                break;
+            default:
+                break;
+        }
+    }
+    
+    void open(char type){
+        Container container{type, type=='{', -1};
+        if(!_targetDepth && !_finished){
+            auto isTargetArray=false;
+            if(_stack.empty()){
+                if(_path.empty()){
+                    isTargetArray=(type=='[');
+                }else if(type=='{'){
+                    container.pathLevel=0;
+                }
+            }else{
+                const auto &parent=_stack.back();
+                if(parent.type=='{' && parent.pathLevel>=0 && _lastKey==_path[size_t(parent.pathLevel)]){
+                    if(size_t(parent.pathLevel)+1==_path.size()){
+                        isTargetArray=(type=='[');
+                    }else if(type=='{'){
+                        container.pathLevel=parent.pathLevel+1;
+                    }
+                }
+            }
+            _stack.push_back(container);
+            if(isTargetArray){
+                _targetDepth=_stack.size();
+            }
+            return;
+        }
+        _stack.push_back(container);
+    }
+    
+    void flushElement(){
+        while(_element.length() && isWhitespace(_element.back())){
+            _element.pop_back();
+        }
+        if(_element.empty()){
+            return;
+        }
+        ++_count;
+        size_t errorOffset=0;
+        switch(_elementHandler(_element.data(), _element.length(), errorOffset)){
+            case Verdict::accepted:
+                break;
+            case Verdict::invalid:
+                _decodeFailed=true;
+                _stopped=true;
+                _errorOffset=_elementOffset+errorOffset;
+                break;
+            case Verdict::stopped:
+                _stopped=true;
+                _errorOffset=_offset;
+                break;
+        }
+        _element.clear();
+    }
+    
+    void fail(){
+        _failed=true;
+        _stopped=true;
+        _errorOffset=_offset;
+    }
+    
+    static bool isWhitespace(char c){
+        return c==' ' || c=='\n' || c=='\r' || c=='\t';
+    }
+};
@@ -0,0 +1,420 @@
+//
+//  JsonDecoder.hpp
+//  embeddedRest
+//
+//  Decodes JSON straight into user structs with rapidjson's SAX `Reader` - no DOM
+//  is built. Supported types: bool, arithmetic types, std::string, std::vector<T>,
+//  std::map<std::string,T>, std::shared_ptr<T>, optional<T> and structs which declare
+//  their fields (see JsonFields.hpp). Unknown keys are skipped without allocations.
+//
+//      City city;
+//      if(JsonDecoder::decode(response, city)){
+//          ...
+//      }
+//
+
+#pragma once
+
+#include "rapidjson/reader.h"
+#include "rapidjson/memorystream.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <type_traits>
+#include <cstdint>
+
+#include "JsonFields.hpp"
+#include "JsonValueAdapter.hpp"
+#include "Response.hpp"
+
+class JsonDecoder;
+
+/**
+ *  One SAX value event: a scalar or beginning of an object/array.
+ */
+struct JsonEvent{
+    enum Type{
+        null,
+        boolean,
+        integer,
+        unsignedInteger,
+        number,
+        string,
+        startObject,
+        startArray,
+    };
+    
+    Type type;
+    union{
+        bool b;
+        int64_t i;
+        uint64_t u;
+        double d;
+    };
+    const char *s=nullptr;
+    size_t length=0;
+    
+    JsonEvent(Type type_):type(type_),u(0){}
+    
+    bool isNumber() const{
+        return this->type==integer || this->type==unsignedInteger || this->type==number;
+    }
+};
+
+/**
+ *  Decodes a value of type `T` starting with `event`. Composite types push a frame
+ *  to the decoder and get subsequent events through it.
+ */
+template<class T,class Enable=void>
+struct JsonValueDecoder;
+
+class JsonDecoder{
+public:
+
+    /**
+     *  Container being decoded at the moment.
+     */
+    struct Frame{
+        virtual ~Frame(){}
+        
+        virtual bool key(JsonDecoder &decoder,const char *key,size_t length){
+            (void)decoder;
+            (void)key;
+            (void)length;
+            return false;
+        }
+        
+        virtual bool value(JsonDecoder &decoder,const JsonEvent &event)=0;
+        
+        /**
+         *  EndObject/EndArray of this container.
+         */
+        virtual bool end(JsonDecoder &decoder){
+            (void)decoder;
+            return true;
+        }
+    };
+    
+    /**
+     *  Returns false on malformed JSON or if JSON doesn't match `T` (e.g. string
+     *  where number is expected). `value` can be partially filled then.
+     */
+    template<class T>
+    static bool decode(const char *data,size_t length,T &value,size_t *errorOffset=nullptr){
+        JsonDecoder decoder;
+        decoder.push(std::unique_ptr<Frame>(new RootFrame<T>(value)));
+        rapidjson::MemoryStream stream(data, length);
+        rapidjson::Reader reader;
+        auto result=reader.Parse<rapidjson::kParseDefaultFlags>(stream, decoder);
+        if(result.IsError()){
+            if(errorOffset){
+                *errorOffset=result.Offset();
+            }
+            return false;
+        }
+        return true;
+    }
+    
+    template<class T>
+    static bool decode(const std::string &json,T &value,size_t *errorOffset=nullptr){
+        return decode(json.data(), json.length(), value, errorOffset);
+    }
+    
+    template<class T>
+    static bool decode(const Response &response,T &value,size_t *errorOffset=nullptr){
+        return decode(response.bodyData(), response.bodySize(), value, errorOffset);
+    }
+    
+    void push(std::unique_ptr<Frame> frame){
+        _stack.push_back(std::move(frame));
+    }
+    
+    /**
+     *  Swallows the value which starts with `event` (used for unknown keys).
+     */
+    bool skip(const JsonEvent &event){
+        if(event.type==JsonEvent::startObject || event.type==JsonEvent::startArray){
+            _skipDepth=1;
+        }
+        return true;
+    }
+    
+    //  rapidjson SAX handler interface..
+    
+    bool Null(){
+        return this->onValue(JsonEvent(JsonEvent::null));
+    }
+    
+    bool Bool(bool b){
+        JsonEvent event(JsonEvent::boolean);
+        event.b=b;
+        return this->onValue(event);
+    }
+    
+    bool Int(int i){
+        return this->Int64(i);
+    }
+    
+    bool Uint(unsigned u){
+        return this->Uint64(u);
+    }
+    
+    bool Int64(int64_t i){
+        JsonEvent event(JsonEvent::integer);
+        event.i=i;
+        return this->onValue(event);
+    }
+    
+    bool Uint64(uint64_t u){
+        JsonEvent event(JsonEvent::unsignedInteger);
+        event.u=u;
+        return this->onValue(event);
+    }
+    
+    bool Double(double d){
+        JsonEvent event(JsonEvent::number);
+        event.d=d;
+        return this->onValue(event);
+    }
+    
+    bool RawNumber(const char *str,rapidjson::SizeType length,bool copy){
+        return this->String(str, length, copy);
+    }
+    
+    bool String(const char *str,rapidjson::SizeType length,bool){
+        JsonEvent event(JsonEvent::string);
+        event.s=str;
+        event.length=length;
+        return this->onValue(event);
+    }
+    
+    bool StartObject(){
+        return this->onValue(JsonEvent(JsonEvent::startObject));
+    }
+    
+    bool Key(const char *str,rapidjson::SizeType length,bool){
+        if(_skipDepth){
+            return true;
+        }
+        return _stack.back()->key(*this, str, length);
+    }
+    
+    bool EndObject(rapidjson::SizeType){
+        return this->onEnd();
+    }
+    
+    bool StartArray(){
+        return this->onValue(JsonEvent(JsonEvent::startArray));
+    }
+    
+    bool EndArray(rapidjson::SizeType){
+        return this->onEnd();
+    }
+
+protected:
+    std::vector<std::unique_ptr<Frame>> _stack;
+    size_t _skipDepth=0;
+    
+    template<class T>
+    struct RootFrame:Frame{
+        T &target;
+        
+        RootFrame(T &target_):target(target_){}
+        
+        bool value(JsonDecoder &decoder,const JsonEvent &event) override{
+            return JsonValueDecoder<T>::decode(decoder, event, this->target);
+        }
+    };
+    
+    bool onValue(const JsonEvent &event){
+        if(_skipDepth){
+            if(event.type==JsonEvent::startObject || event.type==JsonEvent::startArray){
+                ++_skipDepth;
+            }
+            return true;
+        }
+        return _stack.back()->value(*this, event);
+    }
+    
+    bool onEnd(){
+        if(_skipDepth){
+            --_skipDepth;
+            return true;
+        }
+        auto res=_stack.back()->end(*this);
+        _stack.pop_back();
+        return res;
+    }
+};
+
+template<class T>
+struct JsonValueDecoder<T,typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T,bool>::value>::type>{
+
+    static bool decode(JsonDecoder&,const JsonEvent &event,T &value){
+        switch(event.type){
+            case JsonEvent::integer:
+                value=T(event.i);
+                return true;
+            case JsonEvent::unsignedInteger:
+                value=T(event.u);
+                return true;
+            case JsonEvent::number:
+                value=T(event.d);
+                return true;
+            default:
+                return false;
+        }
+    }
+};
+
+template<>
+struct JsonValueDecoder<bool>{
+
+    static bool decode(JsonDecoder&,const JsonEvent &event,bool &value){
+        if(event.type!=JsonEvent::boolean){
+            return false;
+        }
+        value=event.b;
+        return true;
+    }
+};
+
+template<>
+struct JsonValueDecoder<std::string>{
+
+    static bool decode(JsonDecoder&,const JsonEvent &event,std::string &value){
+        if(event.type!=JsonEvent::string){
+            return false;
+        }
+        value.assign(event.s, event.length);
+        return true;
+    }
+};
+
+template<class T>
+struct JsonValueDecoder<std::vector<T>>{
+
+    struct ArrayFrame:JsonDecoder::Frame{
+        std::vector<T> &target;
+        
+        ArrayFrame(std::vector<T> &target_):target(target_){}
+        
+        bool value(JsonDecoder &decoder,const JsonEvent &event) override{
+            this->target.emplace_back();
+            return JsonValueDecoder<T>::decode(decoder, event, this->target.back());
+        }
+    };
+    
+    static bool decode(JsonDecoder &decoder,const JsonEvent &event,std::vector<T> &value){
+        value.clear();
+        if(event.type==JsonEvent::null){
+            return true;
+        }
+        if(event.type!=JsonEvent::startArray){
+            return false;
+        }
+        decoder.push(std::unique_ptr<JsonDecoder::Frame>(new ArrayFrame(value)));
+        return true;
+    }
+};
+
+template<class T>
+struct JsonValueDecoder<std::map<std::string,T>>{
+
+    struct MapFrame:JsonDecoder::Frame{
+        std::map<std::string,T> &target;
+        T *current=nullptr;
+        
+        MapFrame(std::map<std::string,T> &target_):target(target_){}
+        
+        bool key(JsonDecoder&,const char *key,size_t length) override{
+            this->current=&this->target[std::string(key, length)];
+            return true;
+        }
+        
+        bool value(JsonDecoder &decoder,const JsonEvent &event) override{
+            return JsonValueDecoder<T>::decode(decoder, event, *this->current);
+        }
+    };
+    
+    static bool decode(JsonDecoder &decoder,const JsonEvent &event,std::map<std::string,T> &value){
+        value.clear();
+        if(event.type==JsonEvent::null){
+            return true;
+        }
+        if(event.type!=JsonEvent::startObject){
+            return false;
+        }
+        decoder.push(std::unique_ptr<JsonDecoder::Frame>(new MapFrame(value)));
+        return true;
+    }
+};
+
+template<class T>
+struct JsonValueDecoder<std::shared_ptr<T>>{
+
+    static bool decode(JsonDecoder &decoder,const JsonEvent &event,std::shared_ptr<T> &value){
+        if(event.type==JsonEvent::null){
+            value.reset();
+            return true;
+        }
+        value=std::make_shared<T>();
+        return JsonValueDecoder<T>::decode(decoder, event, *value);
+    }
+};
+
+#if HAS_CPP14_OPTIONAL==1
+template<class T>
+struct JsonValueDecoder<std::experimental::optional<T>>{
+
+    static bool decode(JsonDecoder &decoder,const JsonEvent &event,std::experimental::optional<T> &value){
+        if(event.type==JsonEvent::null){
+            value=std::experimental::nullopt;
+            return true;
+        }
+        value=T();
+        return JsonValueDecoder<T>::decode(decoder, event, *value);
+    }
+};
+#endif
+
+template<class T>
+struct JsonValueDecoder<T,typename std::enable_if<HasJsonFields<T>::value>::type>{
+
+    struct ObjectFrame:JsonDecoder::Frame{
+        T &target;
+        int current=-1;
+        
+        ObjectFrame(T &target_):target(target_){}
+        
+        static const decltype(JsonFields<T>::fields())& fields(){
+            static const auto res=JsonFields<T>::fields();
+            return res;
+        }
+        
+        bool key(JsonDecoder&,const char *key,size_t length) override{
+            this->current=findJsonField(fields(), key, length);
+            return true;
+        }
+        
+        bool value(JsonDecoder &decoder,const JsonEvent &event) override{
+            if(this->current<0){
+                return decoder.skip(event);
+            }
+            auto &target=this->target;
+            return visitJsonField(fields(), size_t(this->current), [&decoder,&event,&target](const auto &field){
+                typedef typename std::decay<decltype(field)>::type::member_type Member;
+                return JsonValueDecoder<Member>::decode(decoder, event, target.*(field.member));
+            });
+        }
+    };
+    
+    static bool decode(JsonDecoder &decoder,const JsonEvent &event,T &value){
+        if(event.type!=JsonEvent::startObject){
+            return false;
+        }
+        decoder.push(std::unique_ptr<JsonDecoder::Frame>(new ObjectFrame(value)));
+        return true;
+    }
+};
@@ -0,0 +1,223 @@
+//
+//  JsonEncoder.hpp
+//  embeddedRest
+//
+//  Writes values straight to rapidjson `Writer` - the counterpart of JsonDecoder.
+//  Structs which declare their fields (see JsonFields.hpp) are written with keys
+//  taken from the compile time literals, no `JsonValueAdapter` tree is built.
+//  Supported types: bool, arithmetic types, strings, std::vector<T>,
+//  std::map<std::string,T>, std::shared_ptr<T>, optional<T>, field-declared structs,
+//  `JsonValueAdapter` and types with `jsonObject()`.
+//
+//      request.bodyJson(city);
+//      auto json=JsonEncoder::encode(cities);
+//
+
+#pragma once
+
+#include "rapidjson/stringbuffer.h"
+#include "rapidjson/writer.h"
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+
+#include "JsonFields.hpp"
+#include "JsonValueAdapter.hpp"
+
+/**
+ *  Writes value of type `T` to `writer`.
+ */
+template<class T,class Enable=void>
+struct JsonValueEncoder;
+
+class JsonEncoder{
+public:
+
+    template<class T>
+    static std::string encode(const T &value){
+        rapidjson::StringBuffer buffer;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(buffer);
+        write(writer, value);
+        return std::string(buffer.GetString(), buffer.GetSize());
+    }
+    
+    template<class Writer,class T>
+    static void write(Writer &writer,const T &value){
+        JsonValueEncoder<T>::encode(writer, value);
+    }
+};
+
+template<>
+struct JsonValueEncoder<bool>{
+
+    template<class Writer>
+    static void encode(Writer &writer,bool value){
+        writer.Bool(value);
+    }
+};
+
+template<class T>
+struct JsonValueEncoder<T,typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value>::type>{
+
+    template<class Writer>
+    static void encode(Writer &writer,T value){
+        writer.Int64(int64_t(value));
+    }
+};
+
+template<class T>
+struct JsonValueEncoder<T,typename std::enable_if<std::is_integral<T>::value && std::is_unsigned<T>::value && !std::is_same<T,bool>::value>::type>{
+
+    template<class Writer>
+    static void encode(Writer &writer,T value){
+        writer.Uint64(uint64_t(value));
+    }
+};
+
+/**
+ *  Integral values are written without fraction like `JsonValueAdapter` does.
+ */
+template<class T>
+struct JsonValueEncoder<T,typename std::enable_if<std::is_floating_point<T>::value>::type>{
+
+    template<class Writer>
+    static void encode(Writer &writer,T value){
+        const auto d=double(value);
+        if(std::isfinite(d) && d==std::floor(d) && std::abs(d)<9007199254740992.0){
+            writer.Int64(int64_t(d));
+        }else{
+            writer.Double(d);
+        }
+    }
+};
+
+template<>
+struct JsonValueEncoder<std::string>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const std::string &value){
+        writer.String(value.data(), rapidjson::SizeType(value.length()));
+    }
+};
+
+template<>
+struct JsonValueEncoder<const char*>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const char *value){
+        if(value){
+            writer.String(value, rapidjson::SizeType(::strlen(value)));
+        }else{
+            writer.Null();
+        }
+    }
+};
+
+template<size_t N>
+struct JsonValueEncoder<char[N]>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const char (&value)[N]){
+        writer.String(value, rapidjson::SizeType(::strlen(value)));
+    }
+};
+
+template<class T>
+struct JsonValueEncoder<std::vector<T>>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const std::vector<T> &value){
+        writer.StartArray();
+        for(const auto &element:value){
+            JsonValueEncoder<T>::encode(writer, element);
+        }
+        writer.EndArray();
+    }
+};
+
+template<class T>
+struct JsonValueEncoder<std::map<std::string,T>>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const std::map<std::string,T> &value){
+        writer.StartObject();
+        for(const auto &p:value){
+            writer.Key(p.first.data(), rapidjson::SizeType(p.first.length()));
+            JsonValueEncoder<T>::encode(writer, p.second);
+        }
+        writer.EndObject();
+    }
+};
+
+template<class T>
+struct JsonValueEncoder<std::shared_ptr<T>>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const std::shared_ptr<T> &value){
+        if(value){
+            JsonValueEncoder<T>::encode(writer, *value);
+        }else{
+            writer.Null();
+        }
+    }
+};
+
+#if HAS_CPP14_OPTIONAL==1
+template<class T>
+struct JsonValueEncoder<std::experimental::optional<T>>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const std::experimental::optional<T> &value){
+        if(value){
+            JsonValueEncoder<T>::encode(writer, *value);
+        }else{
+            writer.Null();
+        }
+    }
+};
+#endif
+
+template<class T>
+struct JsonValueEncoder<T,typename std::enable_if<HasJsonFields<T>::value>::type>{
+
+    static const decltype(JsonFields<T>::fields())& fields(){
+        static const auto res=JsonFields<T>::fields();
+        return res;
+    }
+    
+    template<class Writer>
+    static void encode(Writer &writer,const T &value){
+        writer.StartObject();
+        forEachJsonField(fields(), [&writer,&value](const auto &field){
+            typedef typename std::decay<decltype(field)>::type::member_type Member;
+            writer.Key(field.name, rapidjson::SizeType(field.nameLength));
+            JsonValueEncoder<Member>::encode(writer, value.*(field.member));
+        });
+        writer.EndObject();
+    }
+};
+
+template<>
+struct JsonValueEncoder<JsonValueAdapter>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const JsonValueAdapter &value){
+        value.write(writer);
+    }
+};
+
+/**
+ *  Types which still build their `jsonObject()` can be mixed with field-declared ones.
+ */
+template<class T>
+struct JsonValueEncoder<T,typename std::enable_if<HasJsonObject<T>::value && !HasJsonFields<T>::value>::type>{
+
+    template<class Writer>
+    static void encode(Writer &writer,const T &value){
+        JsonValueAdapter(value.jsonObject()).write(writer);
+    }
+};
@@ -0,0 +1,117 @@
+//
+//  JsonFields.hpp
+//  embeddedRest
+//
+//  Field list declaration which maps JSON object keys to struct members. A type
+//  declares its fields once:
+//
+//      struct City{
+//          int id;
+//          std::string title;
+//
+//          static constexpr auto jsonFields(){
+//              return std::make_tuple(jsonField("cid", &City::id),
+//                                     jsonField("title", &City::title));
+//          }
+//      };
+//
+//  or, for types you can't modify, specializes `JsonFields<T>` with the same `fields()`.
+//
+
+#pragma once
+
+#include <tuple>
+#include <utility>
+#include <type_traits>
+#include <cstring>
+#include <cstddef>
+
+template<class C,class M>
+struct JsonField{
+    typedef C class_type;
+    typedef M member_type;
+    
+    const char *name;
+    size_t nameLength;
+    M C::*member;
+    
+    constexpr JsonField(const char *name_,size_t nameLength_,M C::*member_):
+    name(name_),
+    nameLength(nameLength_),
+    member(member_){}
+    
+    bool matches(const char *key,size_t keyLength) const{
+        return keyLength==this->nameLength && ::memcmp(key, this->name, keyLength)==0;
+    }
+};
+
+/**
+ *  Name length is taken from the literal at compile time.
+ */
+template<class C,class M,size_t N>
+constexpr JsonField<C,M> jsonField(const char (&name)[N],M C::*member){
+    return JsonField<C,M>(name, N-1, member);
+}
+
+template<class T>
+struct JsonFields{
+
+    template<class U=T>
+    static constexpr auto fields() -> decltype(U::jsonFields()){
+        return U::jsonFields();
+    }
+};
+
+template<class T,class=void>
+struct HasJsonFields:std::false_type{};
+
+template<class T>
+struct HasJsonFields<T,decltype(void(JsonFields<T>::fields()))>:std::true_type{};
+
+/**
+ *  Calls `f(field)` for every field of a tuple returned by `JsonFields<T>::fields()`.
+ */
+template<class Tuple,class F,size_t... I>
+void forEachJsonField(const Tuple &fields,F &&f,std::index_sequence<I...>){
+    using Expander=int[];
+    (void)Expander{0,(f(std::get<I>(fields)),0)...};
+}
+
+template<class Tuple,class F>
+void forEachJsonField(const Tuple &fields,F &&f){
+    forEachJsonField(fields, std::forward<F>(f), std::make_index_sequence<std::tuple_size<Tuple>::value>());
+}
+
+/**
+ *  Calls `f(field)` for the field number `index` only. Returns false if index is out of range.
+ */
+template<size_t I=0,class Tuple,class F>
+typename std::enable_if<(I==std::tuple_size<Tuple>::value),bool>::type
+visitJsonField(const Tuple&,size_t,F&&){
+    return false;
+}
+
+template<size_t I=0,class Tuple,class F>
+typename std::enable_if<(I<std::tuple_size<Tuple>::value),bool>::type
+visitJsonField(const Tuple &fields,size_t index,F &&f){
+    if(index==I){
+        return f(std::get<I>(fields));
+    }
+    return visitJsonField<I+1>(fields, index, std::forward<F>(f));
+}
+
+/**
+ *  Returns index of field named `key` or -1.
+ */
+template<class Tuple>
+int findJsonField(const Tuple &fields,const char *key,size_t keyLength){
+    auto res=-1;
+    auto index=0;
+    forEachJsonField(fields, [&res,&index,key,keyLength](const auto &field){
+        if(res<0 && field.matches(key, keyLength)){
+            res=index;
+        }
+        ++index;
+    });
+    return res;
+}
@@ -24,14 +24,39 @@
 #endif
 
 #include <ctime>
+#include <cstring>
+#include <cstdint>
+#include <type_traits>
+
+#include "JsonFields.hpp"
+
+template<class T,class=void>
+struct HasJsonObject:std::false_type{};
+
+template<class T>
+struct HasJsonObject<T,decltype(void(std::declval<const T&>().jsonObject()))>:std::true_type{};
 
 struct JsonValueAdapter{
     JsonValueAdapter()=delete;
     
-    template<class T>
+    template<class T,typename std::enable_if<HasJsonObject<T>::value,int>::type=0>
     JsonValueAdapter(const T &t):
     JsonValueAdapter(t.jsonObject()){}
     
+    /**
+     *  Types with declared fields (see JsonFields.hpp). Prefer `JsonEncoder` for them -
+     *  it writes such types without building a tree.
+     */
+    template<class T,typename std::enable_if<HasJsonFields<T>::value && !HasJsonObject<T>::value,int>::type=0>
+    JsonValueAdapter(const T &t):
+    JsonValueAdapter([&t]{
+        Object_t obj;
+        forEachJsonField(JsonFields<T>::fields(), [&t,&obj](const auto &field){
+            obj.emplace_back(std::string(field.name, field.nameLength), JsonValueAdapter(t.*(field.member)));
+        });
+        return obj;
+    }()){}
+    
     JsonValueAdapter(const char *s){
         _data=new std::string(s);
         _type=rapidjson::kStringType;
@@ -44,6 +69,9 @@ struct JsonValueAdapter{
     
     JsonValueAdapter(int i):JsonValueAdapter(double(i)){}
     
+    template<class T,typename std::enable_if<std::is_arithmetic<T>::value && !std::is_same<T,bool>::value,int>::type=0>
+    JsonValueAdapter(T n):JsonValueAdapter(double(n)){}
+    
     JsonValueAdapter(bool b){
         _data=new decltype(b)(b);
         _type=(b)?rapidjson::kTrueType:rapidjson::kFalseType;
@@ -53,7 +81,7 @@ struct JsonValueAdapter{
     JsonValueAdapter(dateToString(timeValue,format)){}
     
     template<class T>
-    JsonValueAdapter(std::shared_ptr<T> ptr):_type(rapidjson::kNullType){
+    JsonValueAdapter(const std::shared_ptr<T> &ptr):_type(rapidjson::kNullType){
         if(ptr){
             JsonValueAdapter other(*ptr);
             *this=std::move(other);
@@ -65,7 +93,7 @@ struct JsonValueAdapter{
     
 #if HAS_CPP14_OPTIONAL==1
     template<class T>
-    JsonValueAdapter(std::experimental::optional<T> ptr):_type(rapidjson::kNullType){
+    JsonValueAdapter(const std::experimental::optional<T> &ptr):_type(rapidjson::kNullType){
         if(ptr){
             JsonValueAdapter other(*ptr);
             *this=std::move(other);
@@ -85,25 +113,24 @@ struct JsonValueAdapter{
     }
     
     template<class T>
-    JsonValueAdapter(std::map<std::string,T> map):JsonValueAdapter(std::move([&map]{
+    JsonValueAdapter(const std::map<std::string,T> &map):JsonValueAdapter([&map]{
         Object_t obj;
         obj.reserve(map.size());
         for(auto &p:map){
-            obj.push_back({p.first,p.second.jsonObject()});
+            obj.emplace_back(p.first, JsonValueAdapter(p.second));
         }
-        return std::move(obj);
-    }())){}
+        return obj;
+    }()){}
     
     template<class T>
-    JsonValueAdapter(std::vector<T> v):JsonValueAdapter(std::move([&v]{
+    JsonValueAdapter(const std::vector<T> &v):JsonValueAdapter([&v]{
         Array_t a;
         a.reserve(v.size());
         for(auto &obj:v){
-            //            a.push_back(obj.jsonObject());
             a.push_back(JsonValueAdapter(obj));
         }
-        return std::move(a);
-    }())){}
+        return a;
+    }()){}
     
     JsonValueAdapter(Array_t a){
         _data=new decltype(a)(std::move(a));
@@ -214,42 +241,206 @@ struct JsonValueAdapter{
     }
     
     std::string toString()const{
-        rapidjson::Document d;
+        rapidjson::StringBuffer buffer;
+        rapidjson::Writer<decltype(buffer)> writer(buffer);
+        this->write(writer);
+        return buffer.GetString();
+    }
+    
+    /**
+     *  Writes value straight to rapidjson `Writer` (no intermediate `Document`).
+     */
+    template<class Writer>
+    void write(Writer &writer)const{
         switch(_type){
             case rapidjson::kStringType:
-                //                d.SetString(this->string().c_str(),int(this->string().length()));
-                d.SetString(this->string().c_str(),d.GetAllocator());
+                writer.String(this->string().c_str(), rapidjson::SizeType(this->string().length()));
                 break;
             case rapidjson::kNumberType:{
                 const auto doubleValue=this->dbl();
-                if(double_is_int(doubleValue)){
-                    d.SetInt(int(doubleValue));
+                if(double_is_int(doubleValue) && std::abs(doubleValue)<9007199254740992.0){
+                    writer.Int64(int64_t(doubleValue));
                 }else{
-                    d.SetDouble(doubleValue);
+                    writer.Double(doubleValue);
                 }
             }break;
             case rapidjson::kArrayType:
-                d.SetArray();
-                encodeJsonArray(this->array(), d, d.GetAllocator());
+                writer.StartArray();
+                for(auto &value:this->array()){
+                    value.write(writer);
+                }
+                writer.EndArray();
                 break;
             case rapidjson::kObjectType:
-                d.SetObject();
-                encodeJsonObject(this->object(), d,d.GetAllocator());
+                writer.StartObject();
+                for(auto &p:this->object()){
+                    writer.Key(p.first.c_str(), rapidjson::SizeType(p.first.length()));
+                    p.second.write(writer);
+                }
+                writer.EndObject();
                 break;
             case rapidjson::kTrueType:
             case rapidjson::kFalseType:
-                d.SetBool(this->boolean());
+                writer.Bool(this->boolean());
                 break;
-            case rapidjson::kNullType:{
-                d.SetNull();
+            case rapidjson::kNullType:
+                writer.Null();
+                break;
+            default:
+                break;
+        }
+    }
+    
+    /**
+     *  Same value tree as MessagePack. Integral numbers are written as integers, others as
+     *  float 32 when it's exact and float 64 otherwise.
+     */
+    std::string toMsgpack()const{
+        std::string res;
+        this->writeMsgpack(res);
+        return res;
+    }
+    
+    void writeMsgpack(std::string &out)const{
+        switch(_type){
+            case rapidjson::kStringType:
+                appendMsgpackString(out, this->string());
+                break;
+            case rapidjson::kNumberType:{
+                const auto doubleValue=this->dbl();
+                if(double_is_int(doubleValue) && std::abs(doubleValue)<9007199254740992.0){
+                    const auto integer=int64_t(doubleValue);
+                    if(integer>=0){
+                        if(integer<128){
+                            out+=char(integer);
+                        }else if(integer<=0xff){
+                            out+=char(0xcc);
+                            appendBigEndian(out, uint64_t(integer), 1);
+                        }else if(integer<=0xffff){
+                            out+=char(0xcd);
+                            appendBigEndian(out, uint64_t(integer), 2);
+                        }else if(integer<=0xffffffffll){
+                            out+=char(0xce);
+                            appendBigEndian(out, uint64_t(integer), 4);
+                        }else{
+                            out+=char(0xcf);
+                            appendBigEndian(out, uint64_t(integer), 8);
+                        }
+                    }else if(integer>=-32){
+                        out+=char(integer);
+                    }else if(integer>=-128){
+                        out+=char(0xd0);
+                        appendBigEndian(out, uint64_t(integer), 1);
+                    }else if(integer>=-32768){
+                        out+=char(0xd1);
+                        appendBigEndian(out, uint64_t(integer), 2);
+                    }else if(integer>=-2147483648ll){
+                        out+=char(0xd2);
+                        appendBigEndian(out, uint64_t(integer), 4);
+                    }else{
+                        out+=char(0xd3);
+                        appendBigEndian(out, uint64_t(integer), 8);
+                    }
+                }else{
+                    appendFloat(out, doubleValue, char(0xca), char(0xcb));
+                }
             }break;
+            case rapidjson::kArrayType:{
+                const auto count=this->array().size();
+                if(count<16){
+                    out+=char(0x90|count);
+                }else if(count<=0xffff){
+                    out+=char(0xdc);
+                    appendBigEndian(out, count, 2);
+                }else{
+                    out+=char(0xdd);
+                    appendBigEndian(out, count, 4);
+                }
+                for(auto &value:this->array()){
+                    value.writeMsgpack(out);
+                }
+            }break;
+            case rapidjson::kObjectType:{
+                const auto count=this->object().size();
+                if(count<16){
+                    out+=char(0x80|count);
+                }else if(count<=0xffff){
+                    out+=char(0xde);
+                    appendBigEndian(out, count, 2);
+                }else{
+                    out+=char(0xdf);
+                    appendBigEndian(out, count, 4);
+                }
+                for(auto &p:this->object()){
+                    appendMsgpackString(out, p.first);
+                    p.second.writeMsgpack(out);
+                }
+            }break;
+            case rapidjson::kTrueType:
+            case rapidjson::kFalseType:
+                out+=char(this->boolean()?0xc3:0xc2);
+                break;
+            case rapidjson::kNullType:
+                out+=char(0xc0);
+                break;
+            default:
+                break;
+        }
+    }
+    
+    /**
+     *  Same value tree as CBOR (RFC 8949), definite lengths only. Numbers are written like
+     *  in `toMsgpack`.
+     */
+    std::string toCbor()const{
+        std::string res;
+        this->writeCbor(res);
+        return res;
+    }
+    
+    void writeCbor(std::string &out)const{
+        switch(_type){
+            case rapidjson::kStringType:
+                appendCborHead(out, 3, this->string().length());
+                out+=this->string();
+                break;
+            case rapidjson::kNumberType:{
+                const auto doubleValue=this->dbl();
+                if(double_is_int(doubleValue) && std::abs(doubleValue)<9007199254740992.0){
+                    const auto integer=int64_t(doubleValue);
+                    if(integer>=0){
+                        appendCborHead(out, 0, uint64_t(integer));
+                    }else{
+                        appendCborHead(out, 1, uint64_t(-1-integer));
+                    }
+                }else{
+                    appendFloat(out, doubleValue, char(0xfa), char(0xfb));
+                }
+            }break;
+            case rapidjson::kArrayType:
+                appendCborHead(out, 4, this->array().size());
+                for(auto &value:this->array()){
+                    value.writeCbor(out);
+                }
+                break;
+            case rapidjson::kObjectType:
+                appendCborHead(out, 5, this->object().size());
+                for(auto &p:this->object()){
+                    appendCborHead(out, 3, p.first.length());
+                    out+=p.first;
+                    p.second.writeCbor(out);
+                }
+                break;
+            case rapidjson::kTrueType:
+            case rapidjson::kFalseType:
+                out+=char(this->boolean()?0xf5:0xf4);
+                break;
+            case rapidjson::kNullType:
+                out+=char(0xf6);
+                break;
             default:
                 break;
         }
-        rapidjson::StringBuffer buffer;
-        rapidjson::Writer<decltype(buffer)> writer(buffer);
-        d.Accept(writer);
-        return buffer.GetString();
     }
     
     static std::string dateToString(const struct tm &timeValue,const std::string &format="%Y-%m-%d"){
@@ -298,86 +489,63 @@ protected:
         _type=rapidjson::kNullType;
     }
     
-    static void encodeJsonArray(const Array_t &a,rapidjson::Value &d,rapidjson::Document::AllocatorType &allocator){
-        for(auto &value:a){
-            switch(value.type()){
-                case rapidjson::kStringType:{
-                    d.PushBack(rapidjson::Value(value.string().c_str(),allocator).Move(), allocator);
-                }break;
-                case rapidjson::kNumberType:{
-                    const auto doubleValue=value.dbl();
-                    if(double_is_int(doubleValue)){
-                        d.PushBack(rapidjson::Value(int(value.dbl())).Move(), allocator);
-                    }else{
-                        d.PushBack(rapidjson::Value(value.dbl()).Move(), allocator);
-                    }
-                }break;
-                case rapidjson::kObjectType:{
-                    rapidjson::Value d2;
-                    d2.SetObject();
-                    encodeJsonObject(value.object(), d2,allocator);
-                    d.PushBack(d2.Move(), allocator);
-                }break;
-                case rapidjson::kArrayType:{
-                    rapidjson::Value d2;
-                    d2.SetArray();
-                    encodeJsonArray(value.array(), d2, allocator);
-                    d.PushBack(d2.Move(), allocator);
-                }break;
-                case rapidjson::kTrueType:
-                case rapidjson::kFalseType:{
-                    rapidjson::Value d2;
-                    d2.SetBool(value.boolean());
-                    d.PushBack(d2.Move(), allocator);
-                }break;
-                case rapidjson::kNullType:{
-                    rapidjson::Value d2;
-                    d2.SetNull();
-                    d.PushBack(d2.Move(), allocator);
-                }break;
-            }
+    static void appendBigEndian(std::string &out,uint64_t value,int bytes){
+        for(auto i=bytes-1;i>=0;--i){
+            out+=char((value>>(8*i))&0xff);
         }
     }
     
-    static void encodeJsonObject(const Object_t &obj,rapidjson::Value &d,rapidjson::Document::AllocatorType &allocator){
-        for(auto &p:obj){
-            const auto &value=p.second;
-            switch(value.type()){
-                case rapidjson::kStringType:{
-                    d.AddMember(rapidjson::Value(p.first.c_str(),allocator).Move(), rapidjson::Value(value.string().c_str(),allocator).Move(), allocator);
-                }break;
-                case rapidjson::kNumberType:{
-                    const auto doubleValue=value.dbl();
-                    if(double_is_int(doubleValue)){
-                        d.AddMember(rapidjson::Value(p.first.c_str(),allocator).Move(), rapidjson::Value(int(value.dbl())).Move(), allocator);
-                    }else{
-                        d.AddMember(rapidjson::Value(p.first.c_str(),allocator).Move(), rapidjson::Value(value.dbl()).Move(), allocator);
-                    }
-                }break;
-                case rapidjson::kObjectType:{
-                    rapidjson::Value d2;
-                    d2.SetObject();
-                    encodeJsonObject(value.object(), d2,allocator);
-                    d.AddMember(rapidjson::Value(p.first.c_str(),allocator).Move(), d2.Move(), allocator);
-                }break;
-                case rapidjson::kArrayType:{
-                    rapidjson::Value d2;
-                    d2.SetArray();
-                    encodeJsonArray(value.array(), d2, allocator);
-                    d.AddMember(rapidjson::Value(p.first.c_str(),allocator).Move(), d2.Move(), allocator);
-                }break;
-                case rapidjson::kTrueType:
-                case rapidjson::kFalseType:{
-                    rapidjson::Value d2;
-                    d2.SetBool(value.boolean());
-                    d.AddMember(rapidjson::Value(p.first.c_str(),allocator).Move(), d2.Move(), allocator);
-                }break;
-                case rapidjson::kNullType:{
-                    rapidjson::Value d2;
-                    d2.SetNull();
-                    d.AddMember(rapidjson::Value(p.first.c_str(),allocator).Move(), d2.Move(), allocator);
-                }break;
-            }
+    /**
+     *  Float 32 (after `marker32`) if it holds `value` exactly, float 64 otherwise.
+     */
+    static void appendFloat(std::string &out,double value,char marker32,char marker64){
+        const auto single=float(value);
+        if(double(single)==value){
+            uint32_t bits;
+            ::memcpy(&bits, &single, sizeof(bits));
+            out+=marker32;
+            appendBigEndian(out, bits, 4);
+        }else{
+            uint64_t bits;
+            ::memcpy(&bits, &value, sizeof(bits));
+            out+=marker64;
+            appendBigEndian(out, bits, 8);
+        }
+    }
+    
+    static void appendMsgpackString(std::string &out,const std::string &value){
+        const auto length=value.length();
+        if(length<32){
+            out+=char(0xa0|length);
+        }else if(length<=0xff){
+            out+=char(0xd9);
+            appendBigEndian(out, length, 1);
+        }else if(length<=0xffff){
+            out+=char(0xda);
+            appendBigEndian(out, length, 2);
+        }else{
+            out+=char(0xdb);
+            appendBigEndian(out, length, 4);
+        }
+        out+=value;
+    }
+    
+    static void appendCborHead(std::string &out,int majorType,uint64_t argument){
+        const auto major=char(majorType<<5);
+        if(argument<24){
+            out+=char(major|char(argument));
+        }else if(argument<=0xff){
+            out+=char(major|24);
+            appendBigEndian(out, argument, 1);
+        }else if(argument<=0xffff){
+            out+=char(major|25);
+            appendBigEndian(out, argument, 2);
+        }else if(argument<=0xffffffffull){
+            out+=char(major|26);
+            appendBigEndian(out, argument, 4);
+        }else{
+            out+=char(major|27);
+            appendBigEndian(out, argument, 8);
         }
     }
     
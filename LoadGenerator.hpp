@@ -0,0 +1,401 @@
+//
+//  LoadGenerator.hpp
+//  embeddedRest
+//
+//  Open-loop HTTP load generator (in the spirit of wrk2) driving `UrlRequest` itself, so
+//  upstreams are load-tested through the same client code that runs in production.
+//  Every thread sends at a fixed rate on a precomputed schedule and latency is measured
+//  from the time a request was *supposed* to start, so a stalled server can't hide its
+//  stall by slowing the generator down (coordinated omission).
+//
+//      //  loadgen.cpp
+//      #include "LoadGenerator.hpp"
+//      int main(int argc,char **argv){
+//          return LoadGenerator::main(argc, argv);
+//      }
+//
+//      $ ./loadgen -r 2000 -d 30 -t 8 -f requests.http
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "UrlRequest.hpp"
+#include "Metrics.hpp"
+#include "MemoryTransport.hpp"
+
+class LoadGenerator{
+public:
+    struct Template{
+        std::string method="GET";
+        std::string url;
+        std::vector<std::string> headers;
+        std::string body;
+    };
+
+    struct Options{
+
+        /**
+         *  Requests per second across all threads.
+         */
+        double rate=1000;
+
+        std::chrono::milliseconds duration{10000};
+
+        /**
+         *  Each thread keeps one request in flight on its own connection.
+         */
+        int threads=4;
+
+        timeval timeout{2, 0};
+
+        /**
+         *  Set to send requests to an in-process server instead of the network.
+         */
+        std::shared_ptr<Transport> transport;
+    };
+
+    struct Report{
+        LatencyHistogram::Snapshot latency;     //  from scheduled start, microseconds
+        LatencyHistogram::Snapshot serviceTime; //  from actual start (what closed-loop tools report)
+        uint64_t requests=0;
+        uint64_t statusErrors=0;                //  responses other than 2xx and 3xx
+        uint64_t timeouts=0;                    //  synthetic 408 - no response in time
+        uint64_t connectFailures=0;             //  including unresolvable hosts
+        uint64_t connectionsClosed=0;
+        uint64_t malformed=0;                   //  response without a valid status line
+        uint64_t bytesReceived=0;               //  response bodies
+        std::chrono::microseconds elapsed{0};
+        double userCpu=0;                       //  seconds, whole process
+        double systemCpu=0;
+
+        double requestsPerSecond() const{
+            return this->elapsed.count()?double(this->requests)*1e6/double(this->elapsed.count()):0;
+        }
+
+        /**
+         *  Client CPU microseconds per request (user and system).
+         */
+        double cpuPerRequest() const{
+            return this->requests?(this->userCpu+this->systemCpu)*1e6/double(this->requests):0;
+        }
+
+        void print(std::ostream &os) const{
+            os<<std::fixed<<std::setprecision(3);
+            printDistribution(os, "Latency (corrected for coordinated omission)", this->latency);
+            printDistribution(os, "Service time (uncorrected)", this->serviceTime);
+            os<<"  "<<this->requests<<" requests in "<<double(this->elapsed.count())/1e6<<"s, "
+              <<this->bytesReceived<<" body bytes read"<<std::endl;
+            os<<"  Requests/sec: "<<std::setprecision(2)<<this->requestsPerSecond()<<std::endl;
+            os<<"  Non-2xx or 3xx responses: "<<this->statusErrors<<std::endl;
+            os<<"  Timeouts (synthetic 408): "<<this->timeouts<<", connect failures: "<<this->connectFailures
+              <<", closed: "<<this->connectionsClosed<<", malformed: "<<this->malformed<<std::endl;
+            os<<"  CPU per request: "<<this->cpuPerRequest()<<"us (user "<<this->userCpu<<"s, system "
+              <<this->systemCpu<<"s)"<<std::endl;
+        }
+
+        static void printDistribution(std::ostream &os,const char *title,const LatencyHistogram::Snapshot &snapshot){
+            os<<"  "<<title<<", mean "<<snapshot.mean()/1000<<"ms"<<std::endl;
+            const double quantiles[]={0.5, 0.75, 0.9, 0.99, 0.999, 0.9999, 1};
+            for(auto quantile:quantiles){
+                os<<"    "<<std::setw(8)<<quantile*100<<"%  "<<double(snapshot.percentile(quantile))/1000<<"ms"<<std::endl;
+            }
+        }
+    };
+
+    LoadGenerator(std::vector<Template> templates,Options options):
+    _templates(std::move(templates)),
+    _options(std::move(options)){}
+
+    /**
+     *  Requests in the `.http` format: request line (`METHOD url`, method defaults to GET),
+     *  header lines, a blank line and the body. Requests are separated by `###` lines,
+     *  lines starting with `#` or `//` elsewhere are comments.
+     */
+    static std::vector<Template> parseTemplates(std::istream &is){
+        std::vector<Template> res;
+        Template current;
+        auto inBody=false;
+        auto flush=[&]{
+            if(current.url.length()){
+                while(current.body.length() && (current.body.back()=='\n' || current.body.back()=='\r')){
+                    current.body.pop_back();
+                }
+                res.push_back(std::move(current));
+            }
+            current=Template();
+            inBody=false;
+        };
+        std::string line;
+        while(std::getline(is, line)){
+            if(line.length() && line.back()=='\r'){
+                line.pop_back();
+            }
+            if(line.compare(0, 3, "###")==0){
+                flush();
+                continue;
+            }
+            if(inBody){
+                current.body+=line+"\n";
+                continue;
+            }
+            if(line.compare(0, 1, "#")==0 || line.compare(0, 2, "//")==0){
+                continue;
+            }
+            if(current.url.empty()){
+                std::stringstream ss(line);
+                std::string first, second;
+                ss>>first>>second;
+                if(first.empty()){
+                    continue;
+                }
+                if(second.empty()){
+                    current.url=first;
+                }else{
+                    current.method=first;
+                    current.url=second;
+                }
+            }else if(line.empty()){
+                inBody=true;
+            }else{
+                current.headers.push_back(line);
+            }
+        }
+        flush();
+        return res;
+    }
+
+    static std::vector<Template> loadTemplates(const std::string &path){
+        std::ifstream file(path);
+        if(!file){
+            std::cerr<<"failed to open file at *"<<path<<"*"<<std::endl;
+            return std::vector<Template>();
+        }
+        return parseTemplates(file);
+    }
+
+    /**
+     *  Runs for `duration` and returns the merged report. Templates are sent round robin.
+     */
+    Report run(){
+        const auto threads=std::max(_options.threads, 1);
+        const auto interval=std::chrono::nanoseconds(int64_t(1e9*threads/std::max(_options.rate, 0.001)));
+        std::vector<std::unique_ptr<Worker>> workers;
+        for(auto i=0;i<threads;++i){
+            workers.emplace_back(new Worker());
+        }
+        const auto cpuBefore=cpuTime();
+        const auto start=std::chrono::steady_clock::now()+std::chrono::milliseconds(10);
+        const auto end=start+_options.duration;
+        std::vector<std::thread> runners;
+        for(auto i=0;i<threads;++i){
+            //  threads are staggered so requests are spread evenly over the interval..
+            auto first=start+interval*i/threads;
+            runners.emplace_back(&LoadGenerator::work, this, workers[size_t(i)].get(), first, interval, end, size_t(i));
+        }
+        for(auto &runner:runners){
+            runner.join();
+        }
+        const auto cpuAfter=cpuTime();
+        Report res;
+        res.elapsed=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-start);
+        res.userCpu=cpuAfter.first-cpuBefore.first;
+        res.systemCpu=cpuAfter.second-cpuBefore.second;
+        for(const auto &worker:workers){
+            worker->latency.addTo(res.latency);
+            worker->serviceTime.addTo(res.serviceTime);
+            res.requests+=worker->requests;
+            res.statusErrors+=worker->statusErrors;
+            res.timeouts+=worker->timeouts;
+            res.connectFailures+=worker->connectFailures;
+            res.connectionsClosed+=worker->connectionsClosed;
+            res.malformed+=worker->malformed;
+            res.bytesReceived+=worker->bytesReceived;
+        }
+        return res;
+    }
+
+    /**
+     *  Command line front end, see `usage`.
+     */
+    static int main(int argc,char **argv){
+        Options options;
+        std::vector<Template> templates;
+        auto fakeServer=false;
+        size_t fakeBodySize=0;
+        for(auto i=1;i<argc;++i){
+            const std::string argument=argv[i];
+            auto value=[&]()->const char*{
+                return (i+1<argc)?argv[++i]:"";
+            };
+            if(argument=="-r" || argument=="--rate"){
+                options.rate=std::atof(value());
+            }else if(argument=="-d" || argument=="--duration"){
+                options.duration=std::chrono::milliseconds(int64_t(std::atof(value())*1000));
+            }else if(argument=="-t" || argument=="--threads"){
+                options.threads=std::atoi(value());
+            }else if(argument=="--timeout"){
+                auto milliseconds=std::atol(value());
+                options.timeout.tv_sec=milliseconds/1000;
+                options.timeout.tv_usec=(milliseconds%1000)*1000;
+            }else if(argument=="-f" || argument=="--requests"){
+                auto loaded=loadTemplates(value());
+                templates.insert(templates.end(), loaded.begin(), loaded.end());
+            }else if(argument=="--fake-server"){
+                fakeServer=true;
+                if(i+1<argc && argv[i+1][0]!='-'){
+                    fakeBodySize=size_t(std::atol(value()));
+                }
+            }else if(argument.length() && argument[0]!='-'){
+                Template requestTemplate;
+                requestTemplate.url=argument;
+                templates.push_back(requestTemplate);
+            }else{
+                usage(argv[0]);
+                return 1;
+            }
+        }
+        if(templates.empty() || options.rate<=0 || options.threads<=0){
+            usage(argv[0]);
+            return 1;
+        }
+        if(fakeServer){
+            options.transport=fakeTransport(templates, fakeBodySize);
+        }
+        std::cout<<"Running "<<double(options.duration.count())/1000<<"s test @ "<<options.rate<<" requests/sec, "
+                 <<options.threads<<" threads, "<<templates.size()<<" request templates"
+                 <<(fakeServer?", in-process server":"")<<std::endl;
+        LoadGenerator generator(std::move(templates), options);
+        generator.run().print(std::cout);
+        return 0;
+    }
+
+    /**
+     *  In-process `FakeServer` answering every template's method and uri with 200 and a
+     *  body of `bodySize` bytes - measures the client alone without any network.
+     */
+    static std::shared_ptr<Transport> fakeTransport(const std::vector<Template> &templates,size_t bodySize){
+        auto server=std::make_shared<FakeServer>();
+        for(const auto &requestTemplate:templates){
+            UrlRequest request;
+            request.url(requestTemplate.url);
+            server->on(requestTemplate.method, request.uri(), 200, std::string(bodySize, 'x'));
+        }
+        return std::make_shared<MemoryTransport>(server);
+    }
+
+protected:
+    struct Worker{
+        LatencyHistogram latency;
+        LatencyHistogram serviceTime;
+        uint64_t requests=0;
+        uint64_t statusErrors=0;
+        uint64_t timeouts=0;
+        uint64_t connectFailures=0;
+        uint64_t connectionsClosed=0;
+        uint64_t malformed=0;
+        uint64_t bytesReceived=0;
+    };
+
+    std::vector<Template> _templates;
+    Options _options;
+
+    static void usage(const char *name){
+        std::cerr<<"usage: "<<name<<" -r <requests/sec> [-d <seconds>] [-t <threads>] [--timeout <ms>]\n"
+                   "       [--fake-server [<body bytes>]] (-f <requests.http> | <url>)..."<<std::endl;
+    }
+
+    std::vector<UrlRequest> prepare() const{
+        std::vector<UrlRequest> res;
+        for(const auto &requestTemplate:_templates){
+            UrlRequest request;
+            request.url(requestTemplate.url);
+            request.method(requestTemplate.method);
+            for(const auto &header:requestTemplate.headers){
+                request.addHeader(header);
+            }
+            if(requestTemplate.body.length()){
+                request.body(requestTemplate.body);
+            }
+            request.timeout=_options.timeout;
+            if(_options.transport){
+                request.transport(_options.transport);
+            }
+            res.push_back(std::move(request));
+        }
+        return res;
+    }
+
+    void work(Worker *worker,std::chrono::steady_clock::time_point scheduled,std::chrono::nanoseconds interval,
+              std::chrono::steady_clock::time_point end,size_t firstTemplate)
+    {
+        auto requests=this->prepare();
+        auto next=firstTemplate%requests.size();
+        while(scheduled<end){
+            //  behind schedule - send right away, the wait counts against the server..
+            std::this_thread::sleep_until(scheduled);
+            auto &request=requests[next];
+            next=(next+1)%requests.size();
+            const auto started=std::chrono::steady_clock::now();
+            try{
+                auto response=request.perform();
+                switch(request.failure()){
+                    case RetryPolicy::Failure::none:
+                        if(response.statusCode()<200 || response.statusCode()>=400){
+                            ++worker->statusErrors;
+                        }
+                        worker->bytesReceived+=response.body().length();
+                        break;
+                    case RetryPolicy::Failure::recvTimeout:
+                        ++worker->timeouts;
+                        break;
+                    case RetryPolicy::Failure::connectFailed:
+                        ++worker->connectFailures;
+                        break;
+                    case RetryPolicy::Failure::connectionClosed:
+                        ++worker->connectionsClosed;
+                        break;
+                }
+            }catch(const Response::IncorrectStartLineException&){
+                ++worker->malformed;
+            }catch(const UrlRequest::HostIsNullException&){
+                ++worker->connectFailures;
+            }
+            const auto finished=std::chrono::steady_clock::now();
+            worker->latency.record(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(finished-scheduled).count()));
+            worker->serviceTime.record(uint64_t(std::chrono::duration_cast<std::chrono::microseconds>(finished-started).count()));
+            ++worker->requests;
+            scheduled+=interval;
+        }
+    }
+
+    /**
+     *  User and system CPU seconds of the process.
+     */
+    static std::pair<double,double> cpuTime(){
+#ifndef _WIN32
+        rusage usage;
+        if(::getrusage(RUSAGE_SELF, &usage)==0){
+            return std::make_pair(double(usage.ru_utime.tv_sec)+double(usage.ru_utime.tv_usec)/1e6,
+                                  double(usage.ru_stime.tv_sec)+double(usage.ru_stime.tv_usec)/1e6);
+        }
+#endif
+        return std::make_pair(0.0, 0.0);
+    }
+};
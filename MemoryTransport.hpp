@@ -0,0 +1,367 @@
+//
+//  MemoryTransport.hpp
+//  embeddedRest
+//
+//  In-process transport: requests go straight to a scriptable `FakeServer` running in the
+//  calling thread, no sockets and no syscalls. Deterministic tests and benchmarks of
+//  everything above the socket layer (serialization, parsing, JSON, retries, caching).
+//
+//      auto server=std::make_shared<FakeServer>();
+//      server->on("GET", "/users", 200, "[{\"id\":1}]", {"Content-Type: application/json"});
+//      UrlRequest request;
+//      request.host("api").transport(std::make_shared<MemoryTransport>(server));
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <sstream>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <cctype>
+
+#include "Transport.hpp"
+
+class FakeServer{
+public:
+    struct Request{
+        std::string method;
+        std::string uri;
+        std::vector<std::string> headers;
+        std::string body;
+
+        /**
+         *  Value of header `name` (case insensitive), empty if there's none.
+         */
+        std::string header(const std::string &name) const{
+            for(const auto &line:this->headers){
+                auto colon=line.find(':');
+                if(colon==name.length() && equalNoCase(line.substr(0, colon), name)){
+                    auto start=line.find_first_not_of(' ', colon+1);
+                    return start==std::string::npos?std::string():line.substr(start);
+                }
+            }
+            return std::string();
+        }
+    };
+
+    /**
+     *  Returns raw response bytes. Empty string closes the connection without a response.
+     */
+    typedef std::function<std::string(const Request &request)> Handler;
+
+    /**
+     *  Receives return at most this many bytes, 0 - whole response in one receive. Small
+     *  values reproduce responses split across many reads.
+     */
+    size_t receiveSize=0;
+
+    /**
+     *  Keep connections open after responses unless request or response says close.
+     */
+    bool keepAlive=true;
+
+    /**
+     *  Called with the head (no body) of requests with `Expect: 100-continue`. Returns
+     *  empty string to accept the body (`100 Continue` is sent) or a final response which
+     *  rejects it - the connection is closed after it. Not set - everything is accepted.
+     */
+    Handler expectHandler;
+
+    /**
+     *  Routes `method` ("*" - any) and exact `uri` to `handler`. Unrouted requests get 404.
+     *  Set routes up before requests start.
+     */
+    void on(const std::string &method,const std::string &uri,Handler handler){
+        _routes[std::make_pair(method, uri)]=std::move(handler);
+    }
+
+    void on(const std::string &method,const std::string &uri,int statusCode,const std::string &body,
+            const std::vector<std::string> &headers=std::vector<std::string>())
+    {
+        auto raw=response(statusCode, body, headers);
+        this->on(method, uri, [raw](const Request&){
+            return raw;
+        });
+    }
+
+    static std::string response(int statusCode,const std::string &body,
+                                const std::vector<std::string> &headers=std::vector<std::string>())
+    {
+        std::stringstream ss;
+        ss<<"HTTP/1.1 "<<statusCode<<" "<<reason(statusCode)<<"\r\n";
+        for(const auto &header:headers){
+            ss<<header<<"\r\n";
+        }
+        ss<<"Content-Length: "<<body.length()<<"\r\n\r\n"<<body;
+        return ss.str();
+    }
+
+    std::string handle(const Request &request){
+        ++_requests;
+        auto it=_routes.find(std::make_pair(request.method, request.uri));
+        if(it==_routes.end()){
+            it=_routes.find(std::make_pair(std::string("*"), request.uri));
+        }
+        auto res=(it==_routes.end())?response(404, ""):it->second(request);
+        if(request.method=="HEAD"){
+            auto headEnd=res.find("\r\n\r\n");
+            if(headEnd!=std::string::npos){
+                res.resize(headEnd+4);
+            }
+        }
+        return res;
+    }
+
+    uint64_t requestsCount() const{
+        return _requests.load();
+    }
+
+    /**
+     *  Takes one complete request off the front of `buffer`. False if it isn't complete
+     *  yet (`buffer` untouched then).
+     */
+    static bool parse(std::string &buffer,Request &request){
+        Request res;
+        auto pos=parseHead(buffer, res);
+        if(!pos){
+            return false;
+        }
+        if(equalNoCase(res.header("Transfer-Encoding"), "chunked")){
+            while(true){
+                auto lineEnd=buffer.find("\r\n", pos);
+                if(lineEnd==std::string::npos){
+                    return false;
+                }
+                auto size=size_t(std::strtoull(buffer.c_str()+pos, nullptr, 16));
+                pos=lineEnd+2;
+                if(!size){
+                    //  no trailers are sent by UrlRequest, just the final CRLF..
+                    auto trailersEnd=buffer.find("\r\n", pos);
+                    if(trailersEnd==std::string::npos){
+                        return false;
+                    }
+                    pos=trailersEnd+2;
+                    break;
+                }
+                if(buffer.length()<pos+size+2){
+                    return false;
+                }
+                res.body.append(buffer, pos, size);
+                pos+=size+2;
+            }
+        }else{
+            auto contentLength=size_t(std::strtoull(res.header("Content-Length").c_str(), nullptr, 10));
+            if(buffer.length()<pos+contentLength){
+                return false;
+            }
+            res.body.assign(buffer, pos, contentLength);
+            pos+=contentLength;
+        }
+        buffer.erase(0, pos);
+        request=std::move(res);
+        return true;
+    }
+
+    /**
+     *  Parses method, uri and headers. Returns offset of the body, 0 if head isn't complete.
+     */
+    static size_t parseHead(const std::string &buffer,Request &request){
+        auto headEnd=buffer.find("\r\n\r\n");
+        if(headEnd==std::string::npos){
+            return 0;
+        }
+        std::stringstream ss(buffer.substr(0, headEnd));
+        std::string line;
+        std::getline(ss, line);
+        std::stringstream startLine(line);
+        startLine>>request.method>>request.uri;
+        while(std::getline(ss, line)){
+            if(line.length() && line.back()=='\r'){
+                line.pop_back();
+            }
+            request.headers.push_back(line);
+        }
+        return headEnd+4;
+    }
+
+    static bool equalNoCase(const std::string &a,const std::string &b){
+        return a.length()==b.length() && std::equal(a.begin(), a.end(), b.begin(), [](char x,char y){
+            return std::tolower((unsigned char)x)==std::tolower((unsigned char)y);
+        });
+    }
+
+protected:
+    std::map<std::pair<std::string,std::string>,Handler> _routes;
+    std::atomic<uint64_t> _requests{0};
+
+    static const char* reason(int statusCode){
+        switch(statusCode){
+            case 100: return "Continue";
+            case 200: return "OK";
+            case 201: return "Created";
+            case 204: return "No Content";
+            case 304: return "Not Modified";
+            case 400: return "Bad Request";
+            case 404: return "Not Found";
+            case 500: return "Internal Server Error";
+            case 503: return "Service Unavailable";
+            default: return "Status";
+        }
+    }
+};
+
+/**
+ *  Connection to a `FakeServer`: sent bytes are parsed and answered right away, receives
+ *  return the answers. Nothing ever blocks - receive with nothing to return is a timeout.
+ */
+class MemoryConnection:public Connection{
+public:
+    MemoryConnection(std::shared_ptr<FakeServer> server):_server(std::move(server)){}
+
+    int fd() const override{
+        return -1;
+    }
+
+    bool send(const char *data,size_t length,timeval) override{
+        if(_closed){
+            return false;
+        }
+        _in.append(data, length);
+        FakeServer::Request request;
+        auto headEnd=_in.find("\r\n\r\n");
+        if(!_expectAnswered && headEnd!=std::string::npos && _in.rfind("100-continue", headEnd)!=std::string::npos
+           && FakeServer::parseHead(_in, request) && FakeServer::equalNoCase(request.header("Expect"), "100-continue"))
+        {
+            _expectAnswered=true;
+            auto rejection=_server->expectHandler?_server->expectHandler(request):std::string();
+            if(rejection.length()){
+                _out.append(rejection);
+                _closed=true;
+                return true;
+            }
+            _out.append("HTTP/1.1 100 Continue\r\n\r\n");
+        }
+        while(!_closed && FakeServer::parse(_in, request)){
+            auto response=_server->handle(request);
+            _out.append(response);
+            _expectAnswered=false;
+            if(response.empty() || !_server->keepAlive
+               || FakeServer::equalNoCase(request.header("Connection"), "close")
+               || closesConnection(response))
+            {
+                _closed=true;
+            }
+        }
+        return true;
+    }
+
+    long receive(char *buffer,size_t length,timeval) override{
+        if(_outPosition==_out.length()){
+            return _closed?0:-2;
+        }
+        auto count=std::min(length, _out.length()-_outPosition);
+        if(_server->receiveSize){
+            count=std::min(count, _server->receiveSize);
+        }
+        ::memcpy(buffer, _out.data()+_outPosition, count);
+        _outPosition+=count;
+        if(_outPosition==_out.length()){
+            _out.clear();
+            _outPosition=0;
+        }
+        return long(count);
+    }
+
+    /**
+     *  Still usable for the next request: not closed and nothing unread.
+     */
+    bool idle() const{
+        return !_closed && _out.empty() && _in.empty();
+    }
+
+protected:
+    std::shared_ptr<FakeServer> _server;
+    std::string _in;
+    std::string _out;
+    size_t _outPosition=0;
+    bool _closed=false;
+    bool _expectAnswered=false;
+
+    static bool closesConnection(const std::string &response){
+        auto headEnd=response.find("\r\n\r\n");
+        std::string head=response.substr(0, headEnd);
+        std::transform(head.begin(), head.end(), head.begin(), [](char c){
+            return char(std::tolower((unsigned char)c));
+        });
+        return head.find("\r\nconnection: close")!=std::string::npos;
+    }
+};
+
+/**
+ *  Transport to a `FakeServer` with keep-alive pooling per endpoint.
+ */
+class MemoryTransport:public Transport{
+public:
+    struct Stats{
+        uint64_t connectionsOpened=0;
+        uint64_t connectionsReused=0;
+    };
+
+    /**
+     *  Idle connections kept per endpoint, connections released beyond that are dropped.
+     */
+    size_t maxIdlePerEndpoint=8;
+
+    MemoryTransport(std::shared_ptr<FakeServer> server):_server(std::move(server)){}
+
+    std::unique_ptr<Connection> connect(const Endpoint&,timeval) override{
+        ++_connectionsOpened;
+        return std::unique_ptr<Connection>(new MemoryConnection(_server));
+    }
+
+    std::unique_ptr<Connection> takeIdle(const Endpoint &endpoint) override{
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it=_idle.find(endpoint.key);
+        if(it==_idle.end() || it->second.empty()){
+            return nullptr;
+        }
+        auto res=std::move(it->second.back());
+        it->second.pop_back();
+        ++_connectionsReused;
+        return res;
+    }
+
+    void release(const Endpoint &endpoint,std::unique_ptr<Connection> connection) override{
+        if(!static_cast<MemoryConnection*>(connection.get())->idle()){
+            return;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &idle=_idle[endpoint.key];
+        if(idle.size()<this->maxIdlePerEndpoint){
+            idle.push_back(std::move(connection));
+        }
+    }
+
+    Stats stats() const{
+        Stats res;
+        res.connectionsOpened=_connectionsOpened.load();
+        res.connectionsReused=_connectionsReused.load();
+        return res;
+    }
+
+protected:
+    std::shared_ptr<FakeServer> _server;
+    std::mutex _mutex;
+    std::map<std::string,std::vector<std::unique_ptr<Connection>>> _idle;
+    std::atomic<uint64_t> _connectionsOpened{0};
+    std::atomic<uint64_t> _connectionsReused{0};
+};
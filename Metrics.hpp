@@ -0,0 +1,459 @@
+//
+//  Metrics.hpp
+//  embeddedRest
+//
+//  Per host request metrics: latency histograms (total, connect, time to first byte),
+//  status codes, failures, bytes and connection reuse. Every thread records into its own
+//  shard without locks or contended atomics, shards are merged when a snapshot is taken.
+//
+//      auto metrics=std::make_shared<MetricsRegistry>();
+//      request.metrics(metrics);
+//      ...
+//      std::cout<<metrics->prometheus();
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <sstream>
+#include <algorithm>
+#include <cstdint>
+
+/**
+ *  HDR style histogram of microsecond values: values below 16 are exact, above that every
+ *  power of two is split in 16 buckets, so relative error stays under 6.25% from 1us to
+ *  about 12 days. Single writer, any number of readers.
+ */
+class LatencyHistogram{
+public:
+    static const int subBucketBits=4;
+    static const uint64_t subBuckets=1<<subBucketBits;
+    static const int maxExponent=40;
+    static const size_t bucketCount=(maxExponent-subBucketBits+2)*subBuckets;
+
+    static size_t index(uint64_t value){
+        if(value<subBuckets){
+            return size_t(value);
+        }
+        auto exponent=highestBit(value);
+        auto group=exponent-subBucketBits+1;
+        auto subBucket=(value>>(exponent-subBucketBits))&(subBuckets-1);
+        return std::min(size_t(group*subBuckets+subBucket), bucketCount-1);
+    }
+
+    static int highestBit(uint64_t value){
+#if defined(__GNUC__) || defined(__clang__)
+        return 63-__builtin_clzll(value);
+#else
+        auto res=0;
+        while(value>>=1){
+            ++res;
+        }
+        return res;
+#endif
+    }
+
+    static uint64_t lowerBound(size_t index){
+        if(index<subBuckets){
+            return index;
+        }
+        auto group=index/subBuckets;
+        auto subBucket=uint64_t(index%subBuckets);
+        auto exponent=group+subBucketBits-1;
+        return (uint64_t(1)<<exponent)|(subBucket<<(exponent-subBucketBits));
+    }
+
+    static uint64_t upperBound(size_t index){
+        return (index+1<bucketCount)?lowerBound(index+1)-1:UINT64_MAX;
+    }
+
+    void record(uint64_t value){
+        increment(_counts[index(value)], 1);
+        increment(_count, 1);
+        increment(_sum, value);
+        if(value>_max.load(std::memory_order_relaxed)){
+            _max.store(value, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     *  Merged view of one or more histograms.
+     */
+    struct Snapshot{
+        uint64_t count=0;
+        uint64_t sum=0;
+        uint64_t max=0;
+        std::vector<uint64_t> counts=std::vector<uint64_t>(bucketCount, 0);
+
+        double mean() const{
+            return this->count?double(this->sum)/double(this->count):0;
+        }
+
+        /**
+         *  Value (upper bound of the bucket) below which `quantile` (0..1) of samples are.
+         */
+        uint64_t percentile(double quantile) const{
+            if(!this->count){
+                return 0;
+            }
+            auto rank=uint64_t(quantile*double(this->count)+0.5);
+            rank=std::max<uint64_t>(rank, 1);
+            uint64_t seen=0;
+            for(size_t i=0;i<bucketCount;++i){
+                seen+=this->counts[i];
+                if(seen>=rank){
+                    return std::min(upperBound(i), this->max);
+                }
+            }
+            return this->max;
+        }
+
+        /**
+         *  Count of samples not greater than `value` (exact for bucket bounds).
+         */
+        uint64_t countAtMost(uint64_t value) const{
+            uint64_t res=0;
+            for(size_t i=0;i<bucketCount && upperBound(i)<=value;++i){
+                res+=this->counts[i];
+            }
+            return res;
+        }
+    };
+
+    void addTo(Snapshot &snapshot) const{
+        for(size_t i=0;i<bucketCount;++i){
+            snapshot.counts[i]+=_counts[i].load(std::memory_order_relaxed);
+        }
+        snapshot.count+=_count.load(std::memory_order_relaxed);
+        snapshot.sum+=_sum.load(std::memory_order_relaxed);
+        snapshot.max=std::max(snapshot.max, _max.load(std::memory_order_relaxed));
+    }
+
+    /**
+     *  Adds counts of `other` - used when a thread's shard is retired.
+     */
+    void merge(const LatencyHistogram &other){
+        for(size_t i=0;i<bucketCount;++i){
+            increment(_counts[i], other._counts[i].load(std::memory_order_relaxed));
+        }
+        increment(_count, other._count.load(std::memory_order_relaxed));
+        increment(_sum, other._sum.load(std::memory_order_relaxed));
+        if(other._max.load(std::memory_order_relaxed)>_max.load(std::memory_order_relaxed)){
+            _max.store(other._max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     *  Plain load and store instead of locked read-modify-write - there is only one writer.
+     */
+    static void increment(std::atomic<uint64_t> &counter,uint64_t value){
+        counter.store(counter.load(std::memory_order_relaxed)+value, std::memory_order_relaxed);
+    }
+
+protected:
+    std::atomic<uint64_t> _counts[bucketCount]={};
+    std::atomic<uint64_t> _count{0};
+    std::atomic<uint64_t> _sum{0};
+    std::atomic<uint64_t> _max{0};
+};
+
+class MetricsRegistry{
+public:
+
+    /**
+     *  One exchange with a host as `UrlRequest` measured it. Negative durations weren't measured.
+     */
+    struct Sample{
+        std::chrono::microseconds total{0};
+        std::chrono::microseconds connect{-1};
+        std::chrono::microseconds firstByte{-1};
+        int statusCode=0;
+        bool timedOut=false;
+        bool connectFailed=false;
+        bool connectionClosed=false;
+        bool newConnection=false;
+        bool reusedConnection=false;
+        uint64_t bytesSent=0;
+        uint64_t bytesReceived=0;
+    };
+
+    struct HostSnapshot{
+        uint64_t requests=0;
+        uint64_t timeouts=0;
+        uint64_t connectFailures=0;
+        uint64_t connectionsClosed=0;
+        uint64_t connectionsOpened=0;
+        uint64_t connectionsReused=0;
+        uint64_t bytesSent=0;
+        uint64_t bytesReceived=0;
+        std::map<int,uint64_t> statusCodes;
+        LatencyHistogram::Snapshot total;
+        LatencyHistogram::Snapshot connect;
+        LatencyHistogram::Snapshot firstByte;
+
+        /**
+         *  Share of exchanges which went over an already open connection.
+         */
+        double reuseRatio() const{
+            auto connections=this->connectionsOpened+this->connectionsReused;
+            return connections?double(this->connectionsReused)/double(connections):0;
+        }
+    };
+
+    typedef std::map<std::string,HostSnapshot> Snapshot;
+
+    MetricsRegistry():_id(nextId()++){}
+
+    MetricsRegistry(const MetricsRegistry&)=delete;
+    MetricsRegistry& operator=(const MetricsRegistry&)=delete;
+
+    void record(const std::string &host,const Sample &sample){
+        auto &metrics=this->localShard().host(host);
+        metrics.record(sample);
+    }
+
+    /**
+     *  Merges all shards. Doesn't stop recording threads.
+     */
+    Snapshot snapshot(){
+        Snapshot res;
+        std::lock_guard<std::mutex> lock(_mutex);
+        this->collectRetired();
+        _retired.addTo(res);
+        for(const auto &shard:_shards){
+            shard->addTo(res);
+        }
+        return res;
+    }
+
+    /**
+     *  Snapshot in Prometheus text exposition format. Latencies are exported in seconds with
+     *  fixed bucket bounds.
+     */
+    std::string prometheus(const std::string &prefix="embedded_rest"){
+        const auto snapshot=this->snapshot();
+        std::stringstream ss;
+        auto label=[](const std::string &host){
+            std::string res;
+            for(auto c:host){
+                if(c=='\\' || c=='"'){
+                    res+='\\';
+                }
+                res+=c;
+            }
+            return "host=\""+res+"\"";
+        };
+        auto counter=[&](const std::string &name,const std::string &help,uint64_t HostSnapshot::*field){
+            ss<<"# HELP "<<prefix<<"_"<<name<<" "<<help<<"\n";
+            ss<<"# TYPE "<<prefix<<"_"<<name<<" counter\n";
+            for(const auto &p:snapshot){
+                ss<<prefix<<"_"<<name<<"{"<<label(p.first)<<"} "<<p.second.*field<<"\n";
+            }
+        };
+        ss<<"# HELP "<<prefix<<"_responses_total Complete responses by status code.\n";
+        ss<<"# TYPE "<<prefix<<"_responses_total counter\n";
+        for(const auto &p:snapshot){
+            for(const auto &status:p.second.statusCodes){
+                ss<<prefix<<"_responses_total{"<<label(p.first)<<",code=\""<<status.first<<"\"} "<<status.second<<"\n";
+            }
+        }
+        counter("requests_total", "Exchanges with the host including failed ones.", &HostSnapshot::requests);
+        counter("timeouts_total", "Requests which timed out waiting for the response.", &HostSnapshot::timeouts);
+        counter("connect_failures_total", "Connections which could not be established.", &HostSnapshot::connectFailures);
+        counter("connections_closed_total", "Connections closed before the response was complete.", &HostSnapshot::connectionsClosed);
+        counter("connections_opened_total", "New connections.", &HostSnapshot::connectionsOpened);
+        counter("connections_reused_total", "Exchanges over a kept-alive connection.", &HostSnapshot::connectionsReused);
+        counter("bytes_sent_total", "Request bytes written.", &HostSnapshot::bytesSent);
+        counter("bytes_received_total", "Response bytes read.", &HostSnapshot::bytesReceived);
+        auto histogram=[&](const std::string &name,const std::string &help,LatencyHistogram::Snapshot HostSnapshot::*field){
+            static const uint64_t bounds[]={100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000};
+            ss<<"# HELP "<<prefix<<"_"<<name<<" "<<help<<"\n";
+            ss<<"# TYPE "<<prefix<<"_"<<name<<" histogram\n";
+            for(const auto &p:snapshot){
+                const auto &h=p.second.*field;
+                for(auto bound:bounds){
+                    ss<<prefix<<"_"<<name<<"_bucket{"<<label(p.first)<<",le=\""<<double(bound)/1e6<<"\"} "<<h.countAtMost(bound)<<"\n";
+                }
+                ss<<prefix<<"_"<<name<<"_bucket{"<<label(p.first)<<",le=\"+Inf\"} "<<h.count<<"\n";
+                ss<<prefix<<"_"<<name<<"_sum{"<<label(p.first)<<"} "<<double(h.sum)/1e6<<"\n";
+                ss<<prefix<<"_"<<name<<"_count{"<<label(p.first)<<"} "<<h.count<<"\n";
+            }
+        };
+        histogram("request_duration_seconds", "Time from start to complete response.", &HostSnapshot::total);
+        histogram("connect_duration_seconds", "Time to establish new connections (TLS handshake included).", &HostSnapshot::connect);
+        histogram("first_byte_seconds", "Time from start to the first response byte.", &HostSnapshot::firstByte);
+        return ss.str();
+    }
+
+protected:
+
+    struct HostMetrics{
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> timeouts{0};
+        std::atomic<uint64_t> connectFailures{0};
+        std::atomic<uint64_t> connectionsClosed{0};
+        std::atomic<uint64_t> connectionsOpened{0};
+        std::atomic<uint64_t> connectionsReused{0};
+        std::atomic<uint64_t> bytesSent{0};
+        std::atomic<uint64_t> bytesReceived{0};
+        std::atomic<uint64_t> statusCodes[600]={};
+        LatencyHistogram total;
+        LatencyHistogram connect;
+        LatencyHistogram firstByte;
+
+        void record(const Sample &sample){
+            LatencyHistogram::increment(this->requests, 1);
+            LatencyHistogram::increment(this->timeouts, sample.timedOut?1:0);
+            LatencyHistogram::increment(this->connectFailures, sample.connectFailed?1:0);
+            LatencyHistogram::increment(this->connectionsClosed, sample.connectionClosed?1:0);
+            LatencyHistogram::increment(this->connectionsOpened, sample.newConnection?1:0);
+            LatencyHistogram::increment(this->connectionsReused, sample.reusedConnection?1:0);
+            LatencyHistogram::increment(this->bytesSent, sample.bytesSent);
+            LatencyHistogram::increment(this->bytesReceived, sample.bytesReceived);
+            if(sample.statusCode>0 && sample.statusCode<600){
+                LatencyHistogram::increment(this->statusCodes[sample.statusCode], 1);
+            }
+            this->total.record(uint64_t(sample.total.count()));
+            if(sample.connect.count()>=0){
+                this->connect.record(uint64_t(sample.connect.count()));
+            }
+            if(sample.firstByte.count()>=0){
+                this->firstByte.record(uint64_t(sample.firstByte.count()));
+            }
+        }
+
+        void merge(const HostMetrics &other){
+            LatencyHistogram::increment(this->requests, other.requests.load(std::memory_order_relaxed));
+            LatencyHistogram::increment(this->timeouts, other.timeouts.load(std::memory_order_relaxed));
+            LatencyHistogram::increment(this->connectFailures, other.connectFailures.load(std::memory_order_relaxed));
+            LatencyHistogram::increment(this->connectionsClosed, other.connectionsClosed.load(std::memory_order_relaxed));
+            LatencyHistogram::increment(this->connectionsOpened, other.connectionsOpened.load(std::memory_order_relaxed));
+            LatencyHistogram::increment(this->connectionsReused, other.connectionsReused.load(std::memory_order_relaxed));
+            LatencyHistogram::increment(this->bytesSent, other.bytesSent.load(std::memory_order_relaxed));
+            LatencyHistogram::increment(this->bytesReceived, other.bytesReceived.load(std::memory_order_relaxed));
+            for(size_t i=0;i<600;++i){
+                LatencyHistogram::increment(this->statusCodes[i], other.statusCodes[i].load(std::memory_order_relaxed));
+            }
+            this->total.merge(other.total);
+            this->connect.merge(other.connect);
+            this->firstByte.merge(other.firstByte);
+        }
+
+        void addTo(HostSnapshot &snapshot) const{
+            snapshot.requests+=this->requests.load(std::memory_order_relaxed);
+            snapshot.timeouts+=this->timeouts.load(std::memory_order_relaxed);
+            snapshot.connectFailures+=this->connectFailures.load(std::memory_order_relaxed);
+            snapshot.connectionsClosed+=this->connectionsClosed.load(std::memory_order_relaxed);
+            snapshot.connectionsOpened+=this->connectionsOpened.load(std::memory_order_relaxed);
+            snapshot.connectionsReused+=this->connectionsReused.load(std::memory_order_relaxed);
+            snapshot.bytesSent+=this->bytesSent.load(std::memory_order_relaxed);
+            snapshot.bytesReceived+=this->bytesReceived.load(std::memory_order_relaxed);
+            for(int i=0;i<600;++i){
+                auto count=this->statusCodes[i].load(std::memory_order_relaxed);
+                if(count){
+                    snapshot.statusCodes[i]+=count;
+                }
+            }
+            this->total.addTo(snapshot.total);
+            this->connect.addTo(snapshot.connect);
+            this->firstByte.addTo(snapshot.firstByte);
+        }
+    };
+
+    /**
+     *  Metrics of one thread. Only the owner inserts hosts (under `mutex` so snapshots can
+     *  iterate), lookups by the owner need no lock.
+     */
+    struct Shard{
+        std::mutex mutex;
+        std::map<std::string,std::unique_ptr<HostMetrics>> hosts;
+        std::atomic<bool> retired{false};
+
+        HostMetrics& host(const std::string &name){
+            auto it=this->hosts.find(name);
+            if(it!=this->hosts.end()){
+                return *it->second;
+            }
+            std::lock_guard<std::mutex> lock(this->mutex);
+            auto &res=this->hosts[name];
+            res.reset(new HostMetrics);
+            return *res;
+        }
+
+        void addTo(Snapshot &snapshot){
+            std::lock_guard<std::mutex> lock(this->mutex);
+            for(const auto &p:this->hosts){
+                p.second->addTo(snapshot[p.first]);
+            }
+        }
+
+        void mergeInto(Shard &target){
+            std::lock_guard<std::mutex> lock(this->mutex);
+            for(const auto &p:this->hosts){
+                target.host(p.first).merge(*p.second);
+            }
+        }
+    };
+
+    /**
+     *  Shards of the current thread in every registry it recorded to. Marks them retired
+     *  when the thread exits.
+     */
+    struct ThreadShards{
+        std::vector<std::pair<uint64_t,std::shared_ptr<Shard>>> shards;
+
+        ~ThreadShards(){
+            for(auto &p:this->shards){
+                p.second->retired.store(true);
+            }
+        }
+    };
+
+    const uint64_t _id;
+    std::mutex _mutex;
+    std::vector<std::shared_ptr<Shard>> _shards;
+    Shard _retired;     //  counts of exited threads, written under `_mutex`
+
+    static std::atomic<uint64_t>& nextId(){
+        static std::atomic<uint64_t> res{1};
+        return res;
+    }
+
+    Shard& localShard(){
+        thread_local ThreadShards threadShards;
+        for(auto &p:threadShards.shards){
+            if(p.first==_id){
+                return *p.second;
+            }
+        }
+        auto shard=std::make_shared<Shard>();
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            this->collectRetired();
+            _shards.push_back(shard);
+        }
+        threadShards.shards.emplace_back(_id, shard);
+        return *shard;
+    }
+
+    /**
+     *  Folds shards of exited threads into `_retired` so short-lived threads (hedged
+     *  requests) don't accumulate. Called under `_mutex`.
+     */
+    void collectRetired(){
+        for(auto it=_shards.begin();it!=_shards.end();){
+            if((*it)->retired.load()){
+                (*it)->mergeInto(_retired);
+                it=_shards.erase(it);
+            }else{
+                ++it;
+            }
+        }
+    }
+};
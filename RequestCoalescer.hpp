@@ -0,0 +1,133 @@
+//
+//  RequestCoalescer.hpp
+//  embeddedRest
+//
+//  Single-flight layer: concurrent identical idempotent requests share one
+//  in-flight execution and all of them receive its `Response`.
+//
+
+#pragma once
+
+#include <string>
+#include <map>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <cstdint>
+
+#include "Response.hpp"
+
+class UrlRequest;
+
+class RequestCoalescer{
+public:
+    typedef std::function<std::string(const UrlRequest&)> KeyFunction;
+    
+    struct Metrics{
+        
+        /**
+         *  Requests which actually went to the network (one per flight).
+         */
+        uint64_t executed=0;
+        
+        /**
+         *  Requests which joined a flight started by another thread.
+         */
+        uint64_t coalesced=0;
+        
+        /**
+         *  Flights running at the moment of snapshot.
+         */
+        uint64_t inFlight=0;
+    };
+    
+    /**
+     *  `keyFunction` defines which requests are identical. Empty function means
+     *  `UrlRequest::coalescingKey()` (method, host, port, uri and headers).
+     */
+    RequestCoalescer(KeyFunction keyFunction=KeyFunction()):
+    _keyFunction(std::move(keyFunction)){}
+    
+    RequestCoalescer(const RequestCoalescer&)=delete;
+    RequestCoalescer& operator=(const RequestCoalescer&)=delete;
+    
+    const KeyFunction& keyFunction() const{
+        return _keyFunction;
+    }
+    
+    /**
+     *  Runs `f` unless a call with the same key is already in flight, in which case
+     *  waits for it and returns its result. Exception thrown by `f` is rethrown in
+     *  every waiting thread.
+     */
+    std::shared_ptr<const Response> perform(const std::string &key,const std::function<Response()> &f){
+        std::shared_ptr<Call> call;
+        auto leader=false;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it=_calls.find(key);
+            if(it!=_calls.end()){
+                call=it->second;
+                ++_coalesced;
+            }else{
+                call=std::make_shared<Call>();
+                _calls.insert({key,call});
+                leader=true;
+                ++_executed;
+            }
+        }
+        if(leader){
+            try{
+                call->response=std::make_shared<const Response>(f());
+            }catch(...){
+                call->exception=std::current_exception();
+            }
+            {
+                //  requests arriving after this point start a new flight..
+                std::lock_guard<std::mutex> lock(_mutex);
+                _calls.erase(key);
+            }
+            {
+                std::lock_guard<std::mutex> lock(call->mutex);
+                call->done=true;
+            }
+            call->condition.notify_all();
+        }else{
+            std::unique_lock<std::mutex> lock(call->mutex);
+            call->condition.wait(lock, [&call]{
+                return call->done;
+            });
+        }
+        if(call->exception){
+            std::rethrow_exception(call->exception);
+        }
+        return call->response;
+    }
+    
+    Metrics metrics() const{
+        Metrics res;
+        res.executed=_executed.load();
+        res.coalesced=_coalesced.load();
+        std::lock_guard<std::mutex> lock(_mutex);
+        res.inFlight=_calls.size();
+        return res;
+    }
+
+protected:
+    struct Call{
+        std::mutex mutex;
+        std::condition_variable condition;
+        bool done=false;
+        std::shared_ptr<const Response> response;
+        std::exception_ptr exception;
+    };
+    
+    KeyFunction _keyFunction;
+    mutable std::mutex _mutex;
+    std::map<std::string,std::shared_ptr<Call>> _calls;
+    std::atomic<uint64_t> _executed{0};
+    std::atomic<uint64_t> _coalesced{0};
+};
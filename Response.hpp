@@ -12,12 +12,40 @@
 #include <vector>
 #include <sstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <algorithm>
+#include <cctype>
 
 class Response{
 public:
     struct IncorrectStartLineException{
         const std::string startLine;
     };
+    
+    /**
+     *  Body bytes which live outside of the response object (e.g. a memory-mapped
+     *  file of `DiskCache`). `body()` copies them into a string on first call only,
+     *  use `bodyData()`/`bodySize()` to access them without copying.
+     */
+    struct ExternalBody{
+        virtual ~ExternalBody(){}
+        
+        virtual const char* data() const=0;
+        
+        virtual size_t size() const=0;
+        
+        const std::string& string() const{
+            std::call_once(this->onceFlag, [this]{
+                this->copy.assign(this->data(), this->size());
+            });
+            return this->copy;
+        }
+        
+    protected:
+        mutable std::once_flag onceFlag;
+        mutable std::string copy;
+    };
 protected:
     int _statusCode;
     std::string _statusDescription;
@@ -25,7 +53,7 @@ protected:
     std::string _body;
 
     std::string _httpVersion;
-
+    std::shared_ptr<const ExternalBody> _externalBody;
     
     static void parseStartLine(const std::string &startLine,
                                decltype(_httpVersion) &httpVersion,
@@ -66,14 +94,68 @@ public:
     _statusDescription(std::move(statusDescription_)),
     _body(std::move(body_)){}
     
+    Response(decltype(_statusCode)statusCode_,
+             decltype(_statusDescription)statusDescription_,
+             decltype(_headers)headers_,
+             decltype(_externalBody)externalBody_):
+    _statusCode(statusCode_),
+    _statusDescription(std::move(statusDescription_)),
+    _headers(std::move(headers_)),
+    _httpVersion("HTTP/1.1"),
+    _externalBody(std::move(externalBody_)){}
+    
     const decltype(_body)& body() const{
+        if(_externalBody){
+            return _externalBody->string();
+        }
         return _body;
     }
     
+    const char* bodyData() const{
+        if(_externalBody){
+            return _externalBody->data();
+        }
+        return _body.data();
+    }
+    
+    size_t bodySize() const{
+        if(_externalBody){
+            return _externalBody->size();
+        }
+        return _body.size();
+    }
+    
+    bool hasExternalBody() const{
+        return bool(_externalBody);
+    }
+    
     const decltype(_headers)& headers() const{
         return _headers;
     }
     
+    /**
+     *  Returns value of the first header named `name` (case insensitive) or empty string.
+     */
+    std::string header(const std::string &name) const{
+        for(const auto &line:_headers){
+            auto colonPos=line.find(':');
+            if(colonPos!=name.length()){
+                continue;
+            }
+            auto nameMatches=std::equal(name.begin(), name.end(), line.begin(), [](char a,char b){
+                return std::tolower((unsigned char)a)==std::tolower((unsigned char)b);
+            });
+            if(nameMatches){
+                auto valuePos=line.find_first_not_of(' ', colonPos+1);
+                if(valuePos==std::string::npos){
+                    return {};
+                }
+                return line.substr(valuePos);
+            }
+        }
+        return {};
+    }
+    
     const decltype(_httpVersion)& httpVersion() const{
         return _httpVersion;
     }
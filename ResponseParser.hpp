@@ -0,0 +1,338 @@
+//
+//  ResponseParser.hpp
+//  embeddedRest
+//
+//  Incremental HTTP/1.1 response parser. Bytes are fed as they come off the socket,
+//  body is either accumulated into the resulting `Response` or handed to a callback
+//  chunk by chunk (after chunked transfer-encoding is decoded).
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <memory>
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <cctype>
+
+#include "Response.hpp"
+
+class ResponseParser{
+public:
+
+    /**
+     *  Called once status line and headers are parsed. `response` has empty body.
+     *  Return false to abort the transfer.
+     */
+    typedef std::function<bool(const Response &response)> HeadersHandler;
+    
+    /**
+     *  Called for every piece of decoded body. Return false to abort the transfer.
+     */
+    typedef std::function<bool(const char *data,size_t length)> BodyHandler;
+    
+    enum class State{
+        startLine,
+        headers,
+        body,
+        bodyUntilClose,
+        chunkSize,
+        chunkData,
+        chunkDataEnd,
+        trailers,
+        complete,
+        aborted,
+        failed,
+    };
+    
+    /**
+     *  Set to true when parsing response to HEAD request - it never has a body.
+     */
+    bool headRequest=false;
+    
+    ResponseParser(HeadersHandler headersHandler=HeadersHandler(),BodyHandler bodyHandler=BodyHandler()):
+    _headersHandler(std::move(headersHandler)),
+    _bodyHandler(std::move(bodyHandler)){}
+    
+    /**
+     *  Consumes bytes. Returns count of bytes consumed which is less than `length`
+     *  only if parsing stopped (message is complete, aborted or malformed) or if
+     *  `pauseAfterHeaders` was set and headers are done.
+     */
+    size_t feed(const char *data,size_t length){
+        size_t pos=0;
+        while(pos<length){
+            switch(_state){
+                case State::startLine:
+                case State::headers:
+                case State::chunkSize:
+                case State::chunkDataEnd:
+                case State::trailers:{
+                    std::string line;
+                    if(!this->readLine(data, length, pos, line)){
+                        return pos;
+                    }
+                    this->onLine(line);
+                    if(_paused){
+                        _paused=false;
+                        return pos;
+                    }
+                }break;
+                case State::body:
+                case State::chunkData:{
+                    auto available=uint64_t(length-pos);
+                    auto count=size_t(available<_remaining?available:_remaining);
+                    if(!this->onBody(data+pos, count)){
+                        return pos+count;
+                    }
+                    pos+=count;
+                    _remaining-=count;
+                    if(!_remaining){
+                        _state=(_state==State::body)?State::complete:State::chunkDataEnd;
+                    }
+                }break;
+                case State::bodyUntilClose:{
+                    if(!this->onBody(data+pos, length-pos)){
+                        return length;
+                    }
+                    pos=length;
+                }break;
+                case State::complete:
+                case State::aborted:
+                case State::failed:
+                    return pos;
+            }
+        }
+        return pos;
+    }
+    
+    /**
+     *  Must be called when peer closed the connection.
+     */
+    void finish(){
+        if(_state==State::bodyUntilClose){
+            _state=State::complete;
+        }else if(_state!=State::complete && _state!=State::aborted){
+            _state=State::failed;
+        }
+    }
+    
+    /**
+     *  Makes `feed` return right after headers are parsed so the caller can take
+     *  over the rest of the body (e.g. to splice it to a file).
+     */
+    void pauseAfterHeaders(bool value){
+        _pauseAfterHeaders=value;
+    }
+    
+    State state() const{
+        return _state;
+    }
+    
+    bool complete() const{
+        return _state==State::complete;
+    }
+    
+    bool done() const{
+        return _state==State::complete || _state==State::aborted || _state==State::failed;
+    }
+    
+    bool headersComplete() const{
+        return _state!=State::startLine && _state!=State::headers;
+    }
+    
+    bool chunked() const{
+        return _chunked;
+    }
+    
+    /**
+     *  True once `100 Continue` was received. Interim (1xx except 101) responses are
+     *  skipped, the final response is parsed after them.
+     */
+    bool continued() const{
+        return _continued;
+    }
+    
+    int interimResponses() const{
+        return _interimResponses;
+    }
+    
+    /**
+     *  True if response is complete and connection can carry the next request: body was
+     *  framed (not delimited by close) and server didn't ask to close.
+     */
+    bool keepAlive() const{
+        return _state==State::complete && !_closeDelimited && !_connectionClose;
+    }
+    
+    /**
+     *  Body bytes left to read for `Content-Length` framed body, -1 if unknown.
+     */
+    int64_t remainingBodyLength() const{
+        if(_state==State::body){
+            return int64_t(_remaining);
+        }else if(_state==State::complete){
+            return 0;
+        }
+        return -1;
+    }
+    
+    /**
+     *  Tells parser that the caller consumed `count` identity-encoded body bytes itself.
+     */
+    void skipBody(uint64_t count){
+        if(_state==State::body){
+            _remaining-=(count<_remaining?count:_remaining);
+            if(!_remaining){
+                _state=State::complete;
+            }
+        }
+    }
+    
+    const std::string& startLine() const{
+        return _startLine;
+    }
+    
+    const std::vector<std::string>& headers() const{
+        return _headers;
+    }
+    
+    /**
+     *  Builds final response. Body is empty if `BodyHandler` was set.
+     *  Throws `Response::IncorrectStartLineException` if nothing valid was received.
+     */
+    Response response(){
+        return Response(_startLine, std::move(_headers), std::move(_body));
+    }
+
+protected:
+    HeadersHandler _headersHandler;
+    BodyHandler _bodyHandler;
+    State _state=State::startLine;
+    std::string _line;
+    std::string _startLine;
+    std::vector<std::string> _headers;
+    std::string _body;
+    uint64_t _remaining=0;
+    bool _chunked=false;
+    bool _closeDelimited=false;
+    bool _connectionClose=false;
+    bool _pauseAfterHeaders=false;
+    bool _paused=false;
+    bool _continued=false;
+    int _interimResponses=0;
+    
+    /**
+     *  Appends bytes to `_line` until CRLF. Returns true and moves it to `line` when found.
+     */
+    bool readLine(const char *data,size_t length,size_t &pos,std::string &line){
+        while(pos<length){
+            auto c=data[pos++];
+            _line+=c;
+            if(c=='\n' && _line.length()>=2 && _line[_line.length()-2]=='\r'){
+                _line.resize(_line.length()-2);
+                line=std::move(_line);
+                _line.clear();
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    void onLine(const std::string &line){
+        switch(_state){
+            case State::startLine:
+                _startLine=line;
+                _state=State::headers;
+                break;
+            case State::headers:
+                if(line.length()){
+                    _headers.push_back(line);
+                }else{
+                    this->onHeadersEnd();
+                }
+                break;
+            case State::chunkSize:{
+                //  chunk extensions after ';' are ignored..
+                char *end=nullptr;
+                auto size=::strtoull(line.c_str(), &end, 16);
+                if(end==line.c_str()){
+                    _state=State::failed;
+                }else if(size){
+                    _remaining=size;
+                    _state=State::chunkData;
+                }else{
+                    _state=State::trailers;
+                }
+            }break;
+            case State::chunkDataEnd:
+                _state=line.length()?State::failed:State::chunkSize;
+                break;
+            case State::trailers:
+                if(line.empty()){
+                    _state=State::complete;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    
+    void onHeadersEnd(){
+        Response headersResponse(_startLine, std::vector<std::string>(_headers), std::string());
+        auto statusCode=headersResponse.statusCode();
+        auto transferEncoding=headersResponse.header("Transfer-Encoding");
+        auto contentLength=headersResponse.header("Content-Length");
+        auto connection=headersResponse.header("Connection");
+        if(statusCode>=100 && statusCode<200 && statusCode!=101){
+            //  interim response (100 Continue, 102, 103 Early Hints), the final one follows..
+            ++_interimResponses;
+            if(statusCode==100){
+                _continued=true;
+            }
+            _startLine.clear();
+            _headers.clear();
+            _state=State::startLine;
+            return;
+        }
+        std::transform(connection.begin(), connection.end(), connection.begin(), ::tolower);
+        _connectionClose=(connection.find("close")!=std::string::npos
+                          || (_startLine.compare(0, 8, "HTTP/1.0")==0 && connection.find("keep-alive")==std::string::npos));
+        if(this->headRequest || statusCode==204 || statusCode==304 || statusCode==101){
+            _state=State::complete;
+        }else if(transferEncoding.find("chunked")!=std::string::npos){
+            _chunked=true;
+            _state=State::chunkSize;
+        }else if(contentLength.length()){
+            _remaining=::strtoull(contentLength.c_str(), nullptr, 10);
+            _state=_remaining?State::body:State::complete;
+        }else{
+            _closeDelimited=true;
+            _state=State::bodyUntilClose;
+        }
+        if(_headersHandler && !_headersHandler(headersResponse)){
+            _state=State::aborted;
+        }
+        if(_pauseAfterHeaders){
+            _paused=true;
+        }
+    }
+    
+    bool onBody(const char *data,size_t length){
+        if(!length){
+            return true;
+        }
+        if(_bodyHandler){
+            if(!_bodyHandler(data, length)){
+                _state=State::aborted;
+                return false;
+            }
+        }else{
+            _body.append(data, length);
+        }
+        return true;
+    }
+};
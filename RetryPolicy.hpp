@@ -0,0 +1,216 @@
+//
+//  RetryPolicy.hpp
+//  embeddedRest
+//
+//  Retries with exponential backoff and hedged (duplicated) requests for idempotent
+//  methods. One policy instance is meant to be shared by many requests - it also
+//  keeps counters of retries and hedges.
+//
+
+#pragma once
+
+#include <vector>
+#include <chrono>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#endif
+
+class RetryPolicy{
+public:
+
+    /**
+     *  Why an attempt didn't produce a response.
+     */
+    enum class Failure{
+        none,
+        connectFailed,      //  connection refused or connect timed out
+        recvTimeout,        //  no data within `UrlRequest::timeout`
+        connectionClosed,   //  peer closed connection before complete response
+    };
+    
+    struct Stats{
+        uint64_t attempts=0;
+        uint64_t retries=0;
+        uint64_t hedges=0;
+        uint64_t hedgeWins=0;
+    };
+    
+    /**
+     *  Total attempts including the first one. 1 disables retries.
+     */
+    int maxAttempts=3;
+    
+    std::chrono::milliseconds baseDelay{50};
+    std::chrono::milliseconds maxDelay{2000};
+    
+    /**
+     *  Part of the delay which is randomized: 0 - fixed exponential delays,
+     *  1 - "full jitter" (uniform from 0 to the exponential delay).
+     */
+    double jitter=0.5;
+    
+    bool retryOnConnectFailure=true;
+    bool retryOnTimeout=true;
+    bool retryOnConnectionClosed=true;
+    std::vector<int> retryStatusCodes={502,503,504};
+    
+    /**
+     *  Delay after which a duplicate request is sent if the first one hasn't received
+     *  a single byte yet (set it to observed p95 latency). 0 disables hedging.
+     */
+    std::chrono::milliseconds hedgeDelay{0};
+    
+    /**
+     *  Maximum duplicates sent per attempt, every next one after another `hedgeDelay`.
+     */
+    int maxHedges=1;
+    
+    /**
+     *  Non idempotent methods are performed once regardless of policy unless this is false.
+     */
+    bool onlyIdempotent=true;
+    
+    RetryPolicy(){}
+    
+    RetryPolicy(const RetryPolicy &other):
+    maxAttempts(other.maxAttempts),
+    baseDelay(other.baseDelay),
+    maxDelay(other.maxDelay),
+    jitter(other.jitter),
+    retryOnConnectFailure(other.retryOnConnectFailure),
+    retryOnTimeout(other.retryOnTimeout),
+    retryOnConnectionClosed(other.retryOnConnectionClosed),
+    retryStatusCodes(other.retryStatusCodes),
+    hedgeDelay(other.hedgeDelay),
+    maxHedges(other.maxHedges),
+    onlyIdempotent(other.onlyIdempotent){}
+    
+    bool shouldRetry(Failure failure,int statusCode) const{
+        switch(failure){
+            case Failure::connectFailed:
+                return this->retryOnConnectFailure;
+            case Failure::recvTimeout:
+                return this->retryOnTimeout;
+            case Failure::connectionClosed:
+                return this->retryOnConnectionClosed;
+            case Failure::none:
+                return std::find(this->retryStatusCodes.begin(), this->retryStatusCodes.end(), statusCode)!=this->retryStatusCodes.end();
+        }
+        return false;
+    }
+    
+    /**
+     *  Delay before attempt number `attempt` (1 for the first retry).
+     */
+    std::chrono::milliseconds backoff(int attempt) const{
+        auto delay=double(this->baseDelay.count());
+        for(auto i=1;i<attempt && delay<this->maxDelay.count();++i){
+            delay*=2;
+        }
+        delay=std::min(delay, double(this->maxDelay.count()));
+        auto jitterPart=delay*std::min(std::max(this->jitter, 0.0), 1.0);
+        std::uniform_real_distribution<double> distribution(0, jitterPart);
+        return std::chrono::milliseconds(int64_t(delay-jitterPart+distribution(randomEngine())));
+    }
+    
+    Stats stats() const{
+        Stats res;
+        res.attempts=_attempts.load();
+        res.retries=_retries.load();
+        res.hedges=_hedges.load();
+        res.hedgeWins=_hedgeWins.load();
+        return res;
+    }
+    
+    void countAttempt(){
+        ++_attempts;
+    }
+    
+    void countRetry(){
+        ++_retries;
+    }
+    
+    void countHedge(){
+        ++_hedges;
+    }
+    
+    void countHedgeWin(){
+        ++_hedgeWins;
+    }
+    
+    /**
+     *  Lets one thread abort a request performed by another one: `cancel()` shuts down
+     *  socket the request is waiting on.
+     */
+    struct CancelToken{
+        
+        /**
+         *  Returns false if token is already cancelled.
+         */
+        bool attach(int fd){
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->fd=fd;
+            return !this->cancelled;
+        }
+        
+        /**
+         *  For transports where shutting the socket down would break other requests
+         *  (HTTP/2 streams) - `canceller` is called instead.
+         */
+        bool attach(std::function<void()> canceller){
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->canceller=std::move(canceller);
+            return !this->cancelled;
+        }
+        
+        void detach(){
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->fd=-1;
+            this->canceller=nullptr;
+        }
+        
+        void cancel(){
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->cancelled=true;
+            if(this->fd>=0){
+#ifdef _WIN32
+                ::shutdown(this->fd, SD_BOTH);
+#else
+                ::shutdown(this->fd, SHUT_RDWR);
+#endif
+            }
+            if(this->canceller){
+                this->canceller();
+            }
+        }
+        
+        bool isCancelled(){
+            std::lock_guard<std::mutex> lock(this->mutex);
+            return this->cancelled;
+        }
+    
+    protected:
+        std::mutex mutex;
+        int fd=-1;
+        std::function<void()> canceller;
+        bool cancelled=false;
+    };
+
+protected:
+    std::atomic<uint64_t> _attempts{0};
+    std::atomic<uint64_t> _retries{0};
+    std::atomic<uint64_t> _hedges{0};
+    std::atomic<uint64_t> _hedgeWins{0};
+    
+    static std::mt19937& randomEngine(){
+        static thread_local std::mt19937 res{std::random_device{}()};
+        return res;
+    }
+};
@@ -0,0 +1,312 @@
+//
+//  SegmentedDownload.hpp
+//  embeddedRest
+//
+//  Downloads a resource into a file over several concurrent `Range:` requests.
+//  Every segment is written straight into its slot of a preallocated memory-mapped
+//  file. Servers without range support get a single stream. POSIX only.
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "UrlRequest.hpp"
+
+class SegmentedDownload{
+public:
+    struct FileException{
+        const std::string filepath;
+        const int error;
+    };
+    
+    struct Result{
+        
+        /**
+         *  200 when the whole resource is in the file, otherwise status of the failed
+         *  request (408 for timeouts, 0 if no response at all).
+         */
+        int statusCode=0;
+        uint64_t size=0;
+        size_t segments=0;
+        size_t retries=0;
+        bool ranged=false;
+        
+        bool succeeded() const{
+            return this->statusCode==200;
+        }
+    };
+    
+    /**
+     *  Maximum count of concurrent range requests.
+     */
+    size_t segmentsCount=4;
+    
+    /**
+     *  Resources are not split into segments smaller than this.
+     */
+    uint64_t minSegmentSize=1024*1024;
+    
+    /**
+     *  How many times a failed segment is requested again (from the byte it stopped at).
+     *  Only dropped connections, timeouts, 429 and 5xx are retried.
+     */
+    int maxRetries=3;
+    
+    /**
+     *  Delay before the first retry of a segment, doubled for every next one.
+     */
+    std::chrono::milliseconds retryDelay{250};
+    
+    SegmentedDownload(UrlRequest request,std::string filepath):
+    _request(std::move(request)),
+    _filepath(std::move(filepath)){}
+    
+    /**
+     *  Throws `FileException` if the file can't be created or written. Network failures
+     *  (including unresolvable host) end up in `Result::statusCode`.
+     */
+    Result perform(){
+        Result result;
+        uint64_t size=0;
+        std::string validator;
+        if(this->probe(size, validator)){
+            if(this->performRanged(size, validator, result)){
+                return result;
+            }
+        }
+        this->performSingleStream(result);
+        return result;
+    }
+
+protected:
+    UrlRequest _request;
+    std::string _filepath;
+    
+    struct Segment{
+        uint64_t begin=0;
+        uint64_t length=0;
+        uint64_t written=0;
+        int statusCode=0;
+        size_t retries=0;
+    };
+    
+    /**
+     *  Asks resource size with HEAD. Returns true if server announces byte ranges and the
+     *  resource has a validator for `If-Range` (strong ETag or Last-Modified) - without one
+     *  a resource changed between segments would be stitched from different versions.
+     */
+    bool probe(uint64_t &size,std::string &validator){
+        auto headRequest=_request;
+        headRequest.method("HEAD");
+        try{
+            auto response=headRequest.perform();
+            if(response.statusCode()!=200){
+                return false;
+            }
+            auto contentLength=response.header("Content-Length");
+            if(contentLength.empty() || response.header("Accept-Ranges").find("bytes")==std::string::npos){
+                return false;
+            }
+            size=::strtoull(contentLength.c_str(), nullptr, 10);
+            validator=response.header("ETag");
+            if(validator.empty() || validator.compare(0, 2, "W/")==0){
+                //  weak ETags can't be used in If-Range..
+                validator=response.header("Last-Modified");
+            }
+            return size>0 && validator.length();
+        }catch(...){
+            return false;
+        }
+    }
+    
+    /**
+     *  Returns false if server refused ranges and download must be repeated as a single stream.
+     */
+    bool performRanged(uint64_t size,const std::string &validator,Result &result){
+        auto fd=::open(_filepath.c_str(), O_RDWR|O_CREAT|O_TRUNC, 0644);
+        if(fd<0){
+            throw FileException{_filepath, errno};
+        }
+        if(::posix_fallocate(fd, 0, off_t(size))!=0 && ::ftruncate(fd, off_t(size))!=0){
+            auto error=errno;
+            ::close(fd);
+            throw FileException{_filepath, error};
+        }
+        auto address=::mmap(nullptr, size_t(size), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+        if(address==MAP_FAILED){
+            auto error=errno;
+            ::close(fd);
+            throw FileException{_filepath, error};
+        }
+        auto destination=(char*)address;
+        
+        auto count=size_t((size+this->minSegmentSize-1)/this->minSegmentSize);
+        if(count>this->segmentsCount){
+            count=this->segmentsCount;
+        }
+        if(!count){
+            count=1;
+        }
+        std::vector<Segment> segments(count);
+        auto segmentLength=size/count;
+        for(size_t i=0;i<count;++i){
+            segments[i].begin=i*segmentLength;
+            segments[i].length=(i==count-1)?(size-segments[i].begin):segmentLength;
+        }
+        
+        std::atomic<bool> rangesRefused(false);
+        std::vector<std::thread> threads;
+        threads.reserve(count);
+        for(auto &segment:segments){
+            threads.emplace_back([this,&segment,&validator,&rangesRefused,destination]{
+                this->downloadSegment(segment, validator, destination, rangesRefused);
+            });
+        }
+        for(auto &thread:threads){
+            thread.join();
+        }
+        ::msync(address, size_t(size), MS_SYNC);
+        ::munmap(address, size_t(size));
+        ::close(fd);
+        
+        if(rangesRefused){
+            return false;
+        }
+        result.ranged=true;
+        result.segments=count;
+        result.statusCode=200;
+        for(const auto &segment:segments){
+            result.retries+=segment.retries;
+            result.size+=segment.written;
+            if(segment.written!=segment.length && result.statusCode==200){
+                result.statusCode=segment.statusCode;
+            }
+        }
+        return true;
+    }
+    
+    void downloadSegment(Segment &segment,const std::string &validator,char *destination,std::atomic<bool> &rangesRefused){
+        auto delay=this->retryDelay;
+        for(auto attempt=0;attempt<=this->maxRetries && segment.written<segment.length && !rangesRefused;++attempt){
+            if(attempt){
+                ++segment.retries;
+                std::this_thread::sleep_for(delay);
+                delay*=2;
+            }
+            const auto from=segment.begin+segment.written;
+            const auto to=segment.begin+segment.length-1;
+            std::stringstream rangeHeader;
+            rangeHeader<<"Range: bytes="<<from<<"-"<<to;
+            auto request=_request;
+            request.addHeader(rangeHeader.str());
+            request.addHeader("If-Range: "+validator);
+            std::stringstream expectedContentRange;
+            expectedContentRange<<"bytes "<<from<<"-";
+            const auto contentRangePrefix=expectedContentRange.str();
+            auto accepted=false;
+            auto retryable=true;
+            try{
+                auto response=request.performStreaming([&segment,destination](const char *data,size_t length){
+                    if(segment.written+length>segment.length){
+                        return false;
+                    }
+                    ::memcpy(destination+segment.begin+segment.written, data, length);
+                    segment.written+=length;
+                    return true;
+                },[&segment,&rangesRefused,&contentRangePrefix,&accepted](const Response &response){
+                    segment.statusCode=response.statusCode();
+                    if(response.statusCode()==200){
+                        //  ranges ignored or resource changed (If-Range mismatch)..
+                        rangesRefused=true;
+                        return false;
+                    }
+                    accepted=(response.statusCode()==206
+                              && response.header("Content-Range").compare(0, contentRangePrefix.length(), contentRangePrefix)==0);
+                    return accepted;
+                });
+                if(response.statusCode()==408){
+                    segment.statusCode=408;
+                }
+                if(request.failure()==RetryPolicy::Failure::none && !accepted){
+                    const auto statusCode=segment.statusCode;
+                    retryable=(statusCode==408 || statusCode==429 || statusCode>=500);
+                }
+            }catch(...){
+                //  no response at all, retried..
+            }
+            if(!retryable){
+                break;
+            }
+        }
+    }
+    
+    void performSingleStream(Result &result){
+        auto fd=::open(_filepath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        if(fd<0){
+            throw FileException{_filepath, errno};
+        }
+        uint64_t written=0;
+        auto writeFailed=false;
+        auto request=_request;
+        ResponseParser::BodyHandler bodyHandler=[fd,&written,&writeFailed](const char *data,size_t length){
+            while(length){
+                auto res=::write(fd, data, length);
+                if(res<0){
+                    if(errno==EINTR){
+                        continue;
+                    }
+                    writeFailed=true;
+                    return false;
+                }
+                data+=res;
+                length-=size_t(res);
+                written+=uint64_t(res);
+            }
+            return true;
+        };
+        std::unique_ptr<Response> response;
+        try{
+            response.reset(new Response(request.performStreaming(bodyHandler, [](const Response &response){
+                return response.statusCode()==200;
+            })));
+        }catch(const UrlRequest::HostIsNullException&){
+            //  no response at all, reported as status 0..
+        }catch(const Response::IncorrectStartLineException&){
+        }
+        auto error=errno;
+        ::close(fd);
+        if(writeFailed){
+            throw FileException{_filepath, error};
+        }
+        result.size=written;
+        result.segments=1;
+        if(!response){
+            return;
+        }
+        result.statusCode=response->statusCode();
+        //  chunked or close-delimited body cut short..
+        if(result.statusCode==200 && request.failure()!=RetryPolicy::Failure::none){
+            result.statusCode=0;
+        }
+        auto contentLength=response->header("Content-Length");
+        if(result.statusCode==200 && contentLength.length() && ::strtoull(contentLength.c_str(), nullptr, 10)!=written){
+            result.statusCode=0;
+        }
+    }
+};
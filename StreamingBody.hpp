@@ -0,0 +1,214 @@
+//
+//  StreamingBody.hpp
+//  embeddedRest
+//
+//  Request body of unknown length produced piece by piece while it is being sent with
+//  `Transfer-Encoding: chunked`. The producer runs on its own thread and is held back
+//  once `maxBuffered` bytes are waiting to be written, so upload memory stays bounded
+//  and producing overlaps with sending.
+//
+//      request.method("POST").bodyStream(StreamingBody::ndjson<Event>([&](Event &event){
+//          return source.next(event);
+//      }));
+//
+
+#pragma once
+
+#include <string>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <atomic>
+#include <cstdint>
+
+#include "JsonEncoder.hpp"
+
+class StreamingBody{
+public:
+
+    /**
+     *  Puts next piece of the body into `piece` (cleared before every call) and returns true,
+     *  returns false when the body is complete. An exception aborts the upload (the final
+     *  chunk isn't sent, the request fails with a closed connection), see `exception()`.
+     */
+    typedef std::function<bool(std::string &piece)> Producer;
+
+    /**
+     *  Bytes produced but not written yet above which the producer waits.
+     */
+    size_t maxBuffered=1<<20;
+
+    /**
+     *  Pieces waiting are gathered into one chunk up to this size. A chunk is written as
+     *  soon as something is available - it is not held back to fill it up.
+     */
+    size_t chunkSize=64*1024;
+
+    /**
+     *  Run producer on its own thread. If false it's called by the sending thread between
+     *  writes.
+     */
+    bool background=true;
+
+    StreamingBody(Producer producer):_producer(std::move(producer)){}
+
+    StreamingBody(const StreamingBody&)=delete;
+    StreamingBody& operator=(const StreamingBody&)=delete;
+
+    ~StreamingBody(){
+        this->stop();
+    }
+
+    /**
+     *  Body of newline delimited JSON records which `next` fills one at a time (returns
+     *  false when there are no more). Only the record being encoded is kept in memory
+     *  besides the buffered chunks.
+     */
+    template<class T>
+    static std::shared_ptr<StreamingBody> ndjson(std::function<bool(T&)> next){
+        auto buffer=std::make_shared<rapidjson::StringBuffer>();
+        return std::make_shared<StreamingBody>([next,buffer](std::string &piece){
+            T record;
+            if(!next(record)){
+                return false;
+            }
+            buffer->Clear();
+            rapidjson::Writer<rapidjson::StringBuffer> writer(*buffer);
+            JsonEncoder::write(writer, record);
+            piece.reserve(buffer->GetSize()+1);
+            piece.assign(buffer->GetString(), buffer->GetSize());
+            piece+='\n';
+            return true;
+        });
+    }
+
+    /**
+     *  Next chunk to write, waits for the producer if nothing is buffered. Returns false
+     *  when the body is complete. A body can be sent once only.
+     */
+    bool next(std::string &chunk){
+        chunk.clear();
+        if(!this->background){
+            std::string piece;
+            while(chunk.length()<this->chunkSize && !_finished){
+                piece.clear();
+                if(!this->callProducer(piece)){
+                    _finished=true;
+                }else{
+                    chunk+=piece;
+                }
+            }
+            if(_exception){
+                chunk.clear();
+                return false;
+            }
+            _bytes+=chunk.length();
+            return chunk.length()>0;
+        }
+        std::unique_lock<std::mutex> lock(_mutex);
+        if(!_thread.joinable() && !_finished){
+            _thread=std::thread(&StreamingBody::produce, this);
+        }
+        _condition.wait(lock, [this]{
+            return _pieces.size() || _finished;
+        });
+        if(_exception){
+            return false;
+        }
+        while(_pieces.size() && (chunk.empty() || chunk.length()+_pieces.front().length()<=this->chunkSize)){
+            if(chunk.empty()){
+                chunk.swap(_pieces.front());
+            }else{
+                chunk+=_pieces.front();
+            }
+            _pieces.pop_front();
+        }
+        _buffered-=chunk.length();
+        lock.unlock();
+        _condition.notify_all();
+        _bytes+=chunk.length();
+        return chunk.length()>0;
+    }
+
+    /**
+     *  Stops and joins the producer thread (the body won't be completed).
+     */
+    void stop(){
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _stopped=true;
+        }
+        _condition.notify_all();
+        if(_thread.joinable()){
+            _thread.join();
+        }
+    }
+
+    /**
+     *  Exception thrown by the producer, nullptr if none.
+     */
+    std::exception_ptr exception(){
+        std::lock_guard<std::mutex> lock(_mutex);
+        return _exception;
+    }
+
+    /**
+     *  Body bytes handed out by `next` so far.
+     */
+    uint64_t bytes() const{
+        return _bytes.load();
+    }
+
+protected:
+    Producer _producer;
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::deque<std::string> _pieces;
+    size_t _buffered=0;
+    bool _finished=false;
+    bool _stopped=false;
+    std::exception_ptr _exception;
+    std::thread _thread;
+    std::atomic<uint64_t> _bytes{0};
+
+    bool callProducer(std::string &piece){
+        try{
+            return _producer(piece);
+        }catch(...){
+            std::lock_guard<std::mutex> lock(_mutex);
+            _exception=std::current_exception();
+            return false;
+        }
+    }
+
+    void produce(){
+        std::string piece;
+        while(true){
+            piece.clear();
+            auto more=this->callProducer(piece);
+            std::unique_lock<std::mutex> lock(_mutex);
+            if(!more){
+                _finished=true;
+                break;
+            }
+            if(piece.empty()){
+                continue;
+            }
+            _condition.wait(lock, [this]{
+                return _buffered<this->maxBuffered || _stopped;
+            });
+            if(_stopped){
+                break;
+            }
+            _buffered+=piece.length();
+            _pieces.push_back(std::move(piece));
+            lock.unlock();
+            _condition.notify_all();
+        }
+        _condition.notify_all();
+    }
+};
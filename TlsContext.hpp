@@ -0,0 +1,466 @@
+//
+//  TlsContext.hpp
+//  embeddedRest
+//
+//  TLS over OpenSSL (1.1.0 or newer). Compiled in only when `EMBEDDED_REST_TLS` is
+//  defined - link with `-lssl -lcrypto` then. One context is meant to be shared by many
+//  requests: it keeps client sessions (tickets) per host so repeated connections skip
+//  the full handshake, and a pool of idle keep-alive connections.
+//
+
+#pragma once
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include <string>
+#include <map>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <cstdint>
+#include <cerrno>
+
+#ifdef _WIN32
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include "Transport.hpp"
+
+class TlsContext;
+
+/**
+ *  TLS session over a connected non-blocking socket. Owns both.
+ */
+class TlsConnection:public Connection{
+public:
+    TlsConnection(TlsContext *context,std::string key,int fd,SSL *ssl):
+    _context(context),
+    _key(std::move(key)),
+    _fd(fd),
+    _ssl(ssl){}
+
+    ~TlsConnection(){
+        if(_handshakeDone){
+            //  close_notify, don't wait for the answer..
+            ::SSL_shutdown(_ssl);
+        }
+        ::SSL_free(_ssl);
+#ifdef _WIN32
+        ::closesocket(_fd);
+#else
+        ::close(_fd);
+#endif
+    }
+
+    int fd() const override{
+        return _fd;
+    }
+
+    const std::string& key() const{
+        return _key;
+    }
+
+    TlsContext* context() const{
+        return _context;
+    }
+
+    SSL* nativeHandle() const{
+        return _ssl;
+    }
+
+    /**
+     *  Protocol selected by server with ALPN ("h2", "http/1.1"), empty if none.
+     */
+    std::string alpnProtocol() const{
+        const unsigned char *data=nullptr;
+        unsigned int length=0;
+        ::SSL_get0_alpn_selected(_ssl, &data, &length);
+        return std::string((const char*)data, data?length:0);
+    }
+
+    bool handshake(timeval timeout){
+        while(true){
+            auto res=::SSL_connect(_ssl);
+            if(res==1){
+                _handshakeDone=true;
+                return true;
+            }
+            if(!this->waitFor(::SSL_get_error(_ssl, res), timeout)){
+                return false;
+            }
+        }
+    }
+
+    bool send(const char *data,size_t length,timeval timeout) override{
+        while(length){
+            auto res=::SSL_write(_ssl, data, int(length));
+            if(res>0){
+                data+=res;
+                length-=size_t(res);
+                continue;
+            }
+            if(!this->waitFor(::SSL_get_error(_ssl, res), timeout)){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    long receive(char *buffer,size_t length,timeval timeout) override{
+        while(true){
+            auto res=::SSL_read(_ssl, buffer, int(length));
+            if(res>0){
+                this->rearmQuickAck();
+                return res;
+            }
+            auto error=::SSL_get_error(_ssl, res);
+            switch(error){
+                case SSL_ERROR_ZERO_RETURN:
+                    return 0;
+                case SSL_ERROR_SYSCALL:
+                    //  closed without close_notify - many servers do so..
+                    ::ERR_clear_error();
+                    return 0;
+                case SSL_ERROR_WANT_READ:
+                case SSL_ERROR_WANT_WRITE:{
+                    auto n=wait(_fd, error==SSL_ERROR_WANT_WRITE, timeout);
+                    if(n==0){
+                        return -2;
+                    }
+                    if(n<0){
+                        return -1;
+                    }
+                }break;
+                default:
+                    ::ERR_clear_error();
+                    return -1;
+            }
+        }
+    }
+
+    std::chrono::steady_clock::time_point idleSince;
+
+protected:
+    TlsContext *_context;
+    std::string _key;
+    int _fd;
+    SSL *_ssl;
+    bool _handshakeDone=false;
+
+    bool waitFor(int error,timeval timeout){
+        if(error!=SSL_ERROR_WANT_READ && error!=SSL_ERROR_WANT_WRITE){
+            ::ERR_clear_error();
+            return false;
+        }
+        return wait(_fd, error==SSL_ERROR_WANT_WRITE, timeout)==1;
+    }
+};
+
+class TlsContext{
+public:
+    struct Stats{
+        uint64_t fullHandshakes=0;
+        uint64_t resumedHandshakes=0;
+        uint64_t failedHandshakes=0;
+        uint64_t reusedConnections=0;
+    };
+
+    /**
+     *  Verify server certificate against trusted CAs and the host name. Read on every
+     *  connection.
+     */
+    bool verifyPeer=true;
+
+    /**
+     *  Keep connections open after complete responses and reuse them for the next
+     *  request to the same host and port.
+     */
+    bool keepAlive=true;
+
+    size_t maxIdlePerHost=4;
+    std::chrono::seconds idleTimeout{30};
+
+    TlsContext():
+    _ctx(::SSL_CTX_new(::TLS_client_method())){
+        SSL_CTX_set_min_proto_version(_ctx, TLS1_2_VERSION);
+        ::SSL_CTX_set_default_verify_paths(_ctx);
+        SSL_CTX_set_session_cache_mode(_ctx, SSL_SESS_CACHE_CLIENT|SSL_SESS_CACHE_NO_INTERNAL_STORE);
+        ::SSL_CTX_sess_set_new_cb(_ctx, &TlsContext::onNewSession);
+    }
+
+    TlsContext(const TlsContext&)=delete;
+    TlsContext& operator=(const TlsContext&)=delete;
+
+    ~TlsContext(){
+        _idle.clear();
+        for(auto &p:_sessions){
+            ::SSL_SESSION_free(p.second);
+        }
+        ::SSL_CTX_free(_ctx);
+    }
+
+    /**
+     *  Context used for `https://` urls if no other context is set.
+     */
+    static std::shared_ptr<TlsContext> shared(){
+        static auto res=std::make_shared<TlsContext>();
+        return res;
+    }
+
+    /**
+     *  Trusts CA certificates from PEM `caFile` and/or `caPath` directory in addition to
+     *  system ones.
+     */
+    bool loadVerifyLocations(const std::string &caFile,const std::string &caPath=std::string()){
+        return ::SSL_CTX_load_verify_locations(_ctx,
+                                               caFile.length()?caFile.c_str():nullptr,
+                                               caPath.length()?caPath.c_str():nullptr)==1;
+    }
+
+    /**
+     *  Performs handshake over connected socket `fd` (owned by the result, closed on
+     *  failure). `key` identifies the peer (host:port) for session resumption and pooling.
+     *  `protocols` are offered with ALPN in order of preference.
+     */
+    std::unique_ptr<TlsConnection> connect(int fd,const std::string &host,const std::string &key,timeval timeout,
+                                           const std::vector<std::string> &protocols=std::vector<std::string>())
+    {
+        auto ssl=::SSL_new(_ctx);
+        if(!ssl){
+            closeSocket(fd);
+            return nullptr;
+        }
+#ifdef MSG_NOSIGNAL
+        auto bio=::BIO_new(socketMethod());
+        if(!bio){
+            ::SSL_free(ssl);
+            closeSocket(fd);
+            return nullptr;
+        }
+        ::BIO_set_data(bio, (void*)intptr_t(fd));
+        ::SSL_set_bio(ssl, bio, bio);
+#else
+#ifdef SO_NOSIGPIPE
+        TransportOptions::setOption(fd, SOL_SOCKET, SO_NOSIGPIPE, 1);
+#endif
+        ::SSL_set_fd(ssl, fd);
+#endif
+        std::unique_ptr<TlsConnection> connection(new TlsConnection(this, key, fd, ssl));
+        SSL_set_app_data(ssl, connection.get());
+        unsigned char address[16];
+        auto isAddress=(::inet_pton(AF_INET, host.c_str(), address)==1 || ::inet_pton(AF_INET6, host.c_str(), address)==1);
+        if(!isAddress){
+            SSL_set_tlsext_host_name(ssl, host.c_str());
+        }
+        if(protocols.size()){
+            std::string wire;
+            for(const auto &protocol:protocols){
+                wire+=char(protocol.length());
+                wire+=protocol;
+            }
+            ::SSL_set_alpn_protos(ssl, (const unsigned char*)wire.data(), (unsigned int)wire.length());
+        }
+        if(this->verifyPeer){
+            ::SSL_set_verify(ssl, SSL_VERIFY_PEER, nullptr);
+            if(isAddress){
+                ::X509_VERIFY_PARAM_set1_ip_asc(::SSL_get0_param(ssl), host.c_str());
+            }else{
+                ::SSL_set1_host(ssl, host.c_str());
+            }
+        }else{
+            ::SSL_set_verify(ssl, SSL_VERIFY_NONE, nullptr);
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it=_sessions.find(key);
+            if(it!=_sessions.end()){
+                ::SSL_set_session(ssl, it->second);
+            }
+        }
+        if(!connection->handshake(timeout)){
+            ++_failedHandshakes;
+            auto verifyResult=::SSL_get_verify_result(ssl);
+            if(verifyResult!=X509_V_OK){
+                std::cerr<<"certificate verification failed: "<<::X509_verify_cert_error_string(verifyResult)<<std::endl;
+            }
+            this->forgetSession(key);
+            return nullptr;
+        }
+        if(::SSL_session_reused(ssl)){
+            ++_resumedHandshakes;
+        }else{
+            ++_fullHandshakes;
+        }
+        return connection;
+    }
+
+    /**
+     *  Returns idle connection to `key` which is still open or nullptr.
+     */
+    std::unique_ptr<TlsConnection> takeIdle(const std::string &key){
+        std::unique_ptr<TlsConnection> res;
+        std::vector<std::unique_ptr<TlsConnection>> stale;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto it=_idle.find(key);
+            if(it==_idle.end()){
+                return nullptr;
+            }
+            auto &connections=it->second;
+            const auto now=std::chrono::steady_clock::now();
+            while(connections.size() && !res){
+                auto connection=std::move(connections.back());
+                connections.pop_back();
+                timeval noWait{0, 0};
+                //  readable idle connection means server closed it (or sent garbage)..
+                if(now-connection->idleSince<this->idleTimeout && Connection::wait(connection->fd(), false, noWait)==0){
+                    res=std::move(connection);
+                }else{
+                    stale.push_back(std::move(connection));
+                }
+            }
+        }
+        if(res){
+            ++_reusedConnections;
+        }
+        return res;
+    }
+
+    /**
+     *  Puts connection which finished a keep-alive exchange back to the pool.
+     */
+    void release(std::unique_ptr<TlsConnection> connection){
+        connection->idleSince=std::chrono::steady_clock::now();
+        std::unique_ptr<TlsConnection> evicted;
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &connections=_idle[connection->key()];
+        if(connections.size()>=this->maxIdlePerHost){
+            evicted=std::move(connections.front());
+            connections.erase(connections.begin());
+        }
+        connections.push_back(std::move(connection));
+    }
+
+    Stats stats() const{
+        Stats res;
+        res.fullHandshakes=_fullHandshakes.load();
+        res.resumedHandshakes=_resumedHandshakes.load();
+        res.failedHandshakes=_failedHandshakes.load();
+        res.reusedConnections=_reusedConnections.load();
+        return res;
+    }
+
+    SSL_CTX* nativeHandle() const{
+        return _ctx;
+    }
+
+protected:
+    SSL_CTX *_ctx;
+    std::mutex _mutex;
+    std::map<std::string,SSL_SESSION*> _sessions;
+    std::map<std::string,std::vector<std::unique_ptr<TlsConnection>>> _idle;
+    std::atomic<uint64_t> _fullHandshakes{0};
+    std::atomic<uint64_t> _resumedHandshakes{0};
+    std::atomic<uint64_t> _failedHandshakes{0};
+    std::atomic<uint64_t> _reusedConnections{0};
+
+    /**
+     *  OpenSSL calls it for every session/ticket received (with TLS 1.3 - after the handshake).
+     */
+    static int onNewSession(SSL *ssl,SSL_SESSION *session){
+        auto connection=(TlsConnection*)SSL_get_app_data(ssl);
+        if(!connection || !::SSL_SESSION_is_resumable(session)){
+            return 0;
+        }
+        auto context=connection->context();
+        std::lock_guard<std::mutex> lock(context->_mutex);
+        auto &stored=context->_sessions[connection->key()];
+        if(stored){
+            ::SSL_SESSION_free(stored);
+        }
+        stored=session;
+        return 1;   //  we keep the reference
+    }
+
+    void forgetSession(const std::string &key){
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it=_sessions.find(key);
+        if(it!=_sessions.end()){
+            ::SSL_SESSION_free(it->second);
+            _sessions.erase(it);
+        }
+    }
+
+    static void closeSocket(int fd){
+#ifdef _WIN32
+        ::closesocket(fd);
+#else
+        ::close(fd);
+#endif
+    }
+
+#ifdef MSG_NOSIGNAL
+    /**
+     *  Socket BIO like OpenSSL's own but writing with `MSG_NOSIGNAL`: a peer which reset
+     *  the connection mustn't kill the process with SIGPIPE. The socket stays owned by
+     *  `TlsConnection`.
+     */
+    static BIO_METHOD* socketMethod(){
+        static BIO_METHOD *res=[]{
+            auto method=::BIO_meth_new(BIO_TYPE_SOCKET, "embeddedRest socket");
+            ::BIO_meth_set_write(method, &TlsContext::socketWrite);
+            ::BIO_meth_set_read(method, &TlsContext::socketRead);
+            ::BIO_meth_set_ctrl(method, &TlsContext::socketCtrl);
+            ::BIO_meth_set_create(method, [](BIO *bio){
+                ::BIO_set_init(bio, 1);
+                return 1;
+            });
+            return method;
+        }();
+        return res;
+    }
+
+    static int socketFd(BIO *bio){
+        return int(intptr_t(::BIO_get_data(bio)));
+    }
+
+    static int socketWrite(BIO *bio,const char *data,int length){
+        auto res=int(::send(socketFd(bio), data, size_t(length), MSG_NOSIGNAL));
+        BIO_clear_retry_flags(bio);
+        if(res<=0 && ::BIO_sock_should_retry(res)){
+            BIO_set_retry_write(bio);
+        }
+        return res;
+    }
+
+    static int socketRead(BIO *bio,char *data,int length){
+        auto res=int(::recv(socketFd(bio), data, size_t(length), 0));
+        BIO_clear_retry_flags(bio);
+        if(res<0 && ::BIO_sock_should_retry(res)){
+            BIO_set_retry_read(bio);
+        }
+        return res;
+    }
+
+    static long socketCtrl(BIO *bio,int command,long,void *pointer){
+        switch(command){
+            case BIO_C_GET_FD:
+                if(pointer){
+                    *(int*)pointer=socketFd(bio);
+                }
+                return socketFd(bio);
+            case BIO_CTRL_FLUSH:
+                return 1;
+            default:
+                return 0;
+        }
+    }
+#endif
+};
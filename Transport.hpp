@@ -0,0 +1,503 @@
+//
+//  Transport.hpp
+//  embeddedRest
+//
+//  Byte stream a request is sent over. `UrlRequest` serializes requests and parses
+//  responses through this interface only, so plain sockets and TLS share one code path.
+//  Plain sockets are opened by `SocketTransport`; another `Transport` replaces it
+//  altogether (see MemoryTransport.hpp).
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <functional>
+#include <iostream>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/un.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include "TransportOptions.hpp"
+
+class Connection{
+public:
+    struct Buffer{
+        const char *data;
+        size_t length;
+    };
+
+    virtual ~Connection(){}
+
+    /**
+     *  Underlying socket (used for cancellation and `splice`), -1 if there is none.
+     */
+    virtual int fd() const=0;
+
+    /**
+     *  Sends all `length` bytes. `timeout` applies to every wait for socket buffer space.
+     */
+    virtual bool send(const char *data,size_t length,timeval timeout)=0;
+
+    /**
+     *  Gathering send of `count` buffers - one write for head and body where the
+     *  connection supports it.
+     */
+    virtual bool sendv(const Buffer *buffers,size_t count,timeval timeout){
+        for(size_t i=0;i<count;++i){
+            if(buffers[i].length && !this->send(buffers[i].data, buffers[i].length, timeout)){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     *  Returns count of bytes received, 0 if peer closed connection, -1 on error
+     *  and -2 on timeout.
+     */
+    virtual long receive(char *buffer,size_t length,timeval timeout)=0;
+
+    /**
+     *  True if bytes on the socket are the bytes of the response (no encryption), so
+     *  the socket can be read directly.
+     */
+    virtual bool plain() const{
+        return false;
+    }
+
+    /**
+     *  Waits until socket `fd` is readable (`forWrite` false) or writable. Returns 1 if it
+     *  is, 0 on timeout and -1 on error.
+     */
+    static int wait(int fd,bool forWrite,timeval timeout){
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        return ::select(fd+1, forWrite?nullptr:&fds, forWrite?&fds:nullptr, nullptr, &timeout);
+    }
+
+    /**
+     *  Re-arm TCP_QUICKACK after every read (see `TransportOptions::quickAck`).
+     */
+    bool quickAck=false;
+
+protected:
+    void rearmQuickAck() const{
+#ifdef TCP_QUICKACK
+        if(this->quickAck){
+            TransportOptions::setOption(this->fd(), IPPROTO_TCP, TCP_QUICKACK, 1);
+        }
+#endif
+    }
+};
+
+/**
+ *  Plain (non-blocking) socket. Owns and closes it.
+ */
+class SocketConnection:public Connection{
+public:
+    SocketConnection(int fd):_fd(fd){}
+
+    ~SocketConnection(){
+#ifdef _WIN32
+        ::closesocket(_fd);
+#else
+        ::close(_fd);
+#endif
+    }
+
+    int fd() const override{
+        return _fd;
+    }
+
+    bool plain() const override{
+        return true;
+    }
+
+    bool send(const char *data,size_t length,timeval timeout) override{
+        while(length){
+#ifdef _WIN32
+            auto res=long(::send(_fd, data, int(length), 0));
+#else
+#ifdef MSG_NOSIGNAL
+            auto res=long(::send(_fd, data, length, MSG_NOSIGNAL));
+#else
+            auto res=long(::send(_fd, data, length, 0));
+#endif
+#endif
+            if(res>0){
+                data+=res;
+                length-=size_t(res);
+                continue;
+            }
+#ifndef _WIN32
+            if(res<0 && errno==EINTR){
+                continue;
+            }
+            if(res<0 && errno!=EAGAIN && errno!=EWOULDBLOCK){
+                return false;
+            }
+#endif
+            if(wait(_fd, true, timeout)!=1){
+                return false;
+            }
+        }
+        return true;
+    }
+
+#ifndef _WIN32
+    bool sendv(const Buffer *buffers,size_t count,timeval timeout) override{
+        std::vector<iovec> vectors;
+        vectors.reserve(count);
+        for(size_t i=0;i<count;++i){
+            if(buffers[i].length){
+                vectors.push_back(iovec{const_cast<char*>(buffers[i].data), buffers[i].length});
+            }
+        }
+        size_t first=0;
+        while(first<vectors.size()){
+            msghdr message{};
+            message.msg_iov=&vectors[first];
+            message.msg_iovlen=vectors.size()-first;
+#ifdef MSG_NOSIGNAL
+            auto res=long(::sendmsg(_fd, &message, MSG_NOSIGNAL));
+#else
+            auto res=long(::sendmsg(_fd, &message, 0));
+#endif
+            if(res>0){
+                auto sent=size_t(res);
+                while(first<vectors.size() && sent>=vectors[first].iov_len){
+                    sent-=vectors[first].iov_len;
+                    ++first;
+                }
+                if(first<vectors.size()){
+                    vectors[first].iov_base=(char*)vectors[first].iov_base+sent;
+                    vectors[first].iov_len-=sent;
+                }
+                continue;
+            }
+            if(res<0 && errno==EINTR){
+                continue;
+            }
+            if(res<0 && errno!=EAGAIN && errno!=EWOULDBLOCK){
+                return false;
+            }
+            if(wait(_fd, true, timeout)!=1){
+                return false;
+            }
+        }
+        return true;
+    }
+#endif
+
+    long receive(char *buffer,size_t length,timeval timeout) override{
+        auto n=wait(_fd, false, timeout);
+        if(n==0){
+            return -2;
+        }
+        if(n<0){
+            return -1;
+        }
+#ifdef _WIN32
+        return long(::recv(_fd, buffer, int(length), 0));
+#else
+        auto res=long(::recv(_fd, buffer, length, 0));
+        if(res<0 && (errno==EAGAIN || errno==EINTR)){
+            return this->receive(buffer, length, timeout);
+        }
+        if(res>0){
+            this->rearmQuickAck();
+        }
+        return res;
+#endif
+    }
+
+protected:
+    int _fd;
+};
+
+/**
+ *  Opens connections instead of the built-in sockets (plain, TLS, io_uring) when set with
+ *  `UrlRequest::transport`. Shared by requests from many threads. A transport may keep
+ *  connections alive: `takeIdle` is asked before `connect`, connections whose response
+ *  allowed keep-alive are handed back to `release`.
+ */
+class Transport{
+public:
+    struct HostIsNullException{};
+    
+    struct Endpoint{
+        std::string key;        //  `UrlRequest::connectionKey()`
+        std::string host;
+        int port;
+        std::string unixSocket;
+        TransportOptions options;
+        
+        /**
+         *  Called with a new socket before it connects (cancel token attaches here). False
+         *  closes it and fails the connection.
+         */
+        std::function<bool(int fd)> socketHandler;
+    };
+
+    virtual ~Transport(){}
+
+    /**
+     *  nullptr if connection failed. May throw `HostIsNullException`.
+     */
+    virtual std::unique_ptr<Connection> connect(const Endpoint &endpoint,timeval timeout)=0;
+
+    virtual std::unique_ptr<Connection> takeIdle(const Endpoint &endpoint){
+        (void)endpoint;
+        return nullptr;
+    }
+
+    virtual void release(const Endpoint &endpoint,std::unique_ptr<Connection> connection){
+        (void)endpoint;
+        (void)connection;
+    }
+};
+
+/**
+ *  Built-in transport: non-blocking BSD sockets over TCP or unix sockets. Requests without
+ *  a transport of their own open connections with a shared `SocketTransport` that keeps
+ *  nothing alive. Set one with `maxIdlePerEndpoint` to reuse keep-alive connections.
+ */
+class SocketTransport:public Transport{
+public:
+    union Address{
+        sockaddr_in inet;
+#ifndef _WIN32
+        sockaddr_un local;
+#endif
+    };
+    
+    /**
+     *  Idle connections kept per endpoint, connections released beyond that are closed.
+     */
+    size_t maxIdlePerEndpoint;
+    
+    SocketTransport(size_t maxIdlePerEndpoint=0):maxIdlePerEndpoint(maxIdlePerEndpoint){}
+    
+    std::unique_ptr<Connection> connect(const Endpoint &endpoint,timeval timeout) override{
+        return this->connect(endpoint, timeout, std::string(), nullptr);
+    }
+    
+    /**
+     *  Non-empty `earlyData` is sent in the SYN (TCP Fast Open), count of bytes sent goes
+     *  to `earlySent`.
+     */
+    std::unique_ptr<Connection> connect(const Endpoint &endpoint,timeval timeout,const std::string &earlyData,size_t *earlySent){
+        auto fd=connectSocket(endpoint, timeout, earlyData, earlySent);
+        if(fd<0){
+            return nullptr;
+        }
+        std::unique_ptr<Connection> connection(new SocketConnection(fd));
+        connection->quickAck=endpoint.options.quickAck;
+        return connection;
+    }
+    
+    std::unique_ptr<Connection> takeIdle(const Endpoint &endpoint) override{
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto it=_idle.find(endpoint.key);
+        while(it!=_idle.end() && !it->second.empty()){
+            auto res=std::move(it->second.back());
+            it->second.pop_back();
+            if(alive(res->fd())){
+                return res;
+            }
+        }
+        return nullptr;
+    }
+    
+    void release(const Endpoint &endpoint,std::unique_ptr<Connection> connection) override{
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto &idle=_idle[endpoint.key];
+        if(idle.size()<this->maxIdlePerEndpoint){
+            idle.push_back(std::move(connection));
+        }
+    }
+    
+    /**
+     *  Resolves endpoint and creates socket for it: options applied, non-blocking, passed to
+     *  `socketHandler`. Returns -1 if socket couldn't be created.
+     */
+    static int openSocket(const Endpoint &endpoint,Address &address,int &addressLength,bool &tcp) throw(HostIsNullException){
+        ::memset(&address, 0, sizeof(address));
+        addressLength=sizeof(address.inet);
+        tcp=true;
+        int fd;
+#ifndef _WIN32
+        if(endpoint.unixSocket.length()){
+            if(endpoint.unixSocket.length()>=sizeof(address.local.sun_path)){
+                std::cerr<<"unix socket path is too long *"<<endpoint.unixSocket<<"*"<<std::endl;
+                return -1;
+            }
+            address.local.sun_family=AF_UNIX;
+            ::memcpy(address.local.sun_path, endpoint.unixSocket.c_str(), endpoint.unixSocket.length());
+            addressLength=int(offsetof(sockaddr_un, sun_path)+endpoint.unixSocket.length()+1);
+            fd=::socket(AF_UNIX,SOCK_STREAM,0);
+            tcp=false;
+        }else
+#endif
+        {
+            //  getaddrinfo is reentrant, requests resolve from many threads at once..
+            addrinfo hints;
+            ::memset(&hints, 0, sizeof(hints));
+            hints.ai_family=AF_INET;
+            hints.ai_socktype=SOCK_STREAM;
+            hints.ai_protocol=IPPROTO_TCP;
+            addrinfo *addresses=nullptr;
+            if(::getaddrinfo(endpoint.host.c_str(), nullptr, &hints, &addresses)!=0 || !addresses){
+                throw HostIsNullException{};
+            }
+            ::memcpy(&address.inet, addresses->ai_addr, sizeof(address.inet));
+            ::freeaddrinfo(addresses);
+            address.inet.sin_port=htons(endpoint.port);
+            fd=::socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+        }
+        if(fd<0){
+            return -1;
+        }
+        if(endpoint.socketHandler && !endpoint.socketHandler(fd)){
+            closeSocket(fd);
+            return -1;
+        }
+        endpoint.options.apply(fd, tcp);
+        TransportOptions::setNonBlocking(fd);
+        return fd;
+    }
+    
+    /**
+     *  Opens socket and connects within `timeout`. Returns connected non-blocking socket
+     *  or -1 if connection failed or timed out.
+     */
+    static int connectSocket(const Endpoint &endpoint,timeval timeout,const std::string &earlyData=std::string(),size_t *earlySent=nullptr) throw(HostIsNullException){
+        Address address;
+        int addressLength;
+        auto tcp=true;
+        auto fd=openSocket(endpoint, address, addressLength, tcp);
+        if(fd<0){
+            return -1;
+        }
+        auto connectionTimeoutHappened=false;
+        int connected;
+#ifdef MSG_FASTOPEN
+        if(earlyData.length() && earlySent && tcp){
+            connected=fastOpenTimeout(fd, (sockaddr*)(&address), addressLength, &timeout, earlyData, *earlySent);
+        }else
+#endif
+        {
+            (void)earlyData;
+            (void)earlySent;
+            connected=connectTimeout(fd, (sockaddr*)(&address), addressLength, &timeout);
+        }
+        if(connected==1){
+            int so_error;
+#ifdef _WIN32
+            typedef int socklen_t;
+            typedef char *SockOpt_t;
+#else
+            typedef void *SockOpt_t;
+#endif
+            socklen_t len = sizeof so_error;
+            ::getsockopt(fd, SOL_SOCKET, SO_ERROR, (SockOpt_t)&so_error, &len);
+            if (so_error != 0) {
+                std::cerr<<"error = "<<so_error<<std::endl;
+                connectionTimeoutHappened=true;
+            }
+        }else{
+            connectionTimeoutHappened=true;
+        }
+        if(connectionTimeoutHappened){
+            closeSocket(fd);
+            return -1;
+        }
+        return fd;
+    }
+    
+    static int connectTimeout(int s,sockaddr *address,int addressSize,struct timeval *tv){
+        auto res=::connect(s,address,addressSize);
+#ifndef _WIN32
+        if(res<0 && errno!=EINPROGRESS){
+            //  failed right away (e.g. no listener at unix socket path)..
+            return -1;
+        }
+#else
+        (void)res;
+#endif
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(s, &fdset);
+        return ::select(s + 1, nullptr, &fdset, nullptr, tv);
+    }
+    
+#ifdef MSG_FASTOPEN
+    /**
+     *  Same as `connectTimeout` but connects with `data` in the SYN. `sent` is set to count of
+     *  bytes the kernel took (0 if it has no cookie for the server yet), the rest must be
+     *  sent after connection is established.
+     */
+    static int fastOpenTimeout(int s,sockaddr *address,int addressSize,struct timeval *tv,const std::string &data,size_t &sent){
+        sent=0;
+        auto res=::sendto(s, data.data(), data.length(), MSG_FASTOPEN|MSG_NOSIGNAL, address, socklen_t(addressSize));
+        if(res>=0){
+            sent=size_t(res);
+        }else if(errno==EOPNOTSUPP){
+            //  disabled in kernel..
+            return connectTimeout(s, address, addressSize, tv);
+        }else if(errno!=EINPROGRESS){
+            return -1;
+        }
+        fd_set fdset;
+        FD_ZERO(&fdset);
+        FD_SET(s, &fdset);
+        return ::select(s + 1, nullptr, &fdset, nullptr, tv);
+    }
+#endif
+    
+    static void closeSocket(int fd){
+#ifdef _WIN32
+        ::closesocket(fd);
+#else
+        ::close(fd);
+#endif
+    }
+
+protected:
+    std::mutex _mutex;
+    std::map<std::string,std::vector<std::unique_ptr<Connection>>> _idle;
+    
+    /**
+     *  False if peer closed idle connection (or sent something nobody asked for).
+     */
+    static bool alive(int fd){
+#ifdef _WIN32
+        (void)fd;
+        return true;
+#else
+        char c;
+        auto res=::recv(fd, &c, 1, MSG_PEEK|MSG_DONTWAIT);
+        return res<0 && (errno==EAGAIN || errno==EWOULDBLOCK);
+#endif
+    }
+};
@@ -0,0 +1,146 @@
+//
+//  TransportOptions.hpp
+//  embeddedRest
+//
+//  Socket level tuning applied to every connection a request opens. Options an OS
+//  doesn't support are silently skipped. Copy one instance into every request of a
+//  client to configure them alike.
+//
+
+#pragma once
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#endif
+
+struct TransportOptions{
+
+    /**
+     *  Disables Nagle's algorithm so a request written in several pieces (large body, TLS
+     *  records) isn't held back until the previous piece is acknowledged.
+     */
+    bool noDelay=true;
+
+    /**
+     *  SO_SNDBUF/SO_RCVBUF in bytes, 0 keeps system default (and autotuning). Set before
+     *  connect so the window scale is negotiated accordingly.
+     */
+    int sendBufferSize=0;
+    int receiveBufferSize=0;
+
+    /**
+     *  Linux TCP_QUICKACK: ACK received data immediately instead of delaying it. Kernel
+     *  resets it on its own so it is re-armed after every read.
+     */
+    bool quickAck=false;
+
+    /**
+     *  SO_KEEPALIVE with optional probe timing in seconds (0 - system default): idle time
+     *  before the first probe, interval between probes and count of unanswered probes
+     *  before the connection is dropped. Matters for long polls and pooled connections.
+     */
+    bool keepAlive=false;
+    int keepAliveIdle=0;
+    int keepAliveInterval=0;
+    int keepAliveCount=0;
+
+    /**
+     *  TCP Fast Open (Linux): request head goes out in the SYN with `sendto(MSG_FASTOPEN)`,
+     *  saving a round trip once the server handed out a cookie. Plain TCP only, server must
+     *  enable it too (`net.ipv4.tcp_fastopen`). Falls back to regular connect.
+     */
+    bool fastOpen=false;
+
+    /**
+     *  Linux io_uring backend (compiled in with `EMBEDDED_REST_IO_URING`): connect, send and
+     *  receive of plain connections go through a per-thread ring, connect + request + first
+     *  receive in one submission. Falls back to regular sockets if io_uring is unavailable.
+     *  Takes precedence over `fastOpen`.
+     */
+    bool ioUring=false;
+
+    /**
+     *  Applies options which must be set before connect. `tcp` is false for Unix domain
+     *  sockets - only buffer sizes apply then.
+     */
+    void apply(int fd,bool tcp) const{
+        if(this->sendBufferSize>0){
+            setOption(fd, SOL_SOCKET, SO_SNDBUF, this->sendBufferSize);
+        }
+        if(this->receiveBufferSize>0){
+            setOption(fd, SOL_SOCKET, SO_RCVBUF, this->receiveBufferSize);
+        }
+        if(!tcp){
+            return;
+        }
+        if(this->noDelay){
+            setOption(fd, IPPROTO_TCP, TCP_NODELAY, 1);
+        }
+#ifdef TCP_QUICKACK
+        if(this->quickAck){
+            setOption(fd, IPPROTO_TCP, TCP_QUICKACK, 1);
+        }
+#endif
+        if(this->keepAlive){
+            setOption(fd, SOL_SOCKET, SO_KEEPALIVE, 1);
+#if defined(TCP_KEEPIDLE)
+            if(this->keepAliveIdle>0){
+                setOption(fd, IPPROTO_TCP, TCP_KEEPIDLE, this->keepAliveIdle);
+            }
+#elif defined(TCP_KEEPALIVE)
+            if(this->keepAliveIdle>0){
+                setOption(fd, IPPROTO_TCP, TCP_KEEPALIVE, this->keepAliveIdle);
+            }
+#endif
+#ifdef TCP_KEEPINTVL
+            if(this->keepAliveInterval>0){
+                setOption(fd, IPPROTO_TCP, TCP_KEEPINTVL, this->keepAliveInterval);
+            }
+#endif
+#ifdef TCP_KEEPCNT
+            if(this->keepAliveCount>0){
+                setOption(fd, IPPROTO_TCP, TCP_KEEPCNT, this->keepAliveCount);
+            }
+#endif
+        }
+    }
+
+    /**
+     *  True if this build can send data in the SYN.
+     */
+    static bool fastOpenSupported(){
+#if defined(MSG_FASTOPEN)
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     *  Adds O_NONBLOCK keeping other file status flags.
+     */
+    static bool setNonBlocking(int fd){
+#ifdef _WIN32
+        unsigned long on=1;
+        return ::ioctlsocket(fd, FIONBIO, &on)==0;
+#else
+        auto flags=::fcntl(fd, F_GETFL, 0);
+        return flags>=0 && ::fcntl(fd, F_SETFL, flags|O_NONBLOCK)==0;
+#endif
+    }
+
+    static bool setOption(int fd,int level,int name,int value){
+#ifdef _WIN32
+        return ::setsockopt(fd, level, name, (const char*)&value, sizeof(value))==0;
+#else
+        return ::setsockopt(fd, level, name, &value, sizeof(value))==0;
+#endif
+    }
+};
@@ -14,6 +14,10 @@
 #include <tuple>
 #include <array>
 #include <sstream>
+#include <cstring>
+#include <cstddef>
+#include <cstdlib>
+#include <cstdio>
 
 #ifdef _WIN32
 
@@ -25,11 +29,14 @@
 
 #else
 
-#include <netdb.h>      //  gethostbyname,
+#include <netdb.h>      //  getaddrinfo,
 #include <arpa/inet.h>
+#include <sys/un.h>
 #include <sys/time.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <cerrno>
 
 #endif
 
@@ -37,8 +44,32 @@
 #include <fcntl.h>
 #include <functional>
 #include <fstream>
+#include <memory>
 #include "Response.hpp"
 #include "JsonValueAdapter.hpp"
+#include "JsonEncoder.hpp"
+#include "RequestCoalescer.hpp"
+#include "ResponseParser.hpp"
+#include "JsonArrayStream.hpp"
+#include "RetryPolicy.hpp"
+#include "Transport.hpp"
+#include "TransportOptions.hpp"
+#include "Metrics.hpp"
+#include "WireCapture.hpp"
+#include "StreamingBody.hpp"
+#ifdef EMBEDDED_REST_TLS
+#include "TlsContext.hpp"
+#endif
+#ifdef EMBEDDED_REST_IO_URING
+#include "IoUring.hpp"
+#endif
+#include <thread>
+#include <condition_variable>
+#include <system_error>
+#ifndef _WIN32
+#include "DiskCache.hpp"
+#include "Http2Client.hpp"
+#endif
 
 using std::cout;
 using std::endl;
@@ -88,11 +119,21 @@ int gettimeofday(struct timeval * tp, struct timezone * tzp)
 
 class UrlRequest{
 public:
-    struct HostIsNullException{};
+    typedef Transport::HostIsNullException HostIsNullException;
     struct HostEntry{
         std::string host;
     };
     struct timeval timeout;
+    
+    /**
+     *  Bodies larger than this are sent with `Expect: 100-continue`: only the head goes out
+     *  first and the body follows once server answers `100 Continue` (or is silent for
+     *  `continueTimeout`). A final status instead (401, 413, ..) means the body is never
+     *  sent. 0 disables it. Not used with HTTP/2 and streamed bodies.
+     */
+    size_t expectContinueThreshold=1024*1024;
+    struct timeval continueTimeout{1, 0};
+    
     struct GetParameter{
         
         template<class T>
@@ -225,133 +266,37 @@ protected:
     short _port=80;
     std::string _method="GET";
     std::string _body;
+    std::shared_ptr<StreamingBody> _bodyStream;
+    bool _bodySkipped=false;
+    bool _upgrading=false;
     std::vector<std::string> _headers;
+#ifndef _WIN32
+    std::string _unixSocket;
+    std::shared_ptr<DiskCache> _diskCache;
+    std::shared_ptr<Http2Client> _http2;
+    int _priority=0;
+#endif
+    std::shared_ptr<RequestCoalescer> _coalescer;
+    std::shared_ptr<RetryPolicy> _retryPolicy;
+    TransportOptions _transportOptions;
+    std::shared_ptr<MetricsRegistry> _metrics;
+    MetricsRegistry::Sample _sample;
+    std::chrono::steady_clock::time_point _exchangeStarted;
+    std::shared_ptr<WireCapture> _capture;
+    std::shared_ptr<Transport> _transport;
+    uint64_t _captureExchange=0;
+#ifdef EMBEDDED_REST_TLS
+    std::shared_ptr<TlsContext> _tls;
+#endif
+    std::shared_ptr<RetryPolicy::CancelToken> _cancelToken;
+    std::function<void()> _firstByteHandler;
+    RetryPolicy::Failure _failure=RetryPolicy::Failure::none;
     
     static const std::string& crlf(){
         static std::string res="\r\n";
         return res;
     }
     
-    struct MemoryBuffer{
-        char *buffer=nullptr;
-        int size=0;
-        
-        MemoryBuffer(decltype(buffer) buffer_,decltype(size) size_):
-        buffer(buffer_),
-        size(size_){}
-        
-        MemoryBuffer(const MemoryBuffer&)=delete;
-        MemoryBuffer& operator=(const MemoryBuffer&)=delete;
-        
-        MemoryBuffer(MemoryBuffer &&other){
-            this->swap(other);
-        }
-        
-        ~MemoryBuffer(){
-            if(this->buffer){
-                delete [] this->buffer;
-                this->buffer=nullptr;
-            }
-        }
-        
-        void swap(MemoryBuffer &other){
-            std::swap(this->buffer, other.buffer);
-            std::swap(this->size, other.size);
-        }
-        
-        char* begin(){
-            return this->buffer;
-        }
-        
-        const char* begin() const{
-            return this->buffer;
-        }
-        
-        char* end(){
-            return this->buffer+size;
-        }
-        
-        const char* end() const{
-            return this->buffer+size;
-        }
-    };
-    typedef std::vector<MemoryBuffer> MemoryBuffers;
-    
-    static int connectTimeout(int s,sockaddr *address,int addressSize,struct timeval *tv){
-        ::connect(s,address,addressSize);
-        fd_set fdset;
-        FD_ZERO(&fdset);
-        FD_SET(s, &fdset);
-        return ::select(s + 1, nullptr, &fdset, nullptr, tv);
-    }
-    
-    static int sendInLoop(int s,const char *buf,size_t len){
-        auto bytesToWrite=len;
-        size_t bytesWrote=0;
-        while(bytesWrote != bytesToWrite){
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(s, &fds);
-            
-            auto n = ::select(s+1, nullptr, &fds, nullptr, nullptr);
-            switch(n){
-                case 0:return -2;
-                default:return -1;
-                case 1:
-#ifdef _WIN32
-                    typedef const char *SendPointer_t;
-#else
-                    typedef const void *SendPointer_t;
-#endif
-                    auto bytesWroteThisTime = ::send(s, (SendPointer_t)(buf + bytesWrote), bytesToWrite, 0);
-                    //                    cout<<"bytesWroteThisTime = "<<bytesWroteThisTime<<endl;
-                    if(bytesWroteThisTime > 0){
-                        bytesWrote += bytesWroteThisTime;
-                        bytesToWrite -= bytesWroteThisTime;
-                        if(0==bytesToWrite){
-                            return 0;
-                        }
-                    }else{
-                        return -1;
-                    }
-                    break;
-            }
-        }
-        return 0;
-        /*bytesWrote=::send(fd, _body.c_str()+bytesWrote, bytesToWrite, 0);
-         while(bytesWrote!=bytesToWrite){
-         //                                    cout<<"wrote not whole body"<<endl;
-         bytesToWrite -= bytesWrote;
-         cout<<"bytesWrote "<<bytesWrote<<" instead of "<<bytesToWrite<<endl;
-         bytesWrote=::send(fd, _body.c_str()+bytesWrote, bytesToWrite, 0);
-         }*/
-    }
-    
-    static int recvtimeout(int s, char *buf, int len, struct timeval *tv, bool *receivedAll){
-        (void)receivedAll;
-        fd_set fds;
-        int n;
-        
-        // set up the file descriptor set
-        FD_ZERO(&fds);
-        FD_SET(s, &fds);
-        
-        // wait until timeout or data received
-        n = ::select(s+1, &fds, nullptr, nullptr, tv);
-        if (n == 0) return -2; // timeout!
-        if (n == -1) return -1; // error
-        
-        /*int bytesToRead;
-         ::ioctl(s,FIONREAD,&bytesToRead);
-         cout<<"bytesToRead = "<<bytesToRead<<endl;*/
-        
-        // data must be here, so do a normal recv()
-        auto res=int(::recv(s, buf, len, 0));
-        /*if(receivedAll){
-         *receivedAll = bytesToRead==res;
-         }*/
-        return res;
-    }
 public:
     UrlRequest(decltype(_method) method = "GET") :_method(method) {
         this->timeout.tv_sec = 30;
@@ -404,13 +349,40 @@ public:
      return *this;
      }*/
     
+    /**
+     *  Also accepts `unix:///run/agent.sock` and `unix:///run/agent.sock:/uri` (see `unixSocket`).
+     */
     UrlRequest& url(const std::string &value){
+#ifndef _WIN32
+        const std::string unixPrefix="unix://";
+        if(value.compare(0, unixPrefix.length(), unixPrefix)==0){
+            auto socketAndUri=value.substr(unixPrefix.length());
+            auto uriPos=socketAndUri.find(":/");
+            this->unixSocket(socketAndUri.substr(0, uriPos));
+            this->uri((uriPos==std::string::npos)?std::string("/"):socketAndUri.substr(uriPos+1));
+            return *this;
+        }
+#endif
         std::string prefix="://";
         auto prefixPos=value.find(prefix);
+#ifdef EMBEDDED_REST_TLS
+        if(value.compare(0, prefixPos, "https")==0 || value.compare(0, prefixPos, "wss")==0){
+            if(!_tls){
+                _tls=TlsContext::shared();
+            }
+            _port=443;
+        }
+#endif
         auto prefixEndPos=prefixPos+prefix.length();
         auto urlWithoutProtocol=value.substr(prefixEndPos,value.length()-prefixEndPos);
         auto firstSlashPos=urlWithoutProtocol.find('/');
-        this->host(urlWithoutProtocol.substr(0,firstSlashPos));
+        auto hostAndPort=urlWithoutProtocol.substr(0,firstSlashPos);
+        auto colonPos=hostAndPort.find(':');
+        if(colonPos!=std::string::npos){
+            _port=decltype(_port)(std::atoi(hostAndPort.c_str()+colonPos+1));
+            hostAndPort.resize(colonPos);
+        }
+        this->host(std::move(hostAndPort));
         this->uri(urlWithoutProtocol.substr(firstSlashPos,urlWithoutProtocol.length()-firstSlashPos));
         return *this;
     }
@@ -419,17 +391,142 @@ public:
         _port=value;
     }
     
+    const decltype(_host)& host() const{
+        return _host;
+    }
+    
+#ifdef EMBEDDED_REST_TLS
+    /**
+     *  Speaks TLS over the connection using `context` (sessions and idle connections are
+     *  kept in it so share one context between requests). Set `port` to 443 yourself or
+     *  use `https://` url. nullptr switches back to plain HTTP.
+     */
+    UrlRequest& tls(std::shared_ptr<TlsContext> context){
+        _tls=std::move(context);
+        return *this;
+    }
+    
+    const std::shared_ptr<TlsContext>& tls() const{
+        return _tls;
+    }
+#endif
+    
+#ifndef _WIN32
+    /**
+     *  Connects to the Unix domain socket at `path` instead of `host:port`. Host (if set)
+     *  is still sent in `Host:` header, `localhost` otherwise. Empty path switches back to TCP.
+     */
+    UrlRequest& unixSocket(std::string path){
+        _unixSocket=std::move(path);
+        return *this;
+    }
+    
+    const std::string& unixSocket() const{
+        return _unixSocket;
+    }
+    
+    /**
+     *  Sends the request as a stream of the HTTP/2 connection `client` keeps to the peer:
+     *  prior knowledge h2c for plain connections, h2 negotiated with ALPN for TLS. Requests
+     *  sharing one client (from any threads) are multiplexed over one connection.
+     *  `performToFile` still uses HTTP/1.1. nullptr switches back to HTTP/1.1.
+     */
+    UrlRequest& http2(std::shared_ptr<Http2Client> client){
+        _http2=std::move(client);
+        return *this;
+    }
+    
+    const std::shared_ptr<Http2Client>& http2() const{
+        return _http2;
+    }
+    
+    /**
+     *  HTTP/2 stream weight 1..256 (16 is the default of the protocol), 0 doesn't send priority.
+     */
+    UrlRequest& priority(int weight){
+        _priority=weight;
+        return *this;
+    }
+#endif
+    
+    const decltype(_uri)& uri() const{
+        return _uri;
+    }
+    
+    decltype(_port) port() const{
+        return _port;
+    }
+    
+    const decltype(_method)& method() const{
+        return _method;
+    }
+    
+    const decltype(_body)& body() const{
+        return _body;
+    }
+    
+    const decltype(_headers)& headers() const{
+        return _headers;
+    }
+    
     template<class Method>
     UrlRequest& method(Method method){
         _method=std::move(method);
         return *this;
     }
     
+    /**
+     *  Sends `value` as is, set `Content-Type` yourself.
+     */
+    UrlRequest& body(std::string value){
+        _body=std::move(value);
+        _bodyStream.reset();
+        return *this;
+    }
+    
     UrlRequest& bodyJson(JsonValueAdapter::Object_t jsonArguments){
         _body=JsonValueAdapter(std::move(jsonArguments)).toString();
         return *this;
     }
     
+    /**
+     *  Serializes `value` with `JsonEncoder` (struct with declared fields, container etc.).
+     */
+    template<class T>
+    UrlRequest& bodyJson(const T &value){
+        _body=JsonEncoder::encode(value);
+        return *this;
+    }
+    
+    /**
+     *  MessagePack encoding of `value` (anything `JsonValueAdapter` takes) with
+     *  `Content-Type: application/msgpack`. Decode responses with `BinaryDecoder`.
+     */
+    template<class T>
+    UrlRequest& bodyMsgpack(const T &value){
+        _body=JsonValueAdapter(value).toMsgpack();
+        _headers.emplace_back("Content-Type: application/msgpack");
+        return *this;
+    }
+    
+    UrlRequest& bodyMsgpack(JsonValueAdapter::Object_t object){
+        return this->bodyMsgpack(JsonValueAdapter(std::move(object)));
+    }
+    
+    /**
+     *  CBOR encoding of `value` with `Content-Type: application/cbor`.
+     */
+    template<class T>
+    UrlRequest& bodyCbor(const T &value){
+        _body=JsonValueAdapter(value).toCbor();
+        _headers.emplace_back("Content-Type: application/cbor");
+        return *this;
+    }
+    
+    UrlRequest& bodyCbor(JsonValueAdapter::Object_t object){
+        return this->bodyCbor(JsonValueAdapter(std::move(object)));
+    }
+    
     UrlRequest& bodyMultipart(std::function<void(MultipartAdapter&)> f){
         MultipartAdapter multipartAdapter;
         f(multipartAdapter);
@@ -439,263 +536,1392 @@ public:
         return *this;
     }
     
+    /**
+     *  Sends body produced piece by piece with `Transfer-Encoding: chunked` instead of
+     *  `_body`. The body can be sent once, so retries, hedging and stale keep-alive
+     *  connection retries are off for such requests. HTTP/2 collects it into memory.
+     */
+    UrlRequest& bodyStream(std::shared_ptr<StreamingBody> body){
+        _body.clear();
+        _bodyStream=std::move(body);
+        return *this;
+    }
+    
+    UrlRequest& bodyStream(StreamingBody::Producer producer){
+        return this->bodyStream(std::make_shared<StreamingBody>(std::move(producer)));
+    }
+    
+    /**
+     *  Streams records `next` fills one at a time as newline delimited JSON.
+     */
+    template<class T>
+    UrlRequest& bodyNdjson(std::function<bool(T&)> next){
+        _headers.emplace_back("Content-Type: application/x-ndjson");
+        return this->bodyStream(StreamingBody::ndjson<T>(std::move(next)));
+    }
+    
     template<class Header>
     UrlRequest& addHeader(Header header){
         _headers.emplace_back(std::move(header));
         return *this;
     }
     
-    Response perform() throw(HostIsNullException,Response::IncorrectStartLineException){
-        auto fd=::socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
-        struct hostent *host;
-        host = ::gethostbyname(_host.c_str());
-        if(host){
-#ifdef _WIN32
-            {
-                unsigned long on = 1;
-                ::ioctlsocket(fd, FIONBIO, &on);
-            }
-#else
-            ::fcntl(fd, F_SETFL, O_NONBLOCK);
-#endif
-            sockaddr_in sockAddr;
-            sockAddr.sin_port=htons(_port);
-            sockAddr.sin_family=AF_INET;
-            sockAddr.sin_addr.s_addr = decltype(sockAddr.sin_addr.s_addr)(*((unsigned long*)host->h_addr));
-            auto connectionTimeoutHappened=false;
-            if(connectTimeout(fd, (sockaddr*)(&sockAddr), sizeof(sockAddr), &this->timeout)==1){
-                int so_error;
-#ifdef _WIN32
-                typedef int socklen_t;
-                typedef char *SockOpt_t;
-#else
-                typedef void *SockOpt_t;
-#endif
-                socklen_t len = sizeof so_error;
-                ::getsockopt(fd, SOL_SOCKET, SO_ERROR, (SockOpt_t)&so_error, &len);
-                if (so_error == 0) {
-                    //                    std::cout<<"connected"<<std::endl;
-                }else{
-                    std::cerr<<"error = "<<so_error<<std::endl;
-                    connectionTimeoutHappened=true;
-                }
-            }else{
-                connectionTimeoutHappened=true;
-            }
-                    
-            MemoryBuffers buffers;
-            if(!connectionTimeoutHappened){
-                auto requestString=_method+" "+_uri+" HTTP/1.1"+crlf()+"Host: "+_host;
-                for(const auto &header:_headers){
-                    requestString+=crlf()+header;
-                }
-                if(_body.length()){
-                    std::stringstream ss;
-                    ss<<_body.length();
-                    const auto bodyLengthString=std::move(ss.str());
-                    ss.flush();
-                    requestString+=crlf()+"Content-Length: "+bodyLengthString;
-                }
-                requestString+=crlf()+crlf();
-                ssize_t bytesToWrite= (ssize_t)requestString.length();
-                ssize_t bytesWrote=::send(fd,requestString.c_str(), bytesToWrite,0);
-                if(bytesWrote==bytesToWrite){
-                    if(_body.length()){
-                        sendInLoop(fd, _body.c_str(), int(_body.length()));
-                    }
-                    char buffer[10000];
-                    do{
-                        bool receivedAll=false;
-                        auto bytesReceived=recvtimeout(fd, buffer, 10000, &this->timeout, &receivedAll);
-//                        cout<<"bytesReceived = "<<bytesReceived<<", receivedAll = "<<receivedAll<<endl;
-                        if(bytesReceived==0){
-                            break;
-                        }else if(bytesReceived==-2){
-                            return std::move(Response(408, std::string("Request Timeout"),std::string("{\"message\":\"Request Timeout\",\"status_code\":408}")));
-                        }else if(bytesReceived>0){
-                            auto newBuffer=new char[bytesReceived];
-                            ::memcpy((void*)newBuffer, (const void*)buffer, size_t(bytesReceived));
-                            buffers.emplace_back((char*)newBuffer,int(bytesReceived));
-                            /*if(receivedAll){
-                             break;
-                             }*/
-                        }
-                    }while(true);
-                }else{
-                    std::cerr<<"wrote not whole request"<<std::endl;
-                }
-            }
-#ifdef _WIN32
-            ::closesocket(fd);
-#else
-            close(fd);
+#ifndef _WIN32
+    /**
+     *  Enables persistent cache for GET requests. Fresh entries are served without
+     *  network round trip, stale ones are revalidated with `If-None-Match`/`If-Modified-Since`.
+     *  One `DiskCache` instance can be shared between requests and threads.
+     */
+    UrlRequest& diskCache(std::shared_ptr<DiskCache> value){
+        _diskCache=std::move(value);
+        return *this;
+    }
 #endif
-            
-            if(!connectionTimeoutHappened){
-                char prevByte=-1;
-                auto bufferIt=buffers.begin();
-                auto charIt=bufferIt->begin();
-                auto iterateResponseLambda=[&bufferIt,&charIt,&buffers,&prevByte](std::function<void(char,bool&)> f){
-                    auto stop=false;
-                    while (!stop) {
-                        // "while" instead of "if" in case of empty buffer
-                        while (charIt == bufferIt->end()) {
-                            if (bufferIt == buffers.end()) {
-                                // FIXME: shouldn't happen -- throw exception?
-                                return;
-                            }
-                            ++bufferIt;
-                        charIt=bufferIt->begin();
-                    }
-                        // cout<<"buffer index = "<<bufferIt-buffers.begin()<<endl;
-
-                        // at this point, charIt points to a valid char.
-                        // so we can pass it into the user function.
-                        // We increment charIt since the user function
-                        // consumed the character.
-
-                        auto c = *charIt;
-                        ++charIt;
-                        f(c, stop);
-                    }
-                };
-                
-                //  read start line..
-                std::string startLine;
-                prevByte = -1;
-                iterateResponseLambda([&prevByte,&startLine](char c,bool &stop){
-                    startLine+=c;
-                    if(c==10){
-                        if(prevByte==13){
-                            startLine=startLine.substr(0,startLine.length()-2);
-                            prevByte=c;
-                            stop=true;
-                        }
-                    }
-                    prevByte=c;
-                });
-                
-                //  read headers..
-                std::string line;
-                std::vector<std::string> headers;
-                do{
-                    prevByte = -1;
-                    iterateResponseLambda([&prevByte, &line](char c, bool &stop){
-                        line += c;
-                        if (c == 10){
-                            if (prevByte == 13){
-                                line = line.substr(0, line.length() - 2);
-                                prevByte = c;
-                                stop = true;
-                            }
-                        }
-                        prevByte = c;
-                    });
-                    if (line.length()){
-                        headers.emplace_back(std::move(line));
-                        line.clear();
-                    }
-                    else{
-                        break;
-                    }
-                } while (true);
-                
-                //  read body..
-                std::string body;
-                if (std::find(headers.begin(), headers.end(), "Transfer-Encoding: chunked") == headers.end()){
-                    std::stringstream bodyStream;
-                    for (; bufferIt != buffers.end();){
-                        bodyStream.write(&*charIt, bufferIt->end() - charIt);
-                        ++bufferIt;
-                        if (bufferIt == buffers.end())break;
-                        charIt = bufferIt->begin();
-                    }
-                    body = std::move(bodyStream.str());
-                    bodyStream.flush();
-                }
-                else{
-                    auto hexToInt = [](const std::string &s)->int{
-                        std::stringstream ss;
-                        ss << std::hex << s;
-                        int res;
-                        ss >> res;
-                        return res;
-                    };
-                    std::stringstream bodyStream;
-                    do{
-                        line.clear();
-                        prevByte = -1;
-                        iterateResponseLambda([&prevByte, &line](char c, bool &stop){
-                            line += c;
-                            if (c == 10){
-                                if (prevByte == 13){
-                                    line = line.substr(0, line.length() - 2);
-                                    prevByte = c;
-                                    stop = true;
-                                }
-                            }
-                            prevByte = c;
-                        });
-                        int chunkSize = hexToInt(line);
-                        if (!chunkSize){
-                            break;
-                        }
-                        
-                        for (; bufferIt != buffers.end();){
-                            auto bytesToRead = bufferIt->end() - charIt;
-                            if (bytesToRead>chunkSize){
-                                bytesToRead = chunkSize;
-                            }
-                            bodyStream.write(&*charIt, bytesToRead);
-                            charIt += bytesToRead;
-                            if (charIt == bufferIt->end()){
-                                ++bufferIt;
-                                charIt = bufferIt->begin();
-                            }
-                            chunkSize -= bytesToRead;
-                            if (!chunkSize){
-                                break;
-                            }
-                        }
-                        
-                        //  skip crlf..
-                        prevByte = -1;
-                        iterateResponseLambda([&prevByte, &line](char c, bool &stop){
-                            if (c == 10){
-                                if (prevByte == 13){
-                                    stop = true;
-                                }
-                            }
-                            prevByte = c;
-                        });
-                        if (charIt == bufferIt->end()){
-                            ++bufferIt;
-                            charIt = bufferIt->begin();
-                        }
-                    } while (true);
-                    body = std::move(bodyStream.str());
-                    bodyStream.flush();
-                    std::string chuckSuffix = crlf() + '0' + crlf() + crlf();
-                    if (body.length() >= chuckSuffix.length()){
-                        const std::string bodySuffix = std::move(body.substr(body.length() - chuckSuffix.length()));
-                        if (bodySuffix == chuckSuffix){
-                            body = std::move(body.substr(0, body.length() - chuckSuffix.length()));
-                        }
-                    }
-                }
-                return std::move(Response(startLine,
-                                          std::move(headers),
-                                          std::move(body)));
-            }else{
-                return std::move(Response(408,
-                                          std::string("Request Timeout"),
-                                          std::string("{\"message\":\"Request Timeout\",\"status_code\":408}")));
+    
+    /**
+     *  Peer the request connects to: `host:port`, `https://host:port` or `unix:path:`.
+     */
+    std::string connectionKey() const{
+        std::stringstream ss;
+#ifndef _WIN32
+        if(_unixSocket.length()){
+            ss<<"unix:"<<_unixSocket<<":";
+            return ss.str();
+        }
+#endif
+#ifdef EMBEDDED_REST_TLS
+        if(_tls){
+            ss<<"https://";
+        }
+#endif
+        ss<<_host<<":"<<_port;
+        return ss.str();
+    }
+    
+    /**
+     *  Method, peer, uri and content negotiation (`Accept*`) headers. Requests with
+     *  credentials are not cached at all and responses with `Vary` are not stored.
+     */
+    std::string cacheKey() const{
+        std::stringstream ss;
+        ss<<_method<<" "<<this->connectionKey()<<_uri;
+        for(const auto &header:_headers){
+            if(startsWithIgnoringCase(header, "Accept")){
+                ss<<crlf()<<header;
             }
-        }else{
-            throw HostIsNullException{};
         }
+        return std::move(ss.str());
     }
-            
+    
+    /**
+     *  True if a header named `name` (case insensitive) was added.
+     */
+    bool hasHeader(const std::string &name) const{
+        for(const auto &header:_headers){
+            if(header.length()>name.length() && header[name.length()]==':' && startsWithIgnoringCase(header, name)){
+                return true;
+            }
+        }
+        return false;
+    }
+    
+    static bool startsWithIgnoringCase(const std::string &value,const std::string &prefix){
+        return value.length()>=prefix.length() && std::equal(prefix.begin(), prefix.end(), value.begin(), [](char a,char b){
+            return std::tolower((unsigned char)a)==std::tolower((unsigned char)b);
+        });
+    }
+    
+    /**
+     *  Opt-in single-flight: while a GET/HEAD with the same key is in flight other
+     *  requests wait for it and get a copy of its response instead of hitting upstream.
+     */
+    UrlRequest& coalescer(std::shared_ptr<RequestCoalescer> value){
+        _coalescer=std::move(value);
+        return *this;
+    }
+    
+    /**
+     *  Default coalescing key: request line, port and headers in order of addition.
+     */
+    std::string coalescingKey() const{
+        auto res=this->cacheKey();
+        for(const auto &header:_headers){
+            res+=crlf()+header;
+        }
+        return res;
+    }
+    
+    /**
+     *  Retries (and hedged duplicates) for idempotent requests. Share one policy between
+     *  requests to get aggregated counters in `RetryPolicy::stats()`.
+     */
+    UrlRequest& retryPolicy(std::shared_ptr<RetryPolicy> value){
+        _retryPolicy=std::move(value);
+        return *this;
+    }
+    
+    /**
+     *  Cancelling `value` from another thread aborts the request in flight (its socket is
+     *  shut down). A cancelled token stays cancelled - use a new one per request.
+     */
+    UrlRequest& cancelToken(std::shared_ptr<RetryPolicy::CancelToken> value){
+        _cancelToken=std::move(value);
+        return *this;
+    }
+    
+    /**
+     *  Socket options for connections this request opens (pooled TLS connections keep the
+     *  options they were opened with).
+     */
+    UrlRequest& transportOptions(const TransportOptions &value){
+        _transportOptions=value;
+        return *this;
+    }
+    
+    const TransportOptions& transportOptions() const{
+        return _transportOptions;
+    }
+    
+    /**
+     *  Registry every exchange with the host is recorded to (keyed by `connectionKey()`):
+     *  each retry and hedge separately, cache hits and coalesced waiters not at all.
+     *  Share one registry among requests (and threads). `performToFile` isn't recorded.
+     */
+    UrlRequest& metrics(std::shared_ptr<MetricsRegistry> registry){
+        _metrics=std::move(registry);
+        return *this;
+    }
+    
+    const std::shared_ptr<MetricsRegistry>& metrics() const{
+        return _metrics;
+    }
+    
+    /**
+     *  Records bytes of exchanges to `capture`. HTTP/2 and `performToFile` traffic isn't
+     *  captured.
+     */
+    UrlRequest& capture(std::shared_ptr<WireCapture> value){
+        _capture=std::move(value);
+        return *this;
+    }
+    
+    const std::shared_ptr<WireCapture>& capture() const{
+        return _capture;
+    }
+    
+    /**
+     *  Opens connections through `value` instead of sockets - TLS, io_uring and fast open
+     *  settings don't apply then. HTTP/2 still uses sockets. nullptr switches back to sockets.
+     */
+    UrlRequest& transport(std::shared_ptr<Transport> value){
+        _transport=std::move(value);
+        return *this;
+    }
+    
+    const std::shared_ptr<Transport>& transport() const{
+        return _transport;
+    }
+    
+    /**
+     *  Why the last `perform` returned the synthetic 408, `none` if a response was received.
+     */
+    RetryPolicy::Failure failure() const{
+        return _failure;
+    }
+    
+    bool isSafe() const{
+        return _method=="GET" || _method=="HEAD";
+    }
+    
+    bool isIdempotent() const{
+        return this->isSafe() || _method=="PUT" || _method=="DELETE" || _method=="OPTIONS" || _method=="TRACE";
+    }
+    
+    Response perform() throw(HostIsNullException,Response::IncorrectStartLineException){
+        if(_coalescer && this->isSafe()){
+            return *this->performShared();
+        }
+        return this->performUncoalesced();
+    }
+    
+    /**
+     *  Performs request handing body to `bodyHandler` piece by piece as it comes off the socket
+     *  (chunked encoding already decoded) instead of keeping it in memory. `headersHandler` is
+     *  called before the first body byte and can reject the response by returning false.
+     *  Disk cache and coalescing are not used. Returned response has empty body.
+     */
+    Response performStreaming(ResponseParser::BodyHandler bodyHandler,
+                              ResponseParser::HeadersHandler headersHandler=ResponseParser::HeadersHandler())
+    {
+        return this->performNetwork({}, std::move(headersHandler), std::move(bodyHandler));
+    }
+    
+    /**
+     *  Sends the request with `Connection: Upgrade` and `extraHeaders` (`Upgrade` and the
+     *  headers the protocol needs). If the server switches protocols (101) the connection
+     *  is handed over in `connection` with bytes received past the response head in
+     *  `leftover`. Any other response is read to the end and returned, `connection` stays
+     *  empty then. Retries, caching and HTTP/2 are not used.
+     */
+    Response performUpgrade(const std::vector<std::string> &extraHeaders,std::unique_ptr<Connection> &connection,
+                            std::string &leftover)
+    {
+        connection.reset();
+        leftover.clear();
+        auto reused=false;
+        auto candidate=this->connect(reused);
+        if(!candidate){
+            return timeoutResponse();
+        }
+        auto headers=extraHeaders;
+        headers.push_back("Connection: Upgrade");
+        auto statusCode=0;
+        ResponseParser parser([&statusCode](const Response &head){
+            statusCode=head.statusCode();
+            return true;
+        });
+        _upgrading=true;
+        auto sent=this->sendRequest(*candidate, headers);
+        _upgrading=false;
+        auto received=sent && this->receiveResponse(*candidate, parser, &leftover);
+        if(_cancelToken){
+            _cancelToken->detach();
+        }
+        if(!received){
+            return timeoutResponse();
+        }
+        if(statusCode==101){
+            connection=std::move(candidate);
+            return parser.response();
+        }
+        if(leftover.length()){
+            parser.feed(leftover.data(), leftover.length());
+            leftover.clear();
+        }
+        if(!parser.done() && !this->receiveResponse(*candidate, parser)){
+            return timeoutResponse();
+        }
+        return parser.response();
+    }
+    
+    /**
+     *  Streams elements of a JSON array in response body (root array or the one found by
+     *  `path` of object keys) to `handler` decoded into `T` while the body is still being
+     *  received. Only one element is kept in memory at a time. Returning false from
+     *  `handler` aborts the transfer. A 200 doesn't mean every element arrived: check
+     *  `status` (`complete`) and `errorOffset` (offset in body) as with `JsonDecoder`.
+     */
+    template<class T>
+    Response performJsonArray(std::function<bool(T&)> handler,std::vector<std::string> path=std::vector<std::string>(),
+                              JsonArrayStream::Status *status=nullptr,size_t *errorOffset=nullptr)
+    {
+        auto stream=JsonArrayStream::decoding<T>(std::move(handler), std::move(path));
+        auto response=this->performStreaming([&stream](const char *data,size_t length){
+            return stream.feed(data, length);
+        });
+        if(status){
+            *status=stream.status();
+        }
+        if(errorOffset){
+            *errorOffset=stream.errorOffset();
+        }
+        return response;
+    }
+    
+#ifndef _WIN32
+    /**
+     *  Downloads body straight into file at `filepath` without keeping it in memory.
+     *  On Linux identity-encoded bodies are moved from socket to file with `splice`.
+     *  While download is incomplete the validator (ETag or Last-Modified) is kept in
+     *  `filepath + ".etag"`, next call resumes with `Range`/`If-Range` (206 is returned
+     *  then, or 200 if resource changed and was downloaded from scratch). Interrupted
+     *  transfer returns 408, the file is kept for resuming.
+     */
+    Response performToFile(const std::string &filepath) throw(HostIsNullException,Response::IncorrectStartLineException){
+        const auto validatorPath=filepath+".etag";
+        std::string validator;
+        {
+            std::ifstream validatorFile(validatorPath);
+            if(validatorFile){
+                std::getline(validatorFile, validator);
+            }
+        }
+        uint64_t existingSize=0;
+        struct stat fileStat;
+        if(validator.length() && ::stat(filepath.c_str(), &fileStat)==0){
+            existingSize=uint64_t(fileStat.st_size);
+        }
+        std::vector<std::string> extraHeaders;
+        if(existingSize){
+            extraHeaders.push_back("Range: bytes="+std::to_string(existingSize)+"-");
+            extraHeaders.push_back("If-Range: "+validator);
+        }
+        
+        auto reused=false;
+        auto connection=this->connect(reused);
+        if(!connection){
+            return timeoutResponse();
+        }
+        auto response=this->receiveToFile(*connection, filepath, extraHeaders, existingSize);
+        //  fd number may be reused once connection is closed..
+        if(_cancelToken){
+            _cancelToken->detach();
+        }
+        return response;
+    }
+#endif
+    
+    /**
+     *  Same as `perform` but hands out shared response so coalesced requests don't copy the body.
+     */
+    std::shared_ptr<const Response> performShared(){
+        if(_coalescer && this->isSafe()){
+            const auto &keyFunction=_coalescer->keyFunction();
+            auto key=keyFunction?keyFunction(*this):this->coalescingKey();
+            return _coalescer->perform(key, [this]{
+                return this->performUncoalesced();
+            });
+        }
+        return std::make_shared<const Response>(this->performUncoalesced());
+    }
+    
+protected:
+    
+    Response performUncoalesced(){
+#ifndef _WIN32
+        //  cache is shared, credentialed responses belong to one user only..
+        if(_diskCache && _method=="GET" && !this->hasHeader("Authorization") && !this->hasHeader("Cookie")){
+            return this->performCached();
+        }
+#endif
+        return this->performAttempts({});
+    }
+    
+#ifndef _WIN32
+    Response performCached(){
+        const auto key=this->cacheKey();
+        DiskCache::Entry entry;
+        std::shared_ptr<Response> cachedResponse;
+        std::vector<std::string> conditionalHeaders;
+        if(_diskCache->lookup(key, entry)){
+            if(entry.isFresh(DiskCache::now()) && _diskCache->makeResponse(entry, cachedResponse)){
+                return *cachedResponse;
+            }
+            if(entry.etag.length()){
+                conditionalHeaders.push_back("If-None-Match: "+entry.etag);
+            }
+            if(entry.lastModified.length()){
+                conditionalHeaders.push_back("If-Modified-Since: "+entry.lastModified);
+            }
+        }
+        auto response=this->performAttempts(conditionalHeaders);
+        if(response.statusCode()==304 && conditionalHeaders.size()){
+            if(_diskCache->makeResponse(entry, cachedResponse)){
+                _diskCache->revalidated(key, response);
+                return *cachedResponse;
+            }
+            //  body file vanished, fetch it unconditionally..
+            response=this->performAttempts({});
+        }
+        //  a 200 whose body was cut short by a dropped connection is not worth keeping..
+        if(_failure==RetryPolicy::Failure::none){
+            _diskCache->store(key, response);
+        }
+        return response;
+    }
+#endif
+    
+#ifndef _WIN32
+    Response receiveToFile(Connection &connection,const std::string &filepath,
+                           const std::vector<std::string> &extraHeaders,uint64_t existingSize)
+    {
+        const auto validatorPath=filepath+".etag";
+        auto fileFd=-1;
+        std::shared_ptr<Response> headersResponse;
+        ResponseParser parser([&headersResponse](const Response &response){
+            headersResponse=std::make_shared<Response>(response);
+            return true;
+        },[&fileFd](const char *data,size_t length){
+            return writeAll(fileFd, data, length);
+        });
+        parser.headRequest=(_method=="HEAD");
+        std::string leftover;
+        if(!this->sendRequest(connection, extraHeaders) || !this->receiveResponse(connection, parser, &leftover)){
+            return timeoutResponse();
+        }
+        if(!headersResponse){
+            return parser.response();
+        }
+        auto statusCode=headersResponse->statusCode();
+        auto contentRange=headersResponse->header("Content-Range");
+        if(statusCode==416 && existingSize && contentRange=="bytes */"+std::to_string(existingSize)){
+            //  previous call got everything but was interrupted before cleanup..
+            ::unlink(validatorPath.c_str());
+            return std::move(Response(200, std::string("OK"), std::string()));
+        }
+        auto resumed=(statusCode==206 && existingSize
+                      && contentRange.compare(0, 6, "bytes ")==0
+                      && ::strtoull(contentRange.c_str()+6, nullptr, 10)==existingSize);
+        if(statusCode!=200 && !resumed){
+            return *headersResponse;
+        }
+        if(resumed){
+            fileFd=::open(filepath.c_str(), O_WRONLY);
+            if(fileFd>=0 && ::lseek(fileFd, off_t(existingSize), SEEK_SET)<0){
+                ::close(fileFd);
+                fileFd=-1;
+            }
+        }else{
+            fileFd=::open(filepath.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+            auto newValidator=headersResponse->header("ETag");
+            if(newValidator.empty()){
+                newValidator=headersResponse->header("Last-Modified");
+            }
+            if(newValidator.length()){
+                std::ofstream validatorFile(validatorPath, std::ios::trunc);
+                validatorFile<<newValidator;
+            }else{
+                ::unlink(validatorPath.c_str());
+            }
+        }
+        if(fileFd<0){
+            std::cerr<<"failed to open file at *"<<filepath<<"*"<<std::endl;
+            return timeoutResponse();
+        }
+        
+        auto completed=true;
+        if(leftover.length()){
+            parser.feed(leftover.data(), leftover.length());
+        }
+        if(parser.done()){
+            completed=parser.complete();
+        }else if(parser.chunked() || !connection.plain()){
+            completed=this->receiveResponse(connection, parser) && parser.complete();
+        }else{
+            completed=this->copySocketToFile(connection.fd(), fileFd, parser.remainingBodyLength());
+        }
+        ::close(fileFd);
+        if(!completed){
+            return timeoutResponse();
+        }
+        ::unlink(validatorPath.c_str());
+        return *headersResponse;
+    }
+#endif
+    
+    Response performNetwork(const std::vector<std::string> &extraHeaders,
+                            ResponseParser::HeadersHandler headersHandler=ResponseParser::HeadersHandler(),
+                            ResponseParser::BodyHandler bodyHandler=ResponseParser::BodyHandler())
+    {
+        if(!_metrics && !_capture){
+            return this->performExchange(extraHeaders, std::move(headersHandler), std::move(bodyHandler));
+        }
+        _captureExchange=0;
+        _sample=MetricsRegistry::Sample();
+        _exchangeStarted=std::chrono::steady_clock::now();
+        auto response=this->performExchange(extraHeaders, std::move(headersHandler), std::move(bodyHandler));
+        if(_capture && _captureExchange){
+            _capture->end(_captureExchange, uint8_t(_failure), response.statusCode());
+            _captureExchange=0;
+        }
+        if(!_metrics){
+            return response;
+        }
+        _sample.total=this->elapsed();
+        switch(_failure){
+            case RetryPolicy::Failure::none:
+                _sample.statusCode=response.statusCode();
+                break;
+            case RetryPolicy::Failure::recvTimeout:
+                _sample.timedOut=true;
+                break;
+            case RetryPolicy::Failure::connectFailed:
+                _sample.connectFailed=true;
+                break;
+            case RetryPolicy::Failure::connectionClosed:
+                _sample.connectionClosed=true;
+                break;
+        }
+        _metrics->record(this->connectionKey(), _sample);
+        return response;
+    }
+    
+    std::chrono::microseconds elapsed() const{
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-_exchangeStarted);
+    }
+    
+    Response performExchange(const std::vector<std::string> &extraHeaders,
+                             ResponseParser::HeadersHandler headersHandler,
+                             ResponseParser::BodyHandler bodyHandler)
+    {
+        _failure=RetryPolicy::Failure::none;
+#ifndef _WIN32
+        if(_http2){
+            return this->performHttp2(extraHeaders, headersHandler, bodyHandler);
+        }
+#endif
+        std::unique_ptr<Connection> connection;
+        std::unique_ptr<ResponseParser> parser;
+        auto recvTimeoutHappened=false;
+        auto sent=false;
+        auto closedBeforeResponse=false;
+        while(true){
+            auto reused=false;
+            std::string earlyData;
+            size_t earlySent=0;
+            if(this->usesFastOpen() || this->usesIoUring()){
+                earlyData=this->firstWrite(extraHeaders);
+            }
+            auto connectStarted=_metrics?std::chrono::steady_clock::now():std::chrono::steady_clock::time_point();
+            connection=this->connect(reused, earlyData, &earlySent);
+            if(!connection){
+                _failure=RetryPolicy::Failure::connectFailed;
+                return timeoutResponse();
+            }
+            if(_capture){
+                _captureExchange=_capture->begin(this->connectionKey());
+            }
+            if(_metrics){
+                _sample.reusedConnection=reused;
+                _sample.newConnection=!reused;
+                if(!reused){
+                    _sample.connect=std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now()-connectStarted);
+                }
+            }
+            parser.reset(new ResponseParser(headersHandler, bodyHandler));
+            parser->headRequest=(_method=="HEAD");
+            sent=this->sendRequest(*connection, extraHeaders, earlySent, parser.get());
+            if(sent && !parser->done()){
+                recvTimeoutHappened=!this->receiveResponse(*connection, *parser);
+            }
+            closedBeforeResponse=reused && sent && !recvTimeoutHappened
+            && parser->state()==ResponseParser::State::failed && parser->startLine().empty();
+            //  a request written in full may have been processed before the server closed,
+            //  only idempotent ones are repeated then..
+            auto staleConnection=reused && !_bodyStream && (!sent || (closedBeforeResponse && this->isIdempotent()));
+            if(!staleConnection){
+                break;
+            }
+            //  idle connection was closed by server in the meantime, repeat on a new one..
+        }
+        if(_cancelToken){
+            _cancelToken->detach();
+        }
+        if(!sent || closedBeforeResponse){
+            _failure=RetryPolicy::Failure::connectionClosed;
+            return timeoutResponse();
+        }
+        if(recvTimeoutHappened){
+            _failure=RetryPolicy::Failure::recvTimeout;
+            return timeoutResponse();
+        }
+        if(!parser->complete() && parser->state()!=ResponseParser::State::aborted){
+            _failure=RetryPolicy::Failure::connectionClosed;
+        }
+        this->releaseConnection(std::move(connection), *parser);
+        return parser->response();
+    }
+    
+#ifndef _WIN32
+    Response performHttp2(const std::vector<std::string> &extraHeaders,
+                          const ResponseParser::HeadersHandler &headersHandler,
+                          const ResponseParser::BodyHandler &bodyHandler)
+    {
+        Http2Connection::Request request;
+        request.method=_method;
+        request.scheme="http";
+        auto defaultPort=80;
+#ifdef EMBEDDED_REST_TLS
+        if(_tls){
+            request.scheme="https";
+            defaultPort=443;
+        }
+#endif
+        request.authority=_host.length()?_host:std::string("localhost");
+        if(_port!=defaultPort && _unixSocket.empty()){
+            request.authority+=":"+std::to_string(_port);
+        }
+        request.path=_uri;
+        request.body=_body;
+        if(_bodyStream){
+            std::string chunk;
+            while(_bodyStream->next(chunk)){
+                request.body+=chunk;
+            }
+        }
+        request.timeout=this->timeout;
+        request.weight=_priority;
+        for(const auto &header:_headers){
+            request.addHeader(header);
+        }
+        for(const auto &header:extraHeaders){
+            request.addHeader(header);
+        }
+        ResponseParser::HeadersHandler onHeaders;
+        if(headersHandler || _firstByteHandler || _metrics){
+            onHeaders=[this,&headersHandler](const Response &response){
+                if(_firstByteHandler){
+                    _firstByteHandler();
+                }
+                if(_metrics){
+                    _sample.firstByte=this->elapsed();
+                }
+                return !headersHandler || headersHandler(response);
+            };
+        }
+        auto failure=Http2Connection::Failure::none;
+        std::shared_ptr<Response> response;
+        //  refused streams were never processed by server, one more try on a new connection..
+        for(auto attempt=0;attempt<2 && !response;++attempt){
+            auto connection=_http2->connection(this->connectionKey(), [this]{
+                return this->connectHttp2();
+            });
+            if(!connection){
+                _failure=RetryPolicy::Failure::connectFailed;
+                return timeoutResponse();
+            }
+            response=connection->perform(request, failure, onHeaders, bodyHandler, _cancelToken);
+            if(failure!=Http2Connection::Failure::refused){
+                break;
+            }
+        }
+        switch(failure){
+            case Http2Connection::Failure::none:
+                break;
+            case Http2Connection::Failure::timeout:
+                _failure=RetryPolicy::Failure::recvTimeout;
+                break;
+            default:
+                _failure=RetryPolicy::Failure::connectionClosed;
+                break;
+        }
+        if(!response){
+            return timeoutResponse();
+        }
+        //  payload only, frames and compressed headers aren't counted..
+        _sample.bytesSent=request.body.length();
+        _sample.bytesReceived=response->bodySize();
+        return *response;
+    }
+    
+    /**
+     *  New connection for `Http2Client`. Cancel token is not attached to the socket - it
+     *  carries other requests' streams too.
+     */
+    std::unique_ptr<Connection> connectHttp2(){
+        auto fd=this->openConnection();
+        if(_cancelToken){
+            _cancelToken->detach();
+        }
+        if(fd<0){
+            return nullptr;
+        }
+#ifdef EMBEDDED_REST_TLS
+        if(_tls){
+            auto connection=_tls->connect(fd, _host, this->connectionKey(), this->timeout, {"h2"});
+            if(connection && connection->alpnProtocol()!="h2"){
+                std::cerr<<"server *"<<_host<<"* didn't negotiate h2"<<std::endl;
+                return nullptr;
+            }
+            if(connection){
+                connection->quickAck=_transportOptions.quickAck;
+            }
+            return std::unique_ptr<Connection>(std::move(connection));
+        }
+#endif
+        std::unique_ptr<Connection> connection(new SocketConnection(fd));
+        connection->quickAck=_transportOptions.quickAck;
+        return connection;
+    }
+#endif
+    
+    /**
+     *  Returns idle keep-alive connection to the peer if there is one (`reused` is set to
+     *  true then) or opens a new one. nullptr if connection failed. `earlyData` is sent
+     *  while connecting with TCP Fast Open, `earlySent` receives count of bytes that went out.
+     */
+    std::unique_ptr<Connection> connect(bool &reused,const std::string &earlyData=std::string(),size_t *earlySent=nullptr){
+        reused=false;
+        if(_transport){
+            return this->connectTransport(reused);
+        }
+#ifdef EMBEDDED_REST_TLS
+        if(_tls){
+            const auto key=this->connectionKey();
+            if(_tls->keepAlive){
+                if(auto idle=_tls->takeIdle(key)){
+                    if(_cancelToken && !_cancelToken->attach(idle->fd())){
+                        return nullptr;
+                    }
+                    reused=true;
+                    return idle;
+                }
+            }
+            auto fd=this->openConnection();
+            if(fd<0){
+                return nullptr;
+            }
+            auto connection=_tls->connect(fd, _host, key, this->timeout);
+            if(!connection && _cancelToken){
+                _cancelToken->detach();
+            }
+            if(connection){
+                connection->quickAck=_transportOptions.quickAck;
+            }
+            return connection;
+        }
+#endif
+#ifdef EMBEDDED_REST_IO_URING
+        if(_transportOptions.ioUring){
+            if(auto ring=IoUring::threadLocal()){
+                return this->openUringConnection(*ring, earlyData, earlySent);
+            }
+        }
+#endif
+        auto connection=socketTransport().connect(this->endpoint(), this->timeout, earlyData, earlySent);
+        if(!connection && _cancelToken){
+            _cancelToken->detach();
+        }
+        return connection;
+    }
+    
+    /**
+     *  Transport of requests that don't set one: plain sockets, nothing kept alive.
+     */
+    static SocketTransport& socketTransport(){
+        static SocketTransport res;
+        return res;
+    }
+    
+    Transport::Endpoint endpoint() const{
+        Transport::Endpoint res;
+        res.key=this->connectionKey();
+        res.host=_host;
+        res.port=_port;
+#ifndef _WIN32
+        res.unixSocket=_unixSocket;
+#endif
+        res.options=_transportOptions;
+        if(auto cancelToken=_cancelToken){
+            res.socketHandler=[cancelToken](int fd){
+                return cancelToken->attach(fd);
+            };
+        }
+        return res;
+    }
+    
+    std::unique_ptr<Connection> connectTransport(bool &reused){
+        const auto endpoint=this->endpoint();
+        auto connection=_transport->takeIdle(endpoint);
+        reused=bool(connection);
+        if(!connection){
+            connection=_transport->connect(endpoint, this->timeout);
+        }
+        if(connection && connection->fd()>=0 && _cancelToken && !_cancelToken->attach(connection->fd())){
+            return nullptr;
+        }
+        return connection;
+    }
+    
+#ifdef EMBEDDED_REST_IO_URING
+    /**
+     *  Connects, sends `earlyData` and starts receiving with one submission to `ring`.
+     */
+    std::unique_ptr<Connection> openUringConnection(IoUring &ring,const std::string &earlyData,size_t *earlySent){
+        SocketTransport::Address address;
+        int addressLength;
+        auto tcp=true;
+        auto fd=SocketTransport::openSocket(this->endpoint(), address, addressLength, tcp);
+        if(fd<0){
+            return nullptr;
+        }
+        std::unique_ptr<UringConnection> connection(new UringConnection(ring, fd));
+        connection->quickAck=_transportOptions.quickAck;
+        auto connected=false;
+        if(!connection->open((sockaddr*)(&address), socklen_t(addressLength), earlyData, this->timeout, connected)){
+            if(!connected){
+                std::cerr<<"connect failed"<<std::endl;
+            }
+            if(_cancelToken){
+                _cancelToken->detach();
+            }
+            return nullptr;
+        }
+        if(earlySent){
+            *earlySent=connection->sent();
+        }
+        return std::unique_ptr<Connection>(std::move(connection));
+    }
+#endif
+    
+    /**
+     *  True if connections are opened through the thread's io_uring (plain sockets only).
+     */
+    bool usesIoUring() const{
+        if(_transport){
+            return false;
+        }
+#ifdef EMBEDDED_REST_IO_URING
+#ifdef EMBEDDED_REST_TLS
+        if(_tls){
+            return false;
+        }
+#endif
+        return _transportOptions.ioUring && IoUring::threadLocal();
+#else
+        return false;
+#endif
+    }
+    
+    bool usesFastOpen() const{
+        if(!_transportOptions.fastOpen || !TransportOptions::fastOpenSupported() || this->usesIoUring() || _transport){
+            return false;
+        }
+#ifndef _WIN32
+        if(_unixSocket.length()){
+            return false;
+        }
+#endif
+#ifdef EMBEDDED_REST_TLS
+        if(_tls){
+            return false;
+        }
+#endif
+        return true;
+    }
+    
+    /**
+     *  Keeps connection open for the next request if response allows it, closes otherwise.
+     */
+    void releaseConnection(std::unique_ptr<Connection> connection,const ResponseParser &parser){
+        if(_bodySkipped){
+            //  server may still be waiting for the body..
+            return;
+        }
+        if(_transport){
+            if(parser.keepAlive()){
+                _transport->release(this->endpoint(), std::move(connection));
+            }
+            return;
+        }
+#ifdef EMBEDDED_REST_TLS
+        if(_tls && _tls->keepAlive && parser.keepAlive()){
+            std::unique_ptr<TlsConnection> tlsConnection(static_cast<TlsConnection*>(connection.release()));
+            _tls->release(std::move(tlsConnection));
+        }
+#else
+        (void)connection;
+        (void)parser;
+#endif
+    }
+    
+    /**
+     *  Performs request applying retry policy (if any). Failures which the policy doesn't
+     *  retry and the last failed attempt are returned as is (synthetic 408 for timeouts).
+     */
+    Response performAttempts(const std::vector<std::string> &extraHeaders){
+        if(!_retryPolicy || (_retryPolicy->onlyIdempotent && !this->isIdempotent()) || _bodyStream){
+            return this->performNetwork(extraHeaders);
+        }
+        const auto maxAttempts=std::max(_retryPolicy->maxAttempts, 1);
+        for(auto attempt=0;;++attempt){
+            if(attempt){
+                _retryPolicy->countRetry();
+                std::this_thread::sleep_for(_retryPolicy->backoff(attempt));
+            }
+            _retryPolicy->countAttempt();
+            auto isLastAttempt=(attempt+1>=maxAttempts);
+            try{
+                auto response=(_retryPolicy->hedgeDelay.count()>0)
+                ?this->performHedged(extraHeaders)
+                :this->performNetwork(extraHeaders);
+                if(isLastAttempt || !_retryPolicy->shouldRetry(_failure, response.statusCode())){
+                    return response;
+                }
+                if(_cancelToken && _cancelToken->isCancelled()){
+                    return response;
+                }
+            }catch(const Response::IncorrectStartLineException&){
+                //  connection was closed before status line..
+                if(isLastAttempt || !_retryPolicy->shouldRetry(RetryPolicy::Failure::connectionClosed, 0)){
+                    throw;
+                }
+                if(_cancelToken && _cancelToken->isCancelled()){
+                    _failure=RetryPolicy::Failure::connectionClosed;
+                    return timeoutResponse();
+                }
+            }
+        }
+    }
+    
+    /**
+     *  Sends the request and, if no byte has arrived after `hedgeDelay`, a duplicate of it.
+     *  First complete response wins, the rest are cancelled. Sets `_failure` of the result.
+     */
+    Response performHedged(const std::vector<std::string> &extraHeaders){
+        struct Race{
+            std::mutex mutex;
+            std::condition_variable condition;
+            std::shared_ptr<Response> winner;
+            int winnerIndex=-1;
+            std::shared_ptr<Response> lastFailed;
+            RetryPolicy::Failure lastFailure=RetryPolicy::Failure::none;
+            std::exception_ptr exception;
+            std::vector<std::shared_ptr<RetryPolicy::CancelToken>> cancelTokens;
+            int launched=0;
+            int finished=0;
+            bool firstByte=false;
+            bool cancelled=false;
+            
+            void cancelAll(){
+                decltype(cancelTokens) tokens;
+                {
+                    std::lock_guard<std::mutex> lock(this->mutex);
+                    this->cancelled=true;
+                    tokens=this->cancelTokens;
+                }
+                for(auto &cancelToken:tokens){
+                    cancelToken->cancel();
+                }
+                this->condition.notify_all();
+            }
+        };
+        auto race=std::make_shared<Race>();
+        //  user's token cancels every copy in flight..
+        if(_cancelToken && !_cancelToken->attach([race]{
+            race->cancelAll();
+        })){
+            _failure=RetryPolicy::Failure::connectFailed;
+            return timeoutResponse();
+        }
+        //  false if no thread could be started for the copy..
+        auto launch=[this,&race,&extraHeaders]{
+            auto copy=std::make_shared<UrlRequest>(*this);
+            copy->_coalescer.reset();
+            copy->_retryPolicy.reset();
+            copy->_cancelToken=std::make_shared<RetryPolicy::CancelToken>();
+            race->cancelTokens.push_back(copy->_cancelToken);
+            copy->_firstByteHandler=[race]{
+                {
+                    std::lock_guard<std::mutex> lock(race->mutex);
+                    race->firstByte=true;
+                }
+                race->condition.notify_all();
+            };
+            auto index=race->launched;
+            auto run=[copy,race,extraHeaders,index]{
+                std::shared_ptr<Response> response;
+                std::exception_ptr exception;
+                try{
+                    response=std::make_shared<Response>(copy->performNetwork(extraHeaders));
+                }catch(...){
+                    exception=std::current_exception();
+                }
+                {
+                    std::lock_guard<std::mutex> lock(race->mutex);
+                    if(response && copy->_failure==RetryPolicy::Failure::none && !race->winner){
+                        race->winner=std::move(response);
+                        race->winnerIndex=index;
+                    }else if(response){
+                        race->lastFailed=std::move(response);
+                        race->lastFailure=copy->_failure;
+                    }else{
+                        race->exception=exception;
+                    }
+                    ++race->finished;
+                }
+                race->condition.notify_all();
+            };
+            try{
+                std::thread(std::move(run)).detach();
+            }catch(const std::system_error&){
+                race->cancelTokens.pop_back();
+                return false;
+            }
+            //  the copy can't finish before this - it needs the race lock held here..
+            ++race->launched;
+            return true;
+        };
+        
+        std::unique_lock<std::mutex> lock(race->mutex);
+        if(!launch()){
+            lock.unlock();
+            if(_cancelToken){
+                _cancelToken->detach();
+            }
+            return this->performNetwork(extraHeaders);
+        }
+        auto hedges=0;
+        while(!race->winner && race->finished<race->launched){
+            if(!race->firstByte && !race->cancelled && hedges<_retryPolicy->maxHedges){
+                auto hedgeTime=std::chrono::steady_clock::now()+_retryPolicy->hedgeDelay;
+                auto triggered=!race->condition.wait_until(lock, hedgeTime, [&race]{
+                    return race->winner || race->firstByte || race->cancelled || race->finished==race->launched;
+                });
+                if(triggered){
+                    if(launch()){
+                        ++hedges;
+                        _retryPolicy->countHedge();
+                    }else{
+                        //  out of threads, the copies already running go on..
+                        hedges=_retryPolicy->maxHedges;
+                    }
+                }
+            }else{
+                race->condition.wait(lock, [&race]{
+                    return race->winner || race->finished==race->launched;
+                });
+            }
+        }
+        lock.unlock();
+        //  before cancelling copies: user's token locks itself and then the race..
+        if(_cancelToken){
+            _cancelToken->detach();
+        }
+        race->cancelAll();
+        lock.lock();
+        if(race->winner){
+            if(race->winnerIndex>0){
+                _retryPolicy->countHedgeWin();
+            }
+            _failure=RetryPolicy::Failure::none;
+            return *race->winner;
+        }
+        if(race->lastFailed){
+            _failure=race->lastFailure;
+            return *race->lastFailed;
+        }
+        std::rethrow_exception(race->exception);
+    }
+    
+    static Response timeoutResponse(){
+        return std::move(Response(408,
+                                  std::string("Request Timeout"),
+                                  std::string("{\"message\":\"Request Timeout\",\"status_code\":408}")));
+    }
+    
+    /**
+     *  Connects a plain socket for TLS and HTTP/2 connections. Returns -1 if connection
+     *  failed or timed out.
+     */
+    int openConnection() throw(HostIsNullException){
+        auto fd=SocketTransport::connectSocket(this->endpoint(), this->timeout);
+        if(fd<0 && _cancelToken){
+            _cancelToken->detach();
+        }
+        return fd;
+    }
+    
+    static const size_t maxCoalescedBody=16*1024;
+    
+    bool expectsContinue() const{
+        return this->expectContinueThreshold && _body.length()>this->expectContinueThreshold && !_bodyStream;
+    }
+    
+    /**
+     *  Request head with body appended if it's small - one write (one TLS record, or the
+     *  SYN with fast open) for small requests.
+     */
+    std::string firstWrite(const std::vector<std::string> &extraHeaders) const{
+        auto res=this->requestHead(extraHeaders);
+        if(_body.length() && _body.length()<=maxCoalescedBody && !this->expectsContinue()){
+            res+=_body;
+        }
+        return res;
+    }
+    
+    /**
+     *  Sends the request except first `alreadySent` bytes of `firstWrite` (which went out
+     *  in the SYN).
+     */
+    bool sendRequest(Connection &connection,const std::vector<std::string> &extraHeaders,size_t alreadySent=0,
+                     ResponseParser *parser=nullptr)
+    {
+        _bodySkipped=false;
+        auto requestString=this->firstWrite(extraHeaders);
+        _sample.bytesSent+=requestString.length();
+        if(_capture && _captureExchange){
+            _capture->sent(_captureExchange, requestString.data(), requestString.length());
+        }
+        alreadySent=std::min(alreadySent, requestString.length());
+        const auto separateBody=(_body.length()>maxCoalescedBody || this->expectsContinue());
+        if(parser && this->expectsContinue()){
+            if(!connection.send(requestString.data()+alreadySent, requestString.length()-alreadySent, this->timeout)){
+                std::cerr<<"wrote not whole request"<<std::endl;
+                return false;
+            }
+            //  silence means the server doesn't know 100-continue, the body goes anyway..
+            if(this->receiveResponse(connection, *parser, nullptr, true) && !parser->continued()){
+                _bodySkipped=true;
+                return true;
+            }
+            requestString.clear();
+            alreadySent=0;
+        }
+        const Connection::Buffer buffers[]={
+            {requestString.data()+alreadySent, requestString.length()-alreadySent},
+            {_body.data(), separateBody?_body.length():0},
+        };
+        if(!connection.sendv(buffers, 2, this->timeout)){
+            std::cerr<<"wrote not whole request"<<std::endl;
+            return false;
+        }
+        if(separateBody){
+            _sample.bytesSent+=_body.length();
+            if(_capture && _captureExchange){
+                _capture->sent(_captureExchange, _body.data(), _body.length());
+            }
+        }
+        if(_bodyStream){
+            return this->sendBodyStream(connection);
+        }
+        return true;
+    }
+    
+    /**
+     *  Writes chunks of `_bodyStream` as they are produced, size line, data and CRLF
+     *  with one write each.
+     */
+    bool sendBodyStream(Connection &connection){
+        std::string chunk;
+        char sizeLine[24];
+        while(_bodyStream->next(chunk)){
+            auto sizeLength=size_t(std::snprintf(sizeLine, sizeof(sizeLine), "%zx\r\n", chunk.length()));
+            const Connection::Buffer buffers[]={
+                {sizeLine, sizeLength},
+                {chunk.data(), chunk.length()},
+                {crlf().data(), crlf().length()},
+            };
+            if(!connection.sendv(buffers, 3, this->timeout)){
+                std::cerr<<"wrote not whole request"<<std::endl;
+                _bodyStream->stop();
+                return false;
+            }
+            _sample.bytesSent+=sizeLength+chunk.length()+crlf().length();
+            if(_capture && _captureExchange){
+                const auto framed=std::string(sizeLine, sizeLength)+chunk+crlf();
+                _capture->sent(_captureExchange, framed.data(), framed.length());
+            }
+        }
+        if(_bodyStream->exception()){
+            std::cerr<<"body producer failed"<<std::endl;
+            return false;
+        }
+        static const std::string lastChunk="0\r\n\r\n";
+        _sample.bytesSent+=lastChunk.length();
+        if(_capture && _captureExchange){
+            _capture->sent(_captureExchange, lastChunk.data(), lastChunk.length());
+        }
+        if(!connection.send(lastChunk.data(), lastChunk.length(), this->timeout)){
+            std::cerr<<"wrote not whole request"<<std::endl;
+            return false;
+        }
+        return true;
+    }
+    
+    /**
+     *  Feeds received bytes into `parser` until it's done or peer closes connection.
+     *  If `leftover` is set stops right after headers and puts already received body
+     *  bytes into it. Returns false on timeout.
+     */
+    bool receiveResponse(Connection &connection,ResponseParser &parser,std::string *leftover=nullptr,bool untilContinue=false){
+        if(leftover){
+            parser.pauseAfterHeaders(true);
+        }
+        char buffer[10000];
+        auto firstByte=true;
+        do{
+            auto bytesReceived=connection.receive(buffer, sizeof(buffer), untilContinue?this->continueTimeout:this->timeout);
+            if(bytesReceived>0 && firstByte){
+                firstByte=false;
+                if(_firstByteHandler){
+                    _firstByteHandler();
+                }
+                if(_metrics && _sample.firstByte.count()<0){
+                    _sample.firstByte=this->elapsed();
+                }
+            }
+            if(bytesReceived>0){
+                _sample.bytesReceived+=uint64_t(bytesReceived);
+            }
+            if(_capture && _captureExchange && bytesReceived>=0){
+                _capture->received(_captureExchange, buffer, size_t(bytesReceived));
+            }
+            if(bytesReceived==0){
+                parser.finish();
+                break;
+            }else if(bytesReceived==-2){
+                return false;
+            }else if(bytesReceived>0){
+                auto consumed=parser.feed(buffer, size_t(bytesReceived));
+                if(leftover && parser.headersComplete()){
+                    leftover->assign(buffer+consumed, size_t(bytesReceived)-consumed);
+                    break;
+                }
+                if(parser.done() || (untilContinue && (parser.continued() || parser.headersComplete()))){
+                    break;
+                }
+            }else{
+                parser.finish();
+                break;
+            }
+        }while(true);
+        return true;
+    }
+    
+#ifndef _WIN32
+    static bool writeAll(int fd,const char *data,size_t length){
+        while(length){
+            auto res=::write(fd, data, length);
+            if(res<0){
+                if(errno==EINTR){
+                    continue;
+                }
+                return false;
+            }
+            data+=res;
+            length-=size_t(res);
+        }
+        return true;
+    }
+    
+    bool waitReadable(int fd){
+        fd_set fds;
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        auto tv=this->timeout;
+        return ::select(fd+1, &fds, nullptr, nullptr, &tv)==1;
+    }
+    
+    /**
+     *  Moves `length` bytes (everything until EOF if `length` is -1) from socket to file.
+     *  On Linux data goes socket -> pipe -> file with `splice` and never enters user space,
+     *  otherwise (or if file system refuses splice) a single reusable buffer is used.
+     *  Returns false on timeout, error or premature EOF.
+     */
+    bool copySocketToFile(int socketFd,int fileFd,int64_t length){
+        const size_t chunkSize=64*1024;
+        std::vector<char> buffer;
+#ifdef __linux__
+        int pipeFds[2];
+        if(::pipe(pipeFds)==0){
+            auto spliceFailed=false;
+            while(length!=0 && !spliceFailed){
+                if(!this->waitReadable(socketFd)){
+                    ::close(pipeFds[0]);
+                    ::close(pipeFds[1]);
+                    return false;
+                }
+                auto count=(length<0 || uint64_t(length)>chunkSize)?chunkSize:size_t(length);
+                auto received=::splice(socketFd, nullptr, pipeFds[1], nullptr, count, SPLICE_F_MOVE|SPLICE_F_MORE);
+                if(received<0){
+                    if(errno==EAGAIN || errno==EINTR){
+                        continue;
+                    }
+                    spliceFailed=(errno==EINVAL);
+                    if(!spliceFailed){
+                        break;
+                    }
+                    continue;
+                }
+                if(received==0){
+                    break;
+                }
+                auto inPipe=size_t(received);
+                while(inPipe){
+                    auto moved=::splice(pipeFds[0], nullptr, fileFd, nullptr, inPipe, SPLICE_F_MOVE);
+                    if(moved>0){
+                        inPipe-=size_t(moved);
+                        continue;
+                    }
+                    if(moved<0 && errno==EINTR){
+                        continue;
+                    }
+                    //  file side doesn't support splice, drain pipe through buffer..
+                    buffer.resize(chunkSize);
+                    while(inPipe){
+                        auto bytesRead=::read(pipeFds[0], buffer.data(), inPipe<chunkSize?inPipe:chunkSize);
+                        if(bytesRead<=0 || !writeAll(fileFd, buffer.data(), size_t(bytesRead))){
+                            ::close(pipeFds[0]);
+                            ::close(pipeFds[1]);
+                            return false;
+                        }
+                        inPipe-=size_t(bytesRead);
+                    }
+                    spliceFailed=true;
+                }
+                if(length>0){
+                    length-=received;
+                }
+            }
+            ::close(pipeFds[0]);
+            ::close(pipeFds[1]);
+            if(!spliceFailed){
+                return length<=0;
+            }
+        }
+#endif
+        buffer.resize(chunkSize);
+        while(length!=0){
+            if(!this->waitReadable(socketFd)){
+                return false;
+            }
+            auto count=(length<0 || uint64_t(length)>chunkSize)?chunkSize:size_t(length);
+            auto received=::recv(socketFd, buffer.data(), count, 0);
+            if(received<0){
+                if(errno==EAGAIN || errno==EINTR){
+                    continue;
+                }
+                return false;
+            }
+            if(received==0){
+                break;
+            }
+            if(!writeAll(fileFd, buffer.data(), size_t(received))){
+                return false;
+            }
+            if(length>0){
+                length-=received;
+            }
+        }
+        return length<=0;
+    }
+#endif
+    
+    std::string requestHead(const std::vector<std::string> &extraHeaders) const{
+        auto requestString=_method+" "+_uri+" HTTP/1.1"+crlf()+"Host: "+(_host.length()?_host:std::string("localhost"));
+        for(const auto &header:_headers){
+            //  transports may pool connections..
+            if((_transport || _upgrading) && header=="Connection: close"){
+                continue;
+            }
+#ifdef EMBEDDED_REST_TLS
+            if(_tls && _tls->keepAlive && header=="Connection: close"){
+                continue;
+            }
+#endif
+            requestString+=crlf()+header;
+        }
+        for(const auto &header:extraHeaders){
+            requestString+=crlf()+header;
+        }
+        if(this->expectsContinue()){
+            requestString+=crlf()+"Expect: 100-continue";
+        }
+        if(_bodyStream){
+            requestString+=crlf()+"Transfer-Encoding: chunked";
+        }else if(_body.length()){
+            std::stringstream ss;
+            ss<<_body.length();
+            const auto bodyLengthString=std::move(ss.str());
+            ss.flush();
+            requestString+=crlf()+"Content-Length: "+bodyLengthString;
+        }
+        requestString+=crlf()+crlf();
+        return requestString;
+    }
+            
+public:
     UrlRequest& operator+(const HostEntry &hostEntry){
         this->host(hostEntry.host);
         return *this;
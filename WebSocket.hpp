@@ -0,0 +1,762 @@
+//
+//  WebSocket.hpp
+//  embeddedRest
+//
+//  WebSocket client (RFC 6455). The opening handshake is an ordinary `UrlRequest`
+//  (host, port, TLS, unix sockets, custom headers and transports all apply) which hands
+//  its connection over once the server switches protocols. Outgoing payloads are masked
+//  with SIMD while being copied into the send buffer, incoming payloads are read straight
+//  into caller's buffers.
+//
+//      UrlRequest request;
+//      request.url("ws://127.0.0.1:9001/chat");
+//      auto socket=WebSocket::connect(request);
+//      socket->sendText("hello");
+//      std::string message;
+//      WebSocket::Opcode opcode;
+//      while(socket->receive(message, opcode)){
+//          ...
+//      }
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <atomic>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#include "UrlRequest.hpp"
+
+class WebSocket{
+public:
+    enum class Opcode:uint8_t{
+        continuation=0x0,
+        text=0x1,
+        binary=0x2,
+        close=0x8,
+        ping=0x9,
+        pong=0xa,
+    };
+
+    struct FrameHeader{
+        bool fin=true;
+        Opcode opcode=Opcode::binary;
+        bool masked=false;
+        uint8_t mask[4]={0, 0, 0, 0};
+        uint64_t length=0;
+    };
+
+    /**
+     *  Longest frame header: 2 bytes, 8 bytes of extended length and the mask.
+     */
+    static constexpr size_t maxHeaderLength=14;
+
+    /**
+     *  Applies to every wait for the peer. Set from the request's `timeout` by `connect`.
+     */
+    timeval timeout{30, 0};
+
+    /**
+     *  Messages longer than this are sent as several fragments, 0 - never fragmented.
+     */
+    size_t fragmentSize=0;
+
+    /**
+     *  `receive` into `std::string` fails with 1009 (message too big) past this length.
+     */
+    size_t maxMessageSize=64*1024*1024;
+
+    /**
+     *  Performs the opening handshake with `request` (`ws://` and `wss://` urls are
+     *  accepted by `UrlRequest::url`). Returns nullptr if the server didn't switch
+     *  protocols or answered with a wrong `Sec-WebSocket-Accept`, the response is put
+     *  into `response` if it's set.
+     */
+    static std::unique_ptr<WebSocket> connect(UrlRequest request,Response *response=nullptr,
+                                              const std::vector<std::string> &protocols=std::vector<std::string>())
+    {
+        std::string nonce(16, '\0');
+        for(auto &c:nonce){
+            c=char(randomEngine()()&0xff);
+        }
+        const auto key=base64(nonce);
+        std::vector<std::string> headers={
+            "Upgrade: websocket",
+            "Sec-WebSocket-Key: "+key,
+            "Sec-WebSocket-Version: 13",
+        };
+        if(protocols.size()){
+            std::string value;
+            for(const auto &protocol:protocols){
+                value+=(value.empty()?"":", ")+protocol;
+            }
+            headers.push_back("Sec-WebSocket-Protocol: "+value);
+        }
+        std::unique_ptr<Connection> connection;
+        std::string leftover;
+        auto handshakeResponse=request.method("GET").performUpgrade(headers, connection, leftover);
+        if(response){
+            *response=handshakeResponse;
+        }
+        if(!connection){
+            return nullptr;
+        }
+        auto upgrade=handshakeResponse.header("Upgrade");
+        std::transform(upgrade.begin(), upgrade.end(), upgrade.begin(), ::tolower);
+        if(upgrade!="websocket" || handshakeResponse.header("Sec-WebSocket-Accept")!=acceptKey(key)){
+            std::cerr<<"websocket handshake failed"<<std::endl;
+            return nullptr;
+        }
+        std::unique_ptr<WebSocket> res(new WebSocket(std::move(connection), std::move(leftover)));
+        res->timeout=request.timeout;
+        res->_protocol=handshakeResponse.header("Sec-WebSocket-Protocol");
+        return res;
+    }
+
+    /**
+     *  Takes over a connection already switched to WebSocket. `leftover` - bytes received
+     *  past the handshake response.
+     */
+    WebSocket(std::unique_ptr<Connection> connection,std::string leftover=std::string()):
+    _connection(std::move(connection)),
+    _maskEngine(std::random_device{}()),
+    _in(std::max(leftover.length(), size_t(receiveBufferSize))),
+    _inEnd(leftover.length())
+    {
+        ::memcpy(_in.data(), leftover.data(), leftover.length());
+    }
+
+    WebSocket(const WebSocket&)=delete;
+    WebSocket& operator=(const WebSocket&)=delete;
+
+    /**
+     *  Sends close (1001, going away) if the closing handshake wasn't started, doesn't wait
+     *  for the answer.
+     */
+    ~WebSocket(){
+        if(_connection && !_closeSent && !_closeReceived){
+            this->sendClose(1001, std::string());
+        }
+    }
+
+    /**
+     *  Subprotocol the server picked from the ones passed to `connect`, empty if none.
+     */
+    const std::string& protocol() const{
+        return _protocol;
+    }
+
+    bool sendText(const std::string &message){
+        return this->send(Opcode::text, message.data(), message.length());
+    }
+
+    bool sendBinary(const char *data,size_t length){
+        return this->send(Opcode::binary, data, length);
+    }
+
+    /**
+     *  Sends a whole message (split by `fragmentSize` if it's set). Can be called from
+     *  any thread while another one is receiving.
+     */
+    bool send(Opcode opcode,const char *data,size_t length){
+        if(!this->fragmentSize || length<=this->fragmentSize){
+            return this->sendFrame(opcode, data, length, true);
+        }
+        for(size_t offset=0;offset<length;offset+=this->fragmentSize){
+            auto count=std::min(this->fragmentSize, length-offset);
+            if(!this->sendFrame(offset?Opcode::continuation:opcode, data+offset, count, offset+count==length)){
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /**
+     *  Sends one frame. Fragmented messages are the first frame with `text` or `binary`
+     *  and `fin` false followed by `continuation` frames, the last one with `fin`.
+     */
+    bool sendFrame(Opcode opcode,const char *data,size_t length,bool fin){
+        std::lock_guard<std::mutex> lock(_sendMutex);
+        if(!_connection || _closeSent){
+            return false;
+        }
+        FrameHeader header;
+        header.fin=fin;
+        header.opcode=opcode;
+        header.masked=true;
+        header.length=length;
+        const auto maskWord=uint32_t(_maskEngine());
+        ::memcpy(header.mask, &maskWord, 4);
+        char head[maxHeaderLength];
+        auto headLength=encodeHeader(header, head);
+        size_t offset=0;
+        do{
+            auto count=std::min(length-offset, size_t(sendChunkSize));
+            _out.resize(count);
+            applyMask(_out.data(), data+offset, count, header.mask, offset);
+            const Connection::Buffer buffers[]={
+                {head, offset?0:headLength},
+                {_out.data(), count},
+            };
+            if(!_connection->sendv(buffers, 2, this->timeout)){
+                std::cerr<<"wrote not whole frame"<<std::endl;
+                return false;
+            }
+            offset+=count;
+        }while(offset<length);
+        ++_framesSent;
+        if(opcode==Opcode::close){
+            _closeSent=true;
+        }
+        return true;
+    }
+
+    /**
+     *  Payload (up to 125 bytes) is echoed in the pong, see `pongs`.
+     */
+    bool ping(const std::string &payload=std::string()){
+        return this->sendFrame(Opcode::ping, payload.data(), std::min(payload.length(), size_t(125)), true);
+    }
+
+    /**
+     *  Receives next piece of a message straight into `buffer`: as much of the message as
+     *  fits, `final` is set on its last piece. Returns count of bytes written (0 for an empty
+     *  message), -1 if connection is closed (see `closeCode`) and -2 on timeout. Pings are
+     *  answered and the closing handshake is completed while waiting.
+     */
+    long receive(char *buffer,size_t capacity,Opcode &opcode,bool &final){
+        auto pending=this->awaitPayload(opcode, final);
+        if(pending<=0){
+            return pending;
+        }
+        opcode=_messageOpcode;
+        auto count=size_t(std::min(uint64_t(capacity), _frameRemaining));
+        size_t received=std::min(count, _inEnd-_inStart);
+        ::memcpy(buffer, _in.data()+_inStart, received);
+        _inStart+=received;
+        while(received<count){
+            auto bytesReceived=_connection->receive(buffer+received, count-received, this->timeout);
+            if(bytesReceived<=0){
+                if(received){
+                    break;
+                }
+                return this->onReceiveFailed(bytesReceived);
+            }
+            received+=size_t(bytesReceived);
+        }
+        _bytesReceived+=received;
+        _frameRemaining-=received;
+        final=_frameFin && !_frameRemaining;
+        if(!_frameRemaining){
+            _inFrame=false;
+            _inMessage=!_frameFin;
+        }
+        return long(received);
+    }
+
+    /**
+     *  Receives a whole message (fragments joined) into `message`. Returns false if the
+     *  connection is closed or on timeout. Part of a message received before a timeout is
+     *  kept and the next call continues it.
+     */
+    bool receive(std::string &message,Opcode &opcode){
+        message=std::move(_partialMessage);
+        _partialMessage.clear();
+        auto final=false;
+        while(!final){
+            auto pending=this->awaitPayload(opcode, final);
+            if(pending<0){
+                this->keepPartialMessage(message, pending);
+                return false;
+            }
+            if(!pending){
+                break;
+            }
+            if(message.length()+_frameRemaining>this->maxMessageSize){
+                this->fail(1009, "websocket message too big");
+                message.clear();
+                return false;
+            }
+            auto offset=message.length();
+            message.resize(offset+size_t(_frameRemaining));
+            auto res=this->receive(&message[offset], message.length()-offset, opcode, final);
+            if(res<0){
+                message.resize(offset);
+                this->keepPartialMessage(message, res);
+                return false;
+            }
+            message.resize(offset+size_t(res));
+        }
+        return true;
+    }
+
+    /**
+     *  Starts the closing handshake and waits (up to `timeout` per read) for the server to
+     *  answer it, messages received meanwhile are dropped. Returns true if it answered.
+     */
+    bool close(uint16_t code=1000,const std::string &reason=std::string()){
+        if(!_closeSent && !this->sendClose(code, reason)){
+            return false;
+        }
+        char buffer[4096];
+        Opcode opcode;
+        auto final=false;
+        while(!_closeReceived && _connection){
+            if(this->receive(buffer, sizeof(buffer), opcode, final)<0){
+                break;
+            }
+        }
+        std::lock_guard<std::mutex> lock(_sendMutex);
+        _connection.reset();
+        return _closeReceived;
+    }
+
+    /**
+     *  Close code the server sent (1005 if it sent none), 1006 if connection was lost
+     *  without the closing handshake, 0 while open.
+     */
+    uint16_t closeCode() const{
+        return _closeCode;
+    }
+
+    const std::string& closeReason() const{
+        return _closeReason;
+    }
+
+    uint64_t pongs() const{
+        return _pongs.load();
+    }
+
+    uint64_t framesSent() const{
+        return _framesSent.load();
+    }
+
+    uint64_t bytesReceived() const{
+        return _bytesReceived;
+    }
+
+    /**
+     *  Writes `header` into `destination` (at least `maxHeaderLength` bytes), returns its
+     *  length.
+     */
+    static size_t encodeHeader(const FrameHeader &header,char *destination){
+        auto p=reinterpret_cast<uint8_t*>(destination);
+        p[0]=uint8_t((header.fin?0x80:0)|uint8_t(header.opcode));
+        const uint8_t maskBit=header.masked?0x80:0;
+        size_t res=2;
+        if(header.length<126){
+            p[1]=uint8_t(maskBit|header.length);
+        }else if(header.length<=0xffff){
+            p[1]=maskBit|126;
+            p[2]=uint8_t(header.length>>8);
+            p[3]=uint8_t(header.length);
+            res=4;
+        }else{
+            p[1]=maskBit|127;
+            for(auto i=0;i<8;++i){
+                p[2+i]=uint8_t(header.length>>(56-8*i));
+            }
+            res=10;
+        }
+        if(header.masked){
+            ::memcpy(p+res, header.mask, 4);
+            res+=4;
+        }
+        return res;
+    }
+
+    /**
+     *  Parses frame header at the start of `data`. Returns its length, 0 if it isn't
+     *  complete yet.
+     */
+    static size_t decodeHeader(const char *data,size_t length,FrameHeader &header){
+        auto p=reinterpret_cast<const uint8_t*>(data);
+        if(length<2){
+            return 0;
+        }
+        header.fin=(p[0]&0x80)!=0;
+        header.opcode=Opcode(p[0]&0x0f);
+        header.masked=(p[1]&0x80)!=0;
+        size_t res=2;
+        uint64_t payloadLength=p[1]&0x7f;
+        if(payloadLength==126){
+            res=4;
+            if(length<res){
+                return 0;
+            }
+            payloadLength=(uint64_t(p[2])<<8)|p[3];
+        }else if(payloadLength==127){
+            res=10;
+            if(length<res){
+                return 0;
+            }
+            payloadLength=0;
+            for(auto i=0;i<8;++i){
+                payloadLength=(payloadLength<<8)|p[2+i];
+            }
+        }
+        header.length=payloadLength;
+        if(header.masked){
+            if(length<res+4){
+                return 0;
+            }
+            ::memcpy(header.mask, p+res, 4);
+            res+=4;
+        }
+        return res;
+    }
+
+    /**
+     *  XORs `length` bytes of `source` with `mask` into `destination` (may be the same
+     *  buffer). `offset` - position of `source` in the payload, so a payload can be masked
+     *  in pieces. 32 (AVX2), 16 (SSE2, NEON) or 8 bytes at a time.
+     */
+    static void applyMask(char *destination,const char *source,size_t length,const uint8_t mask[4],size_t offset=0){
+        uint8_t rotated[4];
+        for(auto i=0;i<4;++i){
+            rotated[i]=mask[(size_t(i)+offset)&3];
+        }
+        uint32_t word;
+        ::memcpy(&word, rotated, 4);
+        size_t i=0;
+#if defined(__AVX2__)
+        const auto wide=_mm256_set1_epi32(int(word));
+        for(;i+32<=length;i+=32){
+            auto block=_mm256_loadu_si256(reinterpret_cast<const __m256i*>(source+i));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(destination+i), _mm256_xor_si256(block, wide));
+        }
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+        const auto vector=_mm_set1_epi32(int(word));
+        for(;i+16<=length;i+=16){
+            auto block=_mm_loadu_si128(reinterpret_cast<const __m128i*>(source+i));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(destination+i), _mm_xor_si128(block, vector));
+        }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+        const auto vector=vreinterpretq_u8_u32(vdupq_n_u32(word));
+        for(;i+16<=length;i+=16){
+            auto block=vld1q_u8(reinterpret_cast<const uint8_t*>(source+i));
+            vst1q_u8(reinterpret_cast<uint8_t*>(destination+i), veorq_u8(block, vector));
+        }
+#endif
+        const auto doubleWord=(uint64_t(word)<<32)|word;
+        for(;i+8<=length;i+=8){
+            uint64_t block;
+            ::memcpy(&block, source+i, 8);
+            block^=doubleWord;
+            ::memcpy(destination+i, &block, 8);
+        }
+        for(;i<length;++i){
+            destination[i]=char(source[i]^rotated[i&3]);
+        }
+    }
+
+    /**
+     *  `Sec-WebSocket-Accept` the server must answer `key` with.
+     */
+    static std::string acceptKey(const std::string &key){
+        return base64(sha1(key+"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"));
+    }
+
+    /**
+     *  Raw 20 byte digest.
+     */
+    static std::string sha1(const std::string &data){
+        uint32_t h[5]={0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+        auto message=data;
+        message+='\x80';
+        while(message.length()%64!=56){
+            message+='\0';
+        }
+        const auto bits=uint64_t(data.length())*8;
+        for(auto i=7;i>=0;--i){
+            message+=char((bits>>(8*i))&0xff);
+        }
+        auto rotate=[](uint32_t value,int count){
+            return (value<<count)|(value>>(32-count));
+        };
+        for(size_t block=0;block<message.length();block+=64){
+            uint32_t w[80];
+            for(auto i=0;i<16;++i){
+                auto p=reinterpret_cast<const uint8_t*>(message.data()+block+4*i);
+                w[i]=(uint32_t(p[0])<<24)|(uint32_t(p[1])<<16)|(uint32_t(p[2])<<8)|p[3];
+            }
+            for(auto i=16;i<80;++i){
+                w[i]=rotate(w[i-3]^w[i-8]^w[i-14]^w[i-16], 1);
+            }
+            auto a=h[0], b=h[1], c=h[2], d=h[3], e=h[4];
+            for(auto i=0;i<80;++i){
+                uint32_t f, k;
+                if(i<20){
+                    f=(b&c)|(~b&d);
+                    k=0x5a827999;
+                }else if(i<40){
+                    f=b^c^d;
+                    k=0x6ed9eba1;
+                }else if(i<60){
+                    f=(b&c)|(b&d)|(c&d);
+                    k=0x8f1bbcdc;
+                }else{
+                    f=b^c^d;
+                    k=0xca62c1d6;
+                }
+                auto temp=rotate(a, 5)+f+e+k+w[i];
+                e=d;
+                d=c;
+                c=rotate(b, 30);
+                b=a;
+                a=temp;
+            }
+            h[0]+=a;
+            h[1]+=b;
+            h[2]+=c;
+            h[3]+=d;
+            h[4]+=e;
+        }
+        std::string res(20, '\0');
+        for(auto i=0;i<20;++i){
+            res[size_t(i)]=char((h[i/4]>>(24-8*(i%4)))&0xff);
+        }
+        return res;
+    }
+
+    static std::string base64(const std::string &data){
+        static const char alphabet[]="ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string res;
+        res.reserve((data.length()+2)/3*4);
+        for(size_t i=0;i<data.length();i+=3){
+            uint32_t group=uint32_t(uint8_t(data[i]))<<16;
+            if(i+1<data.length()){
+                group|=uint32_t(uint8_t(data[i+1]))<<8;
+            }
+            if(i+2<data.length()){
+                group|=uint8_t(data[i+2]);
+            }
+            res+=alphabet[(group>>18)&0x3f];
+            res+=alphabet[(group>>12)&0x3f];
+            res+=(i+1<data.length())?alphabet[(group>>6)&0x3f]:'=';
+            res+=(i+2<data.length())?alphabet[group&0x3f]:'=';
+        }
+        return res;
+    }
+
+protected:
+    static constexpr size_t receiveBufferSize=64*1024;
+    static constexpr size_t sendChunkSize=64*1024;
+
+    std::unique_ptr<Connection> _connection;
+    std::string _protocol;
+    std::mutex _sendMutex;
+    std::vector<char> _out;
+    std::mt19937 _maskEngine;
+    std::atomic<uint64_t> _framesSent{0};
+    std::atomic<uint64_t> _pongs{0};
+
+    //  receiving side, used by the receiving thread only..
+    std::vector<char> _in;
+    size_t _inStart=0;
+    size_t _inEnd=0;
+    bool _inFrame=false;
+    bool _inMessage=false;
+    bool _frameFin=true;
+    uint64_t _frameRemaining=0;
+    Opcode _messageOpcode=Opcode::binary;
+    uint64_t _bytesReceived=0;
+    std::atomic<bool> _closeSent{false};
+    bool _closeReceived=false;
+    uint16_t _closeCode=0;
+    std::string _closeReason;
+    std::string _partialMessage;
+
+    static std::mt19937& randomEngine(){
+        static thread_local std::mt19937 res{std::random_device{}()};
+        return res;
+    }
+
+    static bool isControl(Opcode opcode){
+        return (uint8_t(opcode)&0x08)!=0;
+    }
+
+    bool sendClose(uint16_t code,const std::string &reason){
+        std::string payload;
+        payload+=char(code>>8);
+        payload+=char(code&0xff);
+        payload.append(reason, 0, 123);
+        return this->sendFrame(Opcode::close, payload.data(), payload.length(), true);
+    }
+
+    /**
+     *  Keeps `message` received so far for the next `receive` if it failed with a timeout.
+     */
+    void keepPartialMessage(std::string &message,long failure){
+        if(failure==-2 && _inMessage){
+            _partialMessage=std::move(message);
+        }
+        message.clear();
+    }
+
+    /**
+     *  Reads frame headers until there is payload to receive (returns 1). Returns 0 if an
+     *  empty frame ended the message, `receive` failure code otherwise.
+     */
+    long awaitPayload(Opcode &opcode,bool &final){
+        while(!_inFrame || !_frameRemaining){
+            if(_inFrame){
+                _inFrame=false;
+                if(_frameFin){
+                    _inMessage=false;
+                    opcode=_messageOpcode;
+                    final=true;
+                    return 0;
+                }
+                continue;
+            }
+            if(_closeReceived || !_connection){
+                return -1;
+            }
+            auto res=this->receiveFrameHeader();
+            if(res<0){
+                return res;
+            }
+        }
+        return 1;
+    }
+
+    /**
+     *  Reads next frame header. Control frames are handled here, data frames set up the
+     *  payload to be received. Returns 0 or `receive` failure code. Nothing is consumed
+     *  until the header (and payload of a control frame) is complete, so a timeout can be
+     *  retried.
+     */
+    long receiveFrameHeader(){
+        FrameHeader header;
+        size_t headerLength;
+        while(!(headerLength=decodeHeader(_in.data()+_inStart, _inEnd-_inStart, header))){
+            auto res=this->fill();
+            if(res<0){
+                return res;
+            }
+        }
+        if(header.masked){
+            return this->fail(1002, "websocket server sent masked frame");
+        }
+        if(isControl(header.opcode)){
+            if(header.length>125 || !header.fin){
+                return this->fail(1002, "websocket control frame is too long or fragmented");
+            }
+            while(_inEnd-_inStart<headerLength+header.length){
+                auto res=this->fill();
+                if(res<0){
+                    return res;
+                }
+            }
+            _inStart+=headerLength;
+            std::string payload(_in.data()+_inStart, size_t(header.length));
+            _inStart+=size_t(header.length);
+            return this->onControl(header.opcode, payload);
+        }
+        _inStart+=headerLength;
+        switch(header.opcode){
+            case Opcode::continuation:
+                if(!_inMessage){
+                    return this->fail(1002, "websocket continuation without a message");
+                }
+                break;
+            case Opcode::text:
+            case Opcode::binary:
+                if(_inMessage){
+                    return this->fail(1002, "websocket message interleaved with a fragmented one");
+                }
+                _messageOpcode=header.opcode;
+                _inMessage=true;
+                break;
+            default:
+                return this->fail(1002, "websocket frame with reserved opcode");
+        }
+        _inFrame=true;
+        _frameFin=header.fin;
+        _frameRemaining=header.length;
+        return 0;
+    }
+
+    long onControl(Opcode opcode,const std::string &payload){
+        switch(opcode){
+            case Opcode::ping:
+                this->sendFrame(Opcode::pong, payload.data(), payload.length(), true);
+                break;
+            case Opcode::pong:
+                ++_pongs;
+                break;
+            case Opcode::close:
+                _closeReceived=true;
+                if(payload.length()>=2){
+                    _closeCode=uint16_t((uint8_t(payload[0])<<8)|uint8_t(payload[1]));
+                    _closeReason=payload.substr(2);
+                }else{
+                    _closeCode=1005;
+                }
+                if(!_closeSent){
+                    //  echoes the code, or nothing if there was none..
+                    this->sendFrame(Opcode::close, payload.data(), std::min(payload.length(), size_t(2)), true);
+                }
+                return -1;
+            default:
+                return this->fail(1002, "websocket frame with reserved opcode");
+        }
+        return 0;
+    }
+
+    /**
+     *  Reads more bytes into `_in` keeping unread ones.
+     */
+    long fill(){
+        if(_inStart){
+            ::memmove(_in.data(), _in.data()+_inStart, _inEnd-_inStart);
+            _inEnd-=_inStart;
+            _inStart=0;
+        }
+        if(_inEnd==_in.size()){
+            _in.resize(_in.size()*2);
+        }
+        auto bytesReceived=_connection->receive(_in.data()+_inEnd, _in.size()-_inEnd, this->timeout);
+        if(bytesReceived<=0){
+            return this->onReceiveFailed(bytesReceived);
+        }
+        _inEnd+=size_t(bytesReceived);
+        return 0;
+    }
+
+    long onReceiveFailed(long bytesReceived){
+        if(bytesReceived==-2){
+            return -2;
+        }
+        _closeReceived=true;
+        _closeCode=1006;
+        return -1;
+    }
+
+    long fail(uint16_t code,const char *message){
+        std::cerr<<message<<std::endl;
+        if(!_closeSent){
+            this->sendClose(code, std::string());
+        }
+        _closeReceived=true;
+        _closeCode=code;
+        return -1;
+    }
+};
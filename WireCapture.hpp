@@ -0,0 +1,415 @@
+//
+//  WireCapture.hpp
+//  embeddedRest
+//
+//  Records the bytes requests write and read - every receive as a separate record, so
+//  chunk boundaries are kept - into a compact binary file. Requests append records to a
+//  lock-free ring, a background thread drains it to the file. `WireReplay` feeds the
+//  captured responses back through `ResponseParser` without sockets: a deterministic
+//  benchmark and regression test built from real traffic.
+//
+//      auto capture=std::make_shared<WireCapture>("/tmp/traffic.cap");
+//      request.capture(capture);
+//      ...
+//      WireReplay replay;
+//      replay.load("/tmp/traffic.cap");
+//      auto stats=replay.run(100);
+//
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cstdint>
+
+#include "ResponseParser.hpp"
+
+class WireCapture{
+public:
+    enum class Kind: uint8_t{
+        begin=1,        //  new exchange, data is the connection key
+        sent=2,         //  bytes written
+        received=3,     //  bytes of one receive, empty if peer closed the connection
+        end=4,          //  exchange finished, data is failure (1 byte) and status code (2 bytes LE)
+    };
+
+    struct Record{
+        Kind kind;
+        uint64_t exchange;
+        uint64_t time;  //  ns since the capture started
+        std::string data;
+    };
+
+    struct Stats{
+        uint64_t records=0;
+        uint64_t bytes=0;
+        uint64_t dropped=0;
+    };
+
+    /**
+     *  How often the background thread drains the ring (and whenever it gets half full).
+     *  Records which don't fit in the ring meanwhile are dropped (and counted) rather than
+     *  blocking requests.
+     */
+    std::chrono::milliseconds drainInterval{10};
+
+    /**
+     *  Opens (truncates) `path`. `ringSize` is in bytes, rounded up to a power of two.
+     */
+    WireCapture(const std::string &path,size_t ringSize=size_t(4)<<20):
+    _started(std::chrono::steady_clock::now()),
+    _file(path, std::ios::binary|std::ios::trunc)
+    {
+        size_t words=1024;
+        while(words*8<ringSize){
+            words*=2;
+        }
+        _capacity=words;
+        _ring.reset(new std::atomic<uint64_t>[words]);
+        for(size_t i=0;i<words;++i){
+            _ring[i].store(0, std::memory_order_relaxed);
+        }
+        if(!_file){
+            std::cerr<<"could not open capture file *"<<path<<"*"<<std::endl;
+            return;
+        }
+        _file.write(magic(), 8);
+        _drainThread=std::thread([this]{
+            std::unique_lock<std::mutex> lock(_stopMutex);
+            while(!_stopping){
+                _stopCondition.wait_for(lock, this->drainInterval, [this]{
+                    return _stopping || _drainRequested.load();
+                });
+                _drainRequested=false;
+                this->flush();
+            }
+        });
+    }
+
+    WireCapture(const WireCapture&)=delete;
+    WireCapture& operator=(const WireCapture&)=delete;
+
+    ~WireCapture(){
+        if(_drainThread.joinable()){
+            {
+                std::lock_guard<std::mutex> lock(_stopMutex);
+                _stopping=true;
+            }
+            _stopCondition.notify_all();
+            _drainThread.join();
+        }
+        this->flush();
+    }
+
+    bool good() const{
+        return bool(_file);
+    }
+
+    /**
+     *  Starts an exchange with `key` peer, returns its id for the following records.
+     */
+    uint64_t begin(const std::string &key){
+        auto exchange=_nextExchange++;
+        this->push(Kind::begin, exchange, key.data(), key.length());
+        return exchange;
+    }
+
+    void sent(uint64_t exchange,const char *data,size_t length){
+        this->push(Kind::sent, exchange, data, length);
+    }
+
+    void received(uint64_t exchange,const char *data,size_t length){
+        this->push(Kind::received, exchange, data, length);
+    }
+
+    void end(uint64_t exchange,uint8_t failure,int statusCode){
+        const char data[3]={char(failure), char(statusCode&0xff), char((statusCode>>8)&0xff)};
+        this->push(Kind::end, exchange, data, sizeof(data));
+    }
+
+    /**
+     *  Writes records committed so far to the file.
+     */
+    void flush(){
+        std::lock_guard<std::mutex> lock(_drainMutex);
+        auto tail=_tail.load(std::memory_order_relaxed);
+        std::string payload;
+        while(true){
+            auto header=this->word(tail).load(std::memory_order_acquire);
+            if(!header){
+                break;  //  empty or not committed yet
+            }
+            auto kind=uint8_t(header&0xff);
+            auto length=size_t(header>>8);
+            auto words=recordWords(length);
+            auto exchange=this->word(tail+1).load(std::memory_order_relaxed);
+            auto time=this->word(tail+2).load(std::memory_order_relaxed);
+            payload.resize(words*8-headerWords*8);
+            for(size_t i=headerWords;i<words;++i){
+                auto value=this->word(tail+i).load(std::memory_order_relaxed);
+                ::memcpy(&payload[(i-headerWords)*8], &value, 8);
+            }
+            //  zeroed so stale words are never taken for headers of later records..
+            for(size_t i=0;i<words;++i){
+                this->word(tail+i).store(0, std::memory_order_relaxed);
+            }
+            tail+=words;
+            _tail.store(tail, std::memory_order_release);
+            _file.put(char(kind));
+            writeVarint(_file, exchange);
+            writeVarint(_file, time);
+            writeVarint(_file, length);
+            _file.write(payload.data(), std::streamsize(length));
+            ++_records;
+            _bytes+=length;
+        }
+        _file.flush();
+    }
+
+    Stats stats() const{
+        Stats res;
+        res.records=_records.load();
+        res.bytes=_bytes.load();
+        res.dropped=_dropped.load();
+        return res;
+    }
+
+    /**
+     *  Reads capture file. Returns false if it is not a capture or is truncated (records
+     *  read before the damage are kept).
+     */
+    static bool read(const std::string &path,std::vector<Record> &records){
+        std::ifstream file(path, std::ios::binary);
+        char header[8];
+        if(!file.read(header, 8) || ::memcmp(header, magic(), 8)!=0){
+            std::cerr<<"not a capture file *"<<path<<"*"<<std::endl;
+            return false;
+        }
+        while(true){
+            auto kind=file.get();
+            if(kind==std::char_traits<char>::eof()){
+                return true;
+            }
+            Record record;
+            record.kind=Kind(kind);
+            uint64_t length=0;
+            if(!readVarint(file, record.exchange) || !readVarint(file, record.time) || !readVarint(file, length)){
+                return false;
+            }
+            record.data.resize(size_t(length));
+            if(length && !file.read(&record.data[0], std::streamsize(length))){
+                return false;
+            }
+            records.push_back(std::move(record));
+        }
+    }
+
+protected:
+    static const size_t headerWords=3;  //  length and kind, exchange, time
+
+    const std::chrono::steady_clock::time_point _started;
+    std::ofstream _file;
+    std::unique_ptr<std::atomic<uint64_t>[]> _ring;
+    size_t _capacity;   //  in words
+    std::atomic<uint64_t> _head{0};
+    std::atomic<uint64_t> _tail{0};
+    std::atomic<uint64_t> _nextExchange{1};
+    std::atomic<uint64_t> _records{0};
+    std::atomic<uint64_t> _bytes{0};
+    std::atomic<uint64_t> _dropped{0};
+    std::mutex _drainMutex;
+    std::thread _drainThread;
+    std::mutex _stopMutex;
+    std::condition_variable _stopCondition;
+    bool _stopping=false;
+    std::atomic<bool> _drainRequested{false};
+
+    static const char* magic(){
+        return "ERWCAP01";
+    }
+
+    static size_t recordWords(size_t length){
+        return headerWords+(length+7)/8;
+    }
+
+    std::atomic<uint64_t>& word(uint64_t position){
+        return _ring[position&(_capacity-1)];
+    }
+
+    /**
+     *  Reserves words with CAS on `_head`, fills them and publishes the record by storing its
+     *  header last. Never blocks: drops the record if the ring is full.
+     */
+    void push(Kind kind,uint64_t exchange,const char *data,size_t length){
+        const auto words=recordWords(length);
+        auto head=_head.load(std::memory_order_relaxed);
+        do{
+            if(words>_capacity || head+words-_tail.load(std::memory_order_acquire)>_capacity){
+                ++_dropped;
+                return;
+            }
+        }while(!_head.compare_exchange_weak(head, head+words, std::memory_order_relaxed));
+        auto time=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-_started).count();
+        this->word(head+1).store(exchange, std::memory_order_relaxed);
+        this->word(head+2).store(uint64_t(time), std::memory_order_relaxed);
+        for(size_t i=headerWords;i<words;++i){
+            uint64_t value=0;
+            auto offset=(i-headerWords)*8;
+            ::memcpy(&value, data+offset, std::min<size_t>(8, length-offset));
+            this->word(head+i).store(value, std::memory_order_relaxed);
+        }
+        this->word(head).store((uint64_t(length)<<8)|uint64_t(kind), std::memory_order_release);
+        //  half full - wake the drain thread early (no lock, notify doesn't need one)..
+        if((head+words-_tail.load(std::memory_order_relaxed))*2>_capacity && !_drainRequested.exchange(true)){
+            _stopCondition.notify_one();
+        }
+    }
+
+    static void writeVarint(std::ostream &stream,uint64_t value){
+        while(value>=0x80){
+            stream.put(char((value&0x7f)|0x80));
+            value>>=7;
+        }
+        stream.put(char(value));
+    }
+
+    static bool readVarint(std::istream &stream,uint64_t &value){
+        value=0;
+        for(auto shift=0;shift<64;shift+=7){
+            auto c=stream.get();
+            if(c==std::char_traits<char>::eof()){
+                return false;
+            }
+            value|=uint64_t(c&0x7f)<<shift;
+            if(!(c&0x80)){
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+/**
+ *  Parses captured responses again, receive by receive as they came off the socket.
+ */
+class WireReplay{
+public:
+    struct Exchange{
+        uint64_t id=0;
+        std::string key;
+        bool headRequest=false;
+        std::vector<std::string> chunks;    //  empty chunk - peer closed the connection
+        bool ended=false;
+        uint8_t failure=0;
+        int statusCode=0;
+    };
+
+    struct Stats{
+        uint64_t exchanges=0;
+        uint64_t responses=0;       //  complete ones
+        uint64_t bytes=0;
+        uint64_t chunks=0;
+        uint64_t mismatches=0;      //  outcome differs from the captured one
+        uint64_t malformed=0;       //  head couldn't be parsed, counted as incomplete
+        std::chrono::nanoseconds elapsed{0};
+    };
+
+    std::vector<Exchange> exchanges;
+
+    bool load(const std::string &path){
+        std::vector<WireCapture::Record> records;
+        auto res=WireCapture::read(path, records);
+        std::map<uint64_t,size_t> indexes;
+        for(auto &record:records){
+            auto it=indexes.find(record.exchange);
+            if(it==indexes.end()){
+                it=indexes.insert(std::make_pair(record.exchange, this->exchanges.size())).first;
+                this->exchanges.push_back(Exchange());
+                this->exchanges.back().id=record.exchange;
+            }
+            auto &exchange=this->exchanges[it->second];
+            switch(record.kind){
+                case WireCapture::Kind::begin:
+                    exchange.key=std::move(record.data);
+                    break;
+                case WireCapture::Kind::sent:
+                    if(exchange.chunks.empty() && record.data.compare(0, 5, "HEAD ")==0){
+                        exchange.headRequest=true;
+                    }
+                    break;
+                case WireCapture::Kind::received:
+                    exchange.chunks.push_back(std::move(record.data));
+                    break;
+                case WireCapture::Kind::end:
+                    if(record.data.length()>=3){
+                        exchange.ended=true;
+                        exchange.failure=uint8_t(record.data[0]);
+                        exchange.statusCode=uint8_t(record.data[1])|(uint8_t(record.data[2])<<8);
+                    }
+                    break;
+            }
+        }
+        return res;
+    }
+
+    /**
+     *  Parses every exchange `iterations` times the way `UrlRequest` does. Mismatches are
+     *  counted on the first iteration for exchanges whose end was captured.
+     */
+    Stats run(int iterations=1){
+        Stats res;
+        const auto started=std::chrono::steady_clock::now();
+        for(auto iteration=0;iteration<iterations;++iteration){
+            for(const auto &exchange:this->exchanges){
+                ResponseParser parser;
+                parser.headRequest=exchange.headRequest;
+                auto malformed=false;
+                try{
+                    for(const auto &chunk:exchange.chunks){
+                        ++res.chunks;
+                        res.bytes+=chunk.length();
+                        if(chunk.empty()){
+                            parser.finish();
+                            break;
+                        }
+                        parser.feed(chunk.data(), chunk.length());
+                        if(parser.done()){
+                            break;
+                        }
+                    }
+                }catch(const Response::IncorrectStartLineException&){
+                    //  garbage status line - exactly what captures are kept for..
+                    malformed=true;
+                    ++res.malformed;
+                }
+                ++res.exchanges;
+                auto statusCode=0;
+                if(!malformed && parser.complete()){
+                    ++res.responses;
+                    try{
+                        statusCode=parser.response().statusCode();
+                    }catch(Response::IncorrectStartLineException&){}
+                }
+                if(iteration==0 && exchange.ended){
+                    auto capturedComplete=(exchange.failure==0);
+                    auto complete=!malformed && parser.complete();
+                    if(capturedComplete!=complete || (capturedComplete && statusCode!=exchange.statusCode)){
+                        ++res.mismatches;
+                    }
+                }
+            }
+        }
+        res.elapsed=std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now()-started);
+        return res;
+    }
+};